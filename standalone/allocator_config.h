@@ -17,6 +17,8 @@
 #include "secondary.h"
 #include "size_class_map.h"
 #include "tsd_exclusive.h"
+#include "tsd_hybrid.h"
+#include "tsd_percpu.h"
 #include "tsd_shared.h"
 
 namespace scudo {
@@ -46,8 +48,8 @@ struct AndroidConfig {
   typedef SizeClassAllocator32<SizeClassMap, 19U> Primary;
 #endif
   typedef MapAllocator<> Secondary;
-  template <class A>
-  using TSDRegistryT = TSDRegistrySharedT<A, 2U>; // Shared, max 2 TSDs.
+  // Shared, 2 TSDs, up to 8 under contention.
+  template <class A> using TSDRegistryT = TSDRegistrySharedT<A, 8U, 2U>;
 };
 
 struct AndroidSvelteConfig {
@@ -68,9 +70,59 @@ struct FuchsiaConfig {
   // 1GB Regions
   typedef SizeClassAllocator64<DefaultSizeClassMap, 30U> Primary;
   typedef MapAllocator<> Secondary;
+  // Shared, 8 TSDs, up to 32 under contention.
+  template <class A> using TSDRegistryT = TSDRegistrySharedT<A, 32U, 8U>;
+};
+
+#if SCUDO_LINUX
+// Caches shared per CPU rather than exclusive to a thread, for processes with
+// many more threads than CPUs: the memory held in caches is bounded by the
+// number of CPUs, up to 64, regardless of the number of threads.
+struct PerCpuConfig {
+  using SizeClassMap = DefaultSizeClassMap;
+#if SCUDO_CAN_USE_PRIMARY64
+  // 1GB Regions
+  typedef SizeClassAllocator64<SizeClassMap, 30U> Primary;
+#else
+  // 512KB regions
+  typedef SizeClassAllocator32<SizeClassMap, 19U> Primary;
+#endif
+  typedef MapAllocator<> Secondary;
+  template <class A>
+  using TSDRegistryT = TSDRegistryPerCpuT<A, 64U>; // Per CPU, max 64 TSDs.
+};
+#endif
+
+// For processes with a few long lived threads doing most of the allocations,
+// among possibly many more: the first 64 threads get an exclusive TSD, the
+// following ones sharing up to 8 TSDs, which bounds the number of caches.
+struct HybridConfig {
+  using SizeClassMap = DefaultSizeClassMap;
+#if SCUDO_CAN_USE_PRIMARY64
+  // 1GB Regions
+  typedef SizeClassAllocator64<SizeClassMap, 30U> Primary;
+#else
+  // 512KB regions
+  typedef SizeClassAllocator32<SizeClassMap, 19U> Primary;
+#endif
+  typedef MapAllocator<> Secondary;
+  template <class A> using TSDRegistryT = TSDRegistryHybridT<A, 8U, 64U>;
+};
+
+#if SCUDO_LINUX && SCUDO_CAN_USE_PRIMARY64
+// For NUMA machines: the Primary has a set of Regions for each node, up to 4,
+// with their memory placed on it. The per CPU caches only ever hold blocks of
+// the node of their CPU, which keeps the blocks local to the threads using
+// them.
+struct NumaConfig {
+  using SizeClassMap = DefaultSizeClassMap;
+  // 1GB Regions, for each node.
+  typedef SizeClassAllocator64<SizeClassMap, 30U, false, 2U> Primary;
+  typedef MapAllocator<> Secondary;
   template <class A>
-  using TSDRegistryT = TSDRegistrySharedT<A, 8U>; // Shared, max 8 TSDs.
+  using TSDRegistryT = TSDRegistryPerCpuT<A, 64U>; // Per CPU, max 64 TSDs.
 };
+#endif
 
 #if SCUDO_ANDROID
 typedef AndroidConfig Config;
@@ -0,0 +1,88 @@
+//===-- malloc_benchmark.cpp ------------------------------------*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+
+#include "allocator_config.h"
+#include "combined.h"
+#include "common.h"
+
+#include "benchmark/benchmark.h"
+
+// The thread specific data of the exclusive TSD registry is shared by all the
+// allocators of a same type, so we use a single allocator per configuration
+// for the lifetime of the process, as it would be in production.
+template <typename Config> static scudo::Allocator<Config> *getAllocator() {
+  static scudo::Allocator<Config> Allocator;
+  return &Allocator;
+}
+
+// Measures a malloc/free pair of a given size, touching each page of the chunk.
+template <typename Config> static void BM_malloc_free(benchmark::State &State) {
+  auto *Allocator = getAllocator<Config>();
+  const scudo::uptr NBytes = static_cast<scudo::uptr>(State.range(0));
+  const scudo::uptr PageSize = scudo::getPageSizeCached();
+  for (auto _ : State) {
+    void *Ptr = Allocator->allocate(NBytes, scudo::Chunk::Origin::Malloc);
+    auto *Data = reinterpret_cast<scudo::u8 *>(Ptr);
+    for (scudo::uptr I = 0; I < NBytes; I += PageSize)
+      Data[I] = 1;
+    benchmark::DoNotOptimize(Ptr);
+    Allocator->deallocate(Ptr, scudo::Chunk::Origin::Malloc);
+  }
+  State.SetBytesProcessed(static_cast<int64_t>(State.iterations()) *
+                          static_cast<int64_t>(NBytes));
+}
+
+static const scudo::uptr MinSize = 8;
+static const scudo::uptr MaxSize = 128 * 1024;
+
+BENCHMARK_TEMPLATE(BM_malloc_free, scudo::DefaultConfig)
+    ->Range(MinSize, MaxSize);
+BENCHMARK_TEMPLATE(BM_malloc_free, scudo::AndroidConfig)
+    ->Range(MinSize, MaxSize);
+BENCHMARK_TEMPLATE(BM_malloc_free, scudo::AndroidSvelteConfig)
+    ->Range(MinSize, MaxSize);
+#if SCUDO_CAN_USE_PRIMARY64
+BENCHMARK_TEMPLATE(BM_malloc_free, scudo::FuchsiaConfig)
+    ->Range(MinSize, MaxSize);
+#endif
+#if SCUDO_LINUX
+BENCHMARK_TEMPLATE(BM_malloc_free, scudo::PerCpuConfig)
+    ->Range(MinSize, MaxSize);
+#endif
+BENCHMARK_TEMPLATE(BM_malloc_free, scudo::HybridConfig)
+    ->Range(MinSize, MaxSize);
+
+// Measures a burst of Count malloc of a given size, followed by the matching
+// free, which is representative of the allocation of a container.
+template <typename Config>
+static void BM_malloc_free_loop(benchmark::State &State) {
+  auto *Allocator = getAllocator<Config>();
+  const scudo::uptr NBytes = static_cast<scudo::uptr>(State.range(0));
+  constexpr scudo::uptr Count = 256U;
+  void *Ptrs[Count];
+  for (auto _ : State) {
+    for (void *&Ptr : Ptrs)
+      Ptr = Allocator->allocate(NBytes, scudo::Chunk::Origin::Malloc);
+    benchmark::DoNotOptimize(Ptrs);
+    for (void *Ptr : Ptrs)
+      Allocator->deallocate(Ptr, scudo::Chunk::Origin::Malloc);
+  }
+  State.SetItemsProcessed(static_cast<int64_t>(State.iterations()) *
+                          static_cast<int64_t>(Count));
+}
+
+BENCHMARK_TEMPLATE(BM_malloc_free_loop, scudo::DefaultConfig)
+    ->Range(MinSize, MinSize * 64);
+BENCHMARK_TEMPLATE(BM_malloc_free_loop, scudo::AndroidConfig)
+    ->Range(MinSize, MinSize * 64);
+#if SCUDO_LINUX
+BENCHMARK_TEMPLATE(BM_malloc_free_loop, scudo::PerCpuConfig)
+    ->Range(MinSize, MinSize * 64);
+#endif
+
+BENCHMARK_MAIN();
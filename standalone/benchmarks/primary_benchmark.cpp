@@ -0,0 +1,67 @@
+//===-- primary_benchmark.cpp -----------------------------------*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+
+#include "primary64.h"
+#include "size_class_map.h"
+
+#include "benchmark/benchmark.h"
+
+#include <utility>
+#include <vector>
+
+// As for the allocators of the malloc benchmarks, a single Primary per
+// configuration is used for the lifetime of the process, shared by the threads.
+template <typename Primary> static Primary *getPrimary() {
+  static Primary P;
+  static const bool Initialized = (P.init(/*ReleaseToOsInterval=*/-1), true);
+  (void)Initialized;
+  return &P;
+}
+
+// Measures the throughput of popBatch/pushBatch, with the threads holding on
+// to a few batches of several classes at a time, which is useful to compare
+// the flavors of free lists on a many-core machine.
+template <typename Primary>
+static void BM_primary_batches(benchmark::State &State) {
+  using TransferBatch = typename Primary::CacheT::TransferBatch;
+  Primary *Allocator = getPrimary<Primary>();
+  typename Primary::CacheT Cache;
+  Cache.init(nullptr, Allocator);
+  std::vector<std::pair<scudo::uptr, TransferBatch *>> Batches;
+  scudo::uptr I = 0;
+  for (auto _ : State) {
+    const scudo::uptr ClassId = 1U + (I++ % 4U);
+    TransferBatch *B = Allocator->popBatch(&Cache, ClassId);
+    if (B)
+      Batches.push_back(std::make_pair(ClassId, B));
+    if (Batches.size() < 8U)
+      continue;
+    while (!Batches.empty()) {
+      Allocator->pushBatch(Batches.back().first, Batches.back().second);
+      Batches.pop_back();
+    }
+  }
+  while (!Batches.empty()) {
+    Allocator->pushBatch(Batches.back().first, Batches.back().second);
+    Batches.pop_back();
+  }
+  Cache.destroy(nullptr);
+  State.SetItemsProcessed(static_cast<int64_t>(State.iterations()));
+}
+
+using SizeClassMap = scudo::DefaultSizeClassMap;
+BENCHMARK_TEMPLATE(BM_primary_batches,
+                   scudo::SizeClassAllocator64<SizeClassMap, 24U>)
+    ->ThreadRange(1, 64)
+    ->UseRealTime();
+BENCHMARK_TEMPLATE(BM_primary_batches,
+                   scudo::SizeClassAllocator64<SizeClassMap, 24U, true>)
+    ->ThreadRange(1, 64)
+    ->UseRealTime();
+
+BENCHMARK_MAIN();
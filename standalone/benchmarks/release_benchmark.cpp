@@ -0,0 +1,110 @@
+//===-- release_benchmark.cpp -----------------------------------*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+
+#include "common.h"
+#include "list.h"
+#include "release.h"
+
+#include "benchmark/benchmark.h"
+
+#include <sys/resource.h>
+
+#include <vector>
+
+struct FreeBatch {
+  static const scudo::u32 MaxCount = 64U;
+  scudo::u32 getCount() const { return Count; }
+  scudo::uptr get(scudo::u32 I) const { return Batch[I]; }
+  FreeBatch *Next;
+  scudo::u32 Count;
+  scudo::uptr Batch[MaxCount];
+};
+
+// Counts the ranges that would be released, without releasing anything, the
+// blocks of the free list not being backed by any memory.
+class CountingRecorder {
+public:
+  void releasePageRangeToOS(scudo::uptr From, scudo::uptr To) {
+    RangesCount++;
+  }
+  scudo::uptr RangesCount = 0;
+};
+
+static scudo::uptr getMinorFaults() {
+  struct rusage Usage;
+  getrusage(RUSAGE_SELF, &Usage);
+  return static_cast<scudo::uptr>(Usage.ru_minflt);
+}
+
+// Measures a release pass over a 64M region of blocks of a given size, one run
+// of blocks out of two being free. The second argument selects whether the
+// counters come from a reusable scratch buffer, or from a fresh mapping as
+// when the scratch buffer is in use. Each counters mapping costs a map and an
+// unmap syscall, which are reported per pass along with the page faults and the
+// madvise syscalls the release would issue.
+static void BM_release_free_memory(benchmark::State &State) {
+  const scudo::uptr BlockSize = static_cast<scudo::uptr>(State.range(0));
+  const bool UseScratch = State.range(1) != 0;
+  const scudo::uptr PageSize = scudo::getPageSizeCached();
+  const scudo::uptr AllocatedPagesCount = (64U << 20) / PageSize;
+  const scudo::uptr NumBlocks = AllocatedPagesCount * PageSize / BlockSize;
+
+  std::vector<FreeBatch> Batches(NumBlocks / FreeBatch::MaxCount + 1);
+  scudo::SinglyLinkedList<FreeBatch> FreeList;
+  FreeList.clear();
+  FreeBatch *Current = nullptr;
+  scudo::u32 RandState = 42;
+  bool InFreeRange = false;
+  scudo::uptr CurrentRangeEnd = 0;
+  for (scudo::uptr I = 0, B = 0; I < NumBlocks; I++) {
+    if (I == CurrentRangeEnd) {
+      InFreeRange = !InFreeRange;
+      CurrentRangeEnd += (scudo::getRandomU32(&RandState) & 0xff) + 1;
+    }
+    if (!InFreeRange)
+      continue;
+    if (!Current || Current->Count == FreeBatch::MaxCount) {
+      Current = &Batches[B++];
+      Current->Count = 0;
+      FreeList.push_back(Current);
+    }
+    Current->Batch[Current->Count++] = I * BlockSize;
+  }
+
+  scudo::PackedCounterBuffer Scratch = {};
+  // Holding on to the scratch buffer forces the releases to map their own.
+  scudo::PackedCounterBuffer Busy = {};
+  if (!UseScratch)
+    Busy.acquire(sizeof(scudo::uptr));
+  scudo::PackedCounterBuffer *Counters = UseScratch ? &Scratch : &Busy;
+  const scudo::uptr MapCount = Counters->getMapCount();
+  const scudo::uptr Faults = getMinorFaults();
+  CountingRecorder Recorder;
+  for (auto _ : State) {
+    scudo::releaseFreeMemoryToOS(FreeList, 0, AllocatedPagesCount, BlockSize,
+                                 &Recorder, Counters);
+    benchmark::ClobberMemory();
+  }
+  const double Passes = static_cast<double>(State.iterations());
+  const double Maps = static_cast<double>(Counters->getMapCount() - MapCount);
+  State.counters["syscalls"] =
+      (2 * Maps + static_cast<double>(Recorder.RangesCount)) / Passes;
+  State.counters["maps"] = Maps / Passes;
+  State.counters["faults"] =
+      static_cast<double>(getMinorFaults() - Faults) / Passes;
+  if (!UseScratch)
+    Busy.release();
+  Busy.unmapTestOnly();
+  Scratch.unmapTestOnly();
+}
+
+BENCHMARK(BM_release_free_memory)
+    ->ArgsProduct({{16, 48, 256, 4096}, {0, 1}})
+    ->ArgNames({"size", "scratch"});
+
+BENCHMARK_MAIN();
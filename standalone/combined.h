@@ -17,9 +17,12 @@
 #include "local_cache.h"
 #include "quarantine.h"
 #include "report.h"
+#include "rss_limit_checker.h"
 #include "secondary.h"
 #include "tsd.h"
 
+#include <pthread.h>
+
 namespace scudo {
 
 template <class Params> class Allocator {
@@ -33,24 +36,83 @@ public:
     explicit QuarantineCallback(ThisT &Instance, CacheT &LocalCache)
         : Allocator(Instance), Cache(LocalCache) {}
 
-    // Chunk recycling function, returns a quarantined chunk to the backend,
-    // first making sure it hasn't been tampered with.
-    void recycle(void *Ptr) {
-      Chunk::UnpackedHeader Header;
-      Chunk::loadHeader(Allocator.Cookie, Ptr, &Header);
-      if (UNLIKELY(Header.State != Chunk::State::Quarantined))
-        reportInvalidChunkState(AllocatorAction::Recycling, Ptr);
-
-      Chunk::UnpackedHeader NewHeader = Header;
-      NewHeader.State = Chunk::State::Available;
-      Chunk::compareExchangeHeader(Allocator.Cookie, Ptr, &NewHeader, &Header);
+    // Chunk recycling function, returns the quarantined chunks of a batch to
+    // the backend, first making sure they haven't been tampered with. As for
+    // deallocateBatch, the headers of a group are all prefetched, loaded and
+    // validated before being updated. The Primary blocks are then sorted in
+    // place by class and node, and each group goes to the Primary in full
+    // batches. This runs on the free() path, so nothing proportional to the
+    // size of a QuarantineBatch is kept on the stack.
+    void recycleBatch(void **Ptrs, uptr Count) {
+      constexpr uptr GroupSize = 16U;
+      constexpr uptr NumberOfPrefetch = 8U;
+      constexpr uptr NumberOfKeys = SizeClassMap::NumClasses *
+                                    PrimaryT::MaxNumaNodes;
+      DCHECK_LE(Count, QuarantineBatch::MaxCount);
+      Chunk::UnpackedHeader Headers[GroupSize];
+      u32 Starts[NumberOfKeys + 1] = {};
+      // The Primary blocks are packed at the front of the array, over the
+      // chunks already processed.
+      uptr NumberOfBlocks = 0;
+      for (uptr Start = 0; Start < Count; Start += GroupSize) {
+        void **Group = &Ptrs[Start];
+        const uptr N = Min(Count - Start, GroupSize);
+        for (uptr I = 0; I < Min(N, NumberOfPrefetch); I++)
+          PREFETCH(Group[I]);
+        for (uptr I = 0; I < N; I++) {
+          if (I + NumberOfPrefetch < N)
+            PREFETCH(Group[I + NumberOfPrefetch]);
+          Chunk::loadHeader(Allocator.Cookie, Group[I], &Headers[I]);
+          if (UNLIKELY(Headers[I].State != Chunk::State::Quarantined))
+            reportInvalidChunkState(AllocatorAction::Recycling, Group[I]);
+        }
+        for (uptr I = 0; I < N; I++) {
+          void *Ptr = Group[I];
+          Chunk::UnpackedHeader NewHeader = Headers[I];
+          NewHeader.State = Chunk::State::Available;
+          Chunk::compareExchangeHeader(Allocator.Cookie, Ptr, &NewHeader,
+                                       &Headers[I]);
+          void *BlockBegin = Allocator::getBlockBegin(Ptr, &NewHeader);
+          if (UNLIKELY(!NewHeader.ClassId)) {
+            Allocator.Secondary.deallocate(BlockBegin);
+            continue;
+          }
+          Starts[getKeyOfBlock(BlockBegin) + 1]++;
+          Ptrs[NumberOfBlocks++] = BlockBegin;
+        }
+      }
+      // In place counting sort of the blocks by key: going through the keys
+      // in order, a misplaced block is swapped into the next free slot of its
+      // own key, which can only be a later one.
+      for (uptr K = 0; K < NumberOfKeys; K++)
+        Starts[K + 1] += Starts[K];
+      DCHECK_EQ(Starts[NumberOfKeys], NumberOfBlocks);
+      u32 Ends[NumberOfKeys];
+      memcpy(Ends, Starts, sizeof(Ends));
+      for (uptr K = 0; K < NumberOfKeys; K++) {
+        while (Ends[K] < Starts[K + 1]) {
+          void *Block = Ptrs[Ends[K]];
+          const uptr Key = getKeyOfBlock(Block);
+          if (Key == K) {
+            Ends[K]++;
+            continue;
+          }
+          DCHECK_GT(Key, K);
+          Ptrs[Ends[K]] = Ptrs[Ends[Key]];
+          Ptrs[Ends[Key]++] = Block;
+        }
+        const u32 N = Starts[K + 1] - Starts[K];
+        if (N)
+          Cache.deallocateToPrimary(K % SizeClassMap::NumClasses,
+                                    &Ptrs[Starts[K]], N);
+      }
+    }
 
-      void *BlockBegin = Allocator::getBlockBegin(Ptr, &NewHeader);
-      const uptr ClassId = NewHeader.ClassId;
-      if (LIKELY(ClassId))
-        Cache.deallocate(ClassId, BlockBegin);
-      else
-        Allocator.Secondary.deallocate(BlockBegin);
+    // The key by which the Primary blocks are sorted when recycled, combining
+    // the class and the NUMA node of the Region a block belongs to.
+    uptr getKeyOfBlock(void *Block) {
+      return Allocator.Primary.getClassIdOfBlock(Block) +
+             SizeClassMap::NumClasses * Allocator.Primary.getNodeOfBlock(Block);
     }
 
     // We take a shortcut when allocating a quarantine batch by working with the
@@ -123,21 +185,39 @@ public:
     Options.ZeroContents = getFlags()->zero_contents;
     Options.DeallocTypeMismatch = getFlags()->dealloc_type_mismatch;
     Options.DeleteSizeMismatch = getFlags()->delete_size_mismatch;
-    Options.QuarantineMaxChunkSize =
-        static_cast<u32>(getFlags()->quarantine_max_chunk_size);
+    atomic_store_relaxed(
+        &Options.QuarantineMaxChunkSize,
+        static_cast<u32>(getFlags()->quarantine_max_chunk_size));
+    Options.ReleaseInBackground = getFlags()->release_to_os_in_background;
+    Options.RecycleInBackground =
+        getFlags()->quarantine_recycle_in_background;
+    RssChecker.initLinkerInitialized(getFlags()->rss_limit_mb);
+    Options.RssLimitEnabled = RssChecker.isEnabled();
+    atomic_store_relaxed(&ReleaseToOsIntervalMs,
+                         getFlags()->release_to_os_interval_ms);
 
     Stats.initLinkerInitialized();
     Primary.initLinkerInitialized(getFlags()->release_to_os_interval_ms);
-    Secondary.initLinkerInitialized(&Stats);
+    if (getFlags()->hugepages_max_size > 0)
+      Primary.setOption(Option::HugePagesMaxSize,
+                        getFlags()->hugepages_max_size);
+    Secondary.initLinkerInitialized(&Stats,
+                                    getFlags()->release_to_os_interval_ms);
 
     Quarantine.init(
         static_cast<uptr>(getFlags()->quarantine_size_kb << 10),
         static_cast<uptr>(getFlags()->thread_local_quarantine_size_kb << 10));
+    if (!SCUDO_FUCHSIA && getFlags()->quarantine_release_min_chunk_size > 0)
+      Quarantine.setReleaseMinSize(
+          static_cast<uptr>(getFlags()->quarantine_release_min_chunk_size));
   }
 
   void reset() { memset(this, 0, sizeof(*this)); }
 
   void unmapTestOnly() {
+    stopReleaseThread();
+    stopRecycleThread();
+    removeFromForkList();
     TSDRegistry.unmapTestOnly();
     Primary.unmapTestOnly();
   }
@@ -157,12 +237,74 @@ public:
     TSD->Cache.destroy(&Stats);
   }
 
-  NOINLINE void *allocate(uptr Size, Chunk::Origin Origin,
-                          uptr Alignment = MinAlignment,
-                          bool ZeroContents = false) {
+  // Moves the contents of the caches of a TSD to an unused one, eg: those of an
+  // exiting thread, to be handed over to the next one.
+  void moveCaches(TSD<ThisT> *From, TSD<ThisT> *To) {
+    To->Cache.moveFrom(&From->Cache);
+    To->QuarantineCache.transfer(&From->QuarantineCache);
+  }
+
+  // Drains the caches of a TSD: the local quarantine goes to the global one,
+  // and the cached blocks back to the Primary, where other threads can use
+  // them, or they can be released to the OS.
+  void drainCaches(TSD<ThisT> *TSD) {
+    Quarantine.drain(&TSD->QuarantineCache,
+                     QuarantineCallback(*this, TSD->Cache));
+    TSD->Cache.drain();
+  }
+
+  // Drains the caches of the calling thread, which is worth doing before it
+  // goes idle for a while.
+  void flushThreadCache() {
     initThreadMaybe();
+    bool UnlockRequired;
+    auto *TSD = TSDRegistry.getTSDAndLock(&UnlockRequired);
+    drainCaches(TSD);
+    if (UnlockRequired)
+      TSD->unlock();
+  }
+
+  // Drains the caches of the TSDs that haven't been used for a release
+  // interval, or of all the unlocked ones if the periodic release is disabled.
+  // Returns the number of TSDs drained.
+  uptr drainIdleCaches() {
+    const s32 IntervalMs = atomic_load_relaxed(&ReleaseToOsIntervalMs);
+    return TSDRegistry.drainCaches(
+        this, static_cast<u64>(Max(IntervalMs, 0)) * 1000000ULL);
+  }
+
+  // Allocations with the default alignment that can be serviced straight from
+  // the thread cache go through an inlined fast path. Everything else, as well
+  // as the options requiring some extra work on every allocation, falls back
+  // to the outlined generic path.
+  ALWAYS_INLINE void *allocate(uptr Size, Chunk::Origin Origin,
+                               uptr Alignment = MinAlignment,
+                               bool ZeroContents = false) {
+    if (LIKELY(Alignment <= MinAlignment && !ZeroContents)) {
+      void *Ptr = allocateFast(Size, Origin);
+      if (LIKELY(Ptr))
+        return Ptr;
+    }
+    return allocateSlow(Size, Origin, Alignment, ZeroContents);
+  }
+
+  NOINLINE void *allocateSlow(uptr Size, Chunk::Origin Origin, uptr Alignment,
+                              bool ZeroContents) {
+    initThreadMaybe();
+    // The background threads can't be created during the initialization as it
+    // would recurse into the allocator, so it is lazily done here instead.
+    if (UNLIKELY(backgroundThreadsPending()))
+      startBackgroundThreads();
     ZeroContents = ZeroContents || Options.ZeroContents;
 
+    // This is only ever set if the RSS limit is enabled, and is the only cost
+    // incurred by the fast path.
+    if (UNLIKELY(RssChecker.isLimitExceeded()) && checkRssLimit(0)) {
+      if (Options.MayReturnNull)
+        return nullptr;
+      reportRssLimitExceeded(RssChecker.getLimitMb());
+    }
+
     if (UNLIKELY(Alignment > MaxAlignment)) {
       if (Options.MayReturnNull)
         return nullptr;
@@ -196,11 +338,24 @@ public:
       DCHECK_NE(ClassId, 0U);
       bool UnlockRequired;
       auto *TSD = TSDRegistry.getTSDAndLock(&UnlockRequired);
+      const bool Refill =
+          UNLIKELY(Options.RssLimitEnabled) && TSD->Cache.needsRefill(ClassId);
       Block = TSD->Cache.allocate(ClassId);
       if (UnlockRequired)
         TSD->unlock();
+      // A refill is a good opportunity to account for a batch worth of blocks.
+      // The chunk is not denied, the limit will apply to the next allocations.
+      if (UNLIKELY(Refill)) {
+        const uptr Size = SizeClassMap::getSizeByClassId(ClassId);
+        checkRssLimit(CacheT::TransferBatch::getMaxCached(Size) * Size);
+      }
     } else {
       ClassId = 0;
+      if (UNLIKELY(Options.RssLimitEnabled) && checkRssLimit(NeededSize)) {
+        if (Options.MayReturnNull)
+          return nullptr;
+        reportRssLimitExceeded(RssChecker.getLimitMb());
+      }
       Block =
           Secondary.allocate(NeededSize, Alignment, &BlockEnd, ZeroContents);
     }
@@ -246,8 +401,18 @@ public:
     return Ptr;
   }
 
-  NOINLINE void deallocate(void *Ptr, Chunk::Origin Origin, uptr DeleteSize = 0,
-                           UNUSED uptr Alignment = MinAlignment) {
+  // Primary backed chunks that don't go to the quarantine are returned to the
+  // thread cache by an inlined fast path, see deallocateFast.
+  ALWAYS_INLINE void deallocate(void *Ptr, Chunk::Origin Origin,
+                                uptr DeleteSize = 0,
+                                uptr Alignment = MinAlignment) {
+    if (LIKELY(deallocateFast(Ptr, Origin, DeleteSize)))
+      return;
+    deallocateSlow(Ptr, Origin, DeleteSize, Alignment);
+  }
+
+  NOINLINE void deallocateSlow(void *Ptr, Chunk::Origin Origin, uptr DeleteSize,
+                               UNUSED uptr Alignment) {
     // For a deallocation, we only ensure minimal initialization, meaning thread
     // local data will be left uninitialized for now (when using ELF TLS). The
     // fallback cache will be used instead. This is a workaround for a situation
@@ -288,6 +453,169 @@ public:
     quarantineOrDeallocateChunk(Ptr, &Header, Size);
   }
 
+  // Allocates Count chunks of Size bytes with a malloc-type origin, stores them
+  // in Ptrs, and returns the number of chunks allocated. That number is lower
+  // than Count only if the allocator may return null. Sizes serviced by the
+  // Primary are pulled from the cache in bulk with a single lock of the TSD,
+  // others fall back to individual allocations.
+  NOINLINE uptr allocateBatch(uptr Size, uptr Count, void **Ptrs) {
+    initThreadMaybe();
+    if (UNLIKELY(backgroundThreadsPending()))
+      startBackgroundThreads();
+
+    if (UNLIKELY(RssChecker.isLimitExceeded()) && checkRssLimit(0)) {
+      if (Options.MayReturnNull)
+        return 0;
+      reportRssLimitExceeded(RssChecker.getLimitMb());
+    }
+
+    const uptr NeededSize =
+        roundUpTo(Size, MinAlignment) + Chunk::getHeaderSize();
+    if (UNLIKELY(Size >= MaxAllowedMallocSize ||
+                 !PrimaryT::canAllocate(NeededSize))) {
+      uptr I = 0;
+      for (; I < Count; I++) {
+        Ptrs[I] = allocate(Size, Chunk::Origin::Malloc);
+        if (UNLIKELY(!Ptrs[I]))
+          break;
+      }
+      return I;
+    }
+
+    const uptr ClassId = SizeClassMap::getClassIdBySize(NeededSize);
+    DCHECK_NE(ClassId, 0U);
+    const uptr ClassSize = SizeClassMap::getSizeByClassId(ClassId);
+    uptr Allocated = 0;
+    bool UnlockRequired;
+    auto *TSD = TSDRegistry.getTSDAndLock(&UnlockRequired);
+    while (Allocated < Count) {
+      const u32 N = static_cast<u32>(Min(Count - Allocated, uptr(UINT32_MAX)));
+      const u32 Obtained =
+          TSD->Cache.allocateBatch(ClassId, &Ptrs[Allocated], N);
+      Allocated += Obtained;
+      if (Obtained < N)
+        break;
+    }
+    if (UnlockRequired)
+      TSD->unlock();
+    // Over-approximates the committed bytes, as some blocks were likely already
+    // resident, but the RSS will be measured again if it matters.
+    if (UNLIKELY(Options.RssLimitEnabled))
+      checkRssLimit(Allocated * ClassSize);
+    if (UNLIKELY(Allocated < Count) && !Options.MayReturnNull)
+      reportOutOfMemory(NeededSize);
+
+    // With the minimal alignment, the user pointer always directly follows the
+    // header, and all the headers only differ by their checksum.
+    Chunk::UnpackedHeader Header = {};
+    Header.ClassId = ClassId & Chunk::ClassIdMask;
+    Header.State = Chunk::State::Allocated;
+    Header.Origin = Chunk::Origin::Malloc & Chunk::OriginMask;
+    Header.SizeOrUnusedBytes = Size & Chunk::SizeOrUnusedBytesMask;
+    const bool ZeroContents = Options.ZeroContents;
+    for (uptr I = 0; I < Allocated; I++) {
+      if (UNLIKELY(ZeroContents))
+        memset(Ptrs[I], 0, ClassSize);
+      void *Ptr = reinterpret_cast<void *>(reinterpret_cast<uptr>(Ptrs[I]) +
+                                           Chunk::getHeaderSize());
+      Chunk::storeHeader(Cookie, Ptr, &Header);
+      Ptrs[I] = Ptr;
+      if (&__scudo_allocate_hook)
+        __scudo_allocate_hook(Ptr, Size);
+    }
+    return Allocated;
+  }
+
+  // Deallocates Count chunks allocated with a malloc-type function, null
+  // pointers being ignored. The chunks are processed in groups: the headers of
+  // a group are all prefetched, loaded and validated before any chunk is
+  // deallocated, then the whole group is deallocated with a single lock of the
+  // TSD, consecutive Primary blocks of a same class going to the cache in bulk.
+  NOINLINE void deallocateBatch(void **Ptrs, uptr Count) {
+    // See deallocate() as to why only a minimal initialization is performed.
+    initThreadMaybe(/*MinimalInit=*/true);
+
+    constexpr uptr GroupSize = 64U;
+    constexpr uptr NumberOfPrefetch = 8U;
+    Chunk::UnpackedHeader Headers[GroupSize];
+    void *Blocks[GroupSize];
+    for (uptr Start = 0; Start < Count; Start += GroupSize) {
+      void **Group = &Ptrs[Start];
+      const uptr N = Min(Count - Start, GroupSize);
+      for (uptr I = 0; I < Min(N, NumberOfPrefetch); I++)
+        PREFETCH(Group[I]);
+      for (uptr I = 0; I < N; I++) {
+        if (I + NumberOfPrefetch < N)
+          PREFETCH(Group[I + NumberOfPrefetch]);
+        void *Ptr = Group[I];
+        if (&__scudo_deallocate_hook)
+          __scudo_deallocate_hook(Ptr);
+        if (UNLIKELY(!Ptr))
+          continue;
+        if (UNLIKELY(!isAligned(reinterpret_cast<uptr>(Ptr), MinAlignment)))
+          reportMisalignedPointer(AllocatorAction::Deallocating, Ptr);
+        Chunk::loadHeader(Cookie, Ptr, &Headers[I]);
+        if (UNLIKELY(Headers[I].State != Chunk::State::Allocated))
+          reportInvalidChunkState(AllocatorAction::Deallocating, Ptr);
+        if (Options.DeallocTypeMismatch &&
+            UNLIKELY(Headers[I].Origin != Chunk::Origin::Malloc &&
+                     Headers[I].Origin != Chunk::Origin::Memalign))
+          reportDeallocTypeMismatch(AllocatorAction::Deallocating, Ptr,
+                                    Headers[I].Origin, Chunk::Origin::Malloc);
+        // The pages of the chunks going to the quarantine are released before
+        // the TSD is locked.
+        const uptr Size = getSize(Ptr, &Headers[I]);
+        if (!shouldBypassQuarantine(Size))
+          Quarantine.releaseChunkPagesMaybe(Ptr, Size);
+      }
+
+      // The Secondary blocks are freed once the TSD is unlocked, not to hold
+      // it during an unmap. They are stored from the end of Blocks, which
+      // can't meet the Primary blocks as a chunk goes to either.
+      uptr NumberOfBlocks = 0;
+      uptr NumberOfSecondaryBlocks = 0;
+      uptr BlocksClassId = 0;
+      bool UnlockRequired;
+      auto *TSD = TSDRegistry.getTSDAndLock(&UnlockRequired);
+      for (uptr I = 0; I < N; I++) {
+        void *Ptr = Group[I];
+        if (UNLIKELY(!Ptr))
+          continue;
+        const uptr Size = getSize(Ptr, &Headers[I]);
+        Chunk::UnpackedHeader NewHeader = Headers[I];
+        if (!shouldBypassQuarantine(Size)) {
+          NewHeader.State = Chunk::State::Quarantined;
+          Chunk::compareExchangeHeader(Cookie, Ptr, &NewHeader, &Headers[I]);
+          Quarantine.put(&TSD->QuarantineCache,
+                         QuarantineCallback(*this, TSD->Cache), Ptr, Size);
+          continue;
+        }
+        NewHeader.State = Chunk::State::Available;
+        Chunk::compareExchangeHeader(Cookie, Ptr, &NewHeader, &Headers[I]);
+        void *BlockBegin = getBlockBegin(Ptr, &NewHeader);
+        const uptr ClassId = NewHeader.ClassId;
+        if (UNLIKELY(!ClassId)) {
+          Blocks[GroupSize - ++NumberOfSecondaryBlocks] = BlockBegin;
+          continue;
+        }
+        if (NumberOfBlocks && ClassId != BlocksClassId) {
+          TSD->Cache.deallocateBatch(BlocksClassId, Blocks,
+                                     static_cast<u32>(NumberOfBlocks));
+          NumberOfBlocks = 0;
+        }
+        BlocksClassId = ClassId;
+        Blocks[NumberOfBlocks++] = BlockBegin;
+      }
+      if (NumberOfBlocks)
+        TSD->Cache.deallocateBatch(BlocksClassId, Blocks,
+                                   static_cast<u32>(NumberOfBlocks));
+      if (UnlockRequired)
+        TSD->unlock();
+      for (uptr I = 0; I < NumberOfSecondaryBlocks; I++)
+        Secondary.deallocate(Blocks[GroupSize - 1 - I]);
+    }
+  }
+
   void *reallocate(void *OldPtr, uptr NewSize, uptr Alignment = MinAlignment) {
     initThreadMaybe();
 
@@ -343,6 +671,15 @@ public:
       }
     }
 
+    // Secondary backed chunks that remain so get their pages moved to a new
+    // mapping, rather than their contents copied.
+    if (!ClassId) {
+      void *NewPtr = reallocateSecondary(OldPtr, &OldHeader, BlockBegin,
+                                         NewSize, Alignment);
+      if (NewPtr)
+        return NewPtr;
+    }
+
     // Otherwise we allocate a new one, and deallocate the old one. Some
     // allocators will allocate an even larger chunk (by a fixed factor) to
     // allow for potential further in-place realloc. The gains of such a trick
@@ -375,12 +712,13 @@ public:
   // which might be larger than the amount of bytes provided. Note that the
   // statistics buffer is not necessarily constant between calls to this
   // function. This can be called with a null buffer or zero size for buffer
-  // sizing purposes.
+  // sizing purposes. The statistics are gathered without disabling the
+  // allocator: each counter is consistent, but they can be slightly off one
+  // another if allocations are happening concurrently.
   uptr getStats(char *Buffer, uptr Size) {
+    initThreadMaybe();
     ScopedString Str(1024);
-    disable();
     const uptr Length = getStats(&Str) + 1;
-    enable();
     if (Length < Size)
       Size = Length;
     if (Buffer && Size) {
@@ -391,14 +729,17 @@ public:
   }
 
   void printStats() {
+    initThreadMaybe();
     ScopedString Str(1024);
-    disable();
     getStats(&Str);
-    enable();
     Str.output();
   }
 
-  void releaseToOS() { Primary.releaseToOS(); }
+  void releaseToOS() {
+    drainIdleCaches();
+    Primary.releaseToOS();
+    Secondary.releaseToOS();
+  }
 
   // Iterate over all chunks and call a callback for all busy chunks located
   // within the provided memory range. Said callback must not use this allocator
@@ -425,8 +766,71 @@ public:
     return Options.MayReturnNull;
   }
 
-  // TODO(kostyak): implement this as a "backend" to mallopt.
-  bool setOption(UNUSED uptr Option, UNUSED uptr Value) { return false; }
+  // Changes an option at runtime, while other threads might be allocating.
+  // Returns false if the option or its value is not supported. Values are
+  // clamped to the range supported by the option, and negative values are
+  // rejected, except for the release interval where they disable the periodic
+  // release. Thread caches pick up a new limit on their next drain.
+  bool setOption(Option O, sptr Value) {
+    initThreadMaybe();
+    if (O == Option::ReleaseInterval) {
+      const s32 Interval = static_cast<s32>(
+          Min(Max(Value, static_cast<sptr>(-1)), static_cast<sptr>(INT32_MAX)));
+      atomic_store_relaxed(&ReleaseToOsIntervalMs, Interval);
+      Secondary.setOption(O, Interval);
+      return Primary.setOption(O, Interval);
+    }
+    if (Value < 0)
+      return false;
+    const uptr V = static_cast<uptr>(Value);
+    switch (O) {
+    case Option::QuarantineSize:
+    case Option::ThreadLocalQuarantineSize: {
+      const uptr OldSize = Quarantine.getMaxSize();
+      const uptr Size = (O == Option::QuarantineSize) ? V : OldSize;
+      const uptr CacheSize = (O == Option::ThreadLocalQuarantineSize)
+                                 ? V
+                                 : Quarantine.getCacheSize();
+      if (!Quarantine.setLimits(Size, CacheSize))
+        return false;
+      // Lowering the global limit recycles the chunks in excess of the new one
+      // right away, the shards keeping the rest. Those sitting in the thread
+      // local quarantines of other threads are only recycled on their next
+      // drain.
+      if (Size < OldSize) {
+        bool UnlockRequired;
+        auto *TSD = TSDRegistry.getTSDAndLock(&UnlockRequired);
+        Quarantine.drainToLimits(&TSD->QuarantineCache,
+                                 QuarantineCallback(*this, TSD->Cache));
+        if (UnlockRequired)
+          TSD->unlock();
+      }
+      return true;
+    }
+    case Option::QuarantineMaxChunkSize:
+      atomic_store_relaxed(&Options.QuarantineMaxChunkSize,
+                           static_cast<u32>(Min(V, uptr(UINT32_MAX))));
+      return true;
+    case Option::QuarantineReleaseMinSize:
+      // Releasing pages requires the MapPlatformData of the chunk on Fuchsia.
+      if (SCUDO_FUCHSIA)
+        return false;
+      Quarantine.setReleaseMinSize(V);
+      return true;
+    case Option::MaxCacheEntriesCount:
+    case Option::MaxCacheEntrySize:
+    case Option::MaxCacheTotalSize:
+      return Secondary.setOption(O, Value);
+    case Option::MaxThreadCacheCount:
+      return Primary.setOption(O, static_cast<sptr>(Min(V, uptr(UINT32_MAX))));
+    case Option::MaxExclusiveThreads:
+      return TSDRegistry.setOption(O, Value);
+    case Option::HugePagesMaxSize:
+      return Primary.setOption(O, Value);
+    default:
+      return false;
+    }
+  }
 
   // Return the usable size for a given chunk. Technically we lie, as we just
   // report the actual size of a chunk. This is done to counteract code actively
@@ -445,6 +849,12 @@ public:
     return getSize(Ptr, &Header);
   }
 
+  // See the Primary getClassStats.
+  uptr getPrimaryClassStats(PrimaryClassStats *Stats, uptr Size) {
+    initThreadMaybe();
+    return Primary.getClassStats(Stats, Size);
+  }
+
   void getStats(StatCounters S) {
     initThreadMaybe();
     Stats.get(S);
@@ -478,9 +888,52 @@ private:
     u8 ZeroContents : 1;        // zero_contents
     u8 DeallocTypeMismatch : 1; // dealloc_type_mismatch
     u8 DeleteSizeMismatch : 1;  // delete_size_mismatch
-    u32 QuarantineMaxChunkSize; // quarantine_max_chunk_size
+    u8 ReleaseInBackground : 1; // release_to_os_in_background
+    u8 RecycleInBackground : 1; // quarantine_recycle_in_background
+    u8 RssLimitEnabled : 1;     // rss_limit_mb
+    // Can be changed at runtime, see setOption.
+    atomic_u32 QuarantineMaxChunkSize; // quarantine_max_chunk_size
   } Options;
 
+  atomic_s32 ReleaseToOsIntervalMs;
+
+  RssLimitChecker RssChecker;
+
+  enum : u8 {
+    BackgroundThreadNotStarted = 0,
+    BackgroundThreadStarting = 1,
+    BackgroundThreadRunning = 2,
+    BackgroundThreadStopping = 3,
+  };
+
+  struct {
+    pthread_t Thread;
+    atomic_u8 State;
+    atomic_uptr Passes;
+    atomic_uptr ReleasedBytes;
+    atomic_u64 TimeSpentNs;
+  } ReleaseThread;
+
+  // The allocators that started background threads, for the fork child
+  // handler.
+  static HybridMutex ForkMutex;
+  static bool ForkHandlerRegistered;
+  static ThisT *ForkList;
+  ThisT *NextInForkList;
+  bool InForkList;
+
+  struct {
+    pthread_t Thread;
+    atomic_u8 State;
+    atomic_uptr Passes;
+    atomic_uptr RecycledChunks;
+    atomic_u64 TimeSpentNs;
+    atomic_u64 MaxPassNs;
+    // Used exclusively by the recycle thread.
+    CacheT Cache;
+    bool CacheInitialized;
+  } RecycleThread;
+
   // The following might get optimized out by the compiler.
   NOINLINE void performSanityChecks() {
     // Verify that the header offset field can hold the maximum offset. In the
@@ -536,14 +989,97 @@ private:
     TSDRegistry.initThreadMaybe(this, MinimalInit);
   }
 
+  // Returns null if the allocation can't be serviced from the thread cache as
+  // is, in which case the generic path has to be taken. Nothing is modified in
+  // that event, the hook is only called on success.
+  ALWAYS_INLINE void *allocateFast(uptr Size, Chunk::Origin Origin) {
+    // Checking Size first takes care of the overflows in NeededSize.
+    if (UNLIKELY(Size > SizeClassMap::MaxSize))
+      return nullptr;
+    const uptr NeededSize =
+        roundUpTo(Size, MinAlignment) + Chunk::getHeaderSize();
+    if (UNLIKELY(!PrimaryT::canAllocate(NeededSize)))
+      return nullptr;
+    initThreadMaybe();
+    if (UNLIKELY(Options.ZeroContents || Options.RssLimitEnabled))
+      return nullptr;
+    if (UNLIKELY(backgroundThreadsPending()))
+      return nullptr;
+
+    const uptr ClassId = SizeClassMap::getClassIdBySize(NeededSize);
+    bool UnlockRequired;
+    auto *TSD = TSDRegistry.getTSDAndLock(&UnlockRequired);
+    void *Block = nullptr;
+    if (LIKELY(!TSD->Cache.needsRefill(ClassId)))
+      Block = TSD->Cache.allocate(ClassId);
+    if (UnlockRequired)
+      TSD->unlock();
+    if (UNLIKELY(!Block))
+      return nullptr;
+
+    Chunk::UnpackedHeader Header = {};
+    Header.ClassId = ClassId & Chunk::ClassIdMask;
+    Header.State = Chunk::State::Allocated;
+    Header.Origin = Origin & Chunk::OriginMask;
+    Header.SizeOrUnusedBytes = Size & Chunk::SizeOrUnusedBytesMask;
+    void *Ptr = reinterpret_cast<void *>(reinterpret_cast<uptr>(Block) +
+                                         Chunk::getHeaderSize());
+    Chunk::storeHeader(Cookie, Ptr, &Header);
+
+    if (&__scudo_allocate_hook)
+      __scudo_allocate_hook(Ptr, Size);
+
+    return Ptr;
+  }
+
+  // Returns false if the chunk has to go through the generic path, either to
+  // be quarantined, to be returned to the Secondary, or to report an error.
+  // Nothing is modified in that event.
+  ALWAYS_INLINE bool deallocateFast(void *Ptr, Chunk::Origin Origin,
+                                    uptr DeleteSize) {
+    if (UNLIKELY(&__scudo_deallocate_hook != nullptr))
+      return false;
+    if (UNLIKELY(!Ptr || !isAligned(reinterpret_cast<uptr>(Ptr), MinAlignment)))
+      return false;
+    initThreadMaybe(/*MinimalInit=*/true);
+
+    Chunk::UnpackedHeader Header;
+    Chunk::loadHeader(Cookie, Ptr, &Header);
+    const uptr ClassId = Header.ClassId;
+    // For a Primary backed chunk, SizeOrUnusedBytes holds the size.
+    const uptr Size = Header.SizeOrUnusedBytes;
+    if (UNLIKELY(!ClassId || Header.State != Chunk::State::Allocated))
+      return false;
+    if (UNLIKELY(Header.Origin != Origin && Options.DeallocTypeMismatch))
+      return false;
+    if (UNLIKELY(DeleteSize && DeleteSize != Size))
+      return false;
+    if (UNLIKELY(!shouldBypassQuarantine(Size)))
+      return false;
+
+    Chunk::UnpackedHeader NewHeader = Header;
+    NewHeader.State = Chunk::State::Available;
+    Chunk::compareExchangeHeader(Cookie, Ptr, &NewHeader, &Header);
+    void *BlockBegin = getBlockBegin(Ptr, &NewHeader);
+    bool UnlockRequired;
+    auto *TSD = TSDRegistry.getTSDAndLock(&UnlockRequired);
+    TSD->Cache.deallocate(ClassId, BlockBegin);
+    if (UnlockRequired)
+      TSD->unlock();
+    return true;
+  }
+
+  // If the quarantine is disabled, the actual size of a chunk is 0 or larger
+  // than the maximum allowed, we return a chunk directly to the backend.
+  bool shouldBypassQuarantine(uptr Size) {
+    return !Quarantine.getCacheSize() || !Size ||
+           (Size > atomic_load_relaxed(&Options.QuarantineMaxChunkSize));
+  }
+
   void quarantineOrDeallocateChunk(void *Ptr, Chunk::UnpackedHeader *Header,
                                    uptr Size) {
     Chunk::UnpackedHeader NewHeader = *Header;
-    // If the quarantine is disabled, the actual size of a chunk is 0 or larger
-    // than the maximum allowed, we return a chunk directly to the backend.
-    const bool BypassQuarantine = !Quarantine.getCacheSize() || !Size ||
-                                  (Size > Options.QuarantineMaxChunkSize);
-    if (BypassQuarantine) {
+    if (shouldBypassQuarantine(Size)) {
       NewHeader.State = Chunk::State::Available;
       Chunk::compareExchangeHeader(Cookie, Ptr, &NewHeader, Header);
       void *BlockBegin = getBlockBegin(Ptr, &NewHeader);
@@ -560,6 +1096,7 @@ private:
     } else {
       NewHeader.State = Chunk::State::Quarantined;
       Chunk::compareExchangeHeader(Cookie, Ptr, &NewHeader, Header);
+      Quarantine.releaseChunkPagesMaybe(Ptr, Size);
       bool UnlockRequired;
       auto *TSD = TSDRegistry.getTSDAndLock(&UnlockRequired);
       Quarantine.put(&TSD->QuarantineCache,
@@ -569,6 +1106,53 @@ private:
     }
   }
 
+  // Returns null if the chunk can't be resized by the Secondary, in which case
+  // it is left untouched. The chunk keeps its offset within the block, and the
+  // block is moved by a multiple of a page, so the alignment is preserved.
+  NOINLINE void *reallocateSecondary(void *OldPtr,
+                                     Chunk::UnpackedHeader *OldHeader,
+                                     void *BlockBegin, uptr NewSize,
+                                     uptr Alignment) {
+    const uptr OldSize = getSize(OldPtr, OldHeader);
+    if (UNLIKELY(Options.RssLimitEnabled) || !shouldBypassQuarantine(OldSize))
+      return nullptr;
+    if (Alignment > getPageSizeCached() ||
+        !isAligned(reinterpret_cast<uptr>(OldPtr), Alignment))
+      return nullptr;
+    const uptr ChunkOffset =
+        reinterpret_cast<uptr>(OldPtr) - reinterpret_cast<uptr>(BlockBegin);
+    const uptr NeededSize = ChunkOffset + roundUpTo(NewSize, MinAlignment);
+    // Sizes that now belong in the Primary, or that are too large, are left to
+    // the generic path.
+    if (NewSize >= MaxAllowedMallocSize || PrimaryT::canAllocate(NeededSize))
+      return nullptr;
+
+    // Detects a concurrent use of the chunk while it is being moved.
+    Chunk::UnpackedHeader NewHeader = *OldHeader;
+    NewHeader.State = Chunk::State::Available;
+    Chunk::compareExchangeHeader(Cookie, OldPtr, &NewHeader, OldHeader);
+    uptr BlockEnd;
+    void *NewBlock = Secondary.reallocate(BlockBegin, NeededSize, &BlockEnd);
+    if (UNLIKELY(!NewBlock)) {
+      Chunk::compareExchangeHeader(Cookie, OldPtr, OldHeader, &NewHeader);
+      return nullptr;
+    }
+    if (&__scudo_deallocate_hook)
+      __scudo_deallocate_hook(OldPtr);
+
+    // The checksum depends on the address, so the header has to be rewritten.
+    const uptr NewUserPtr = reinterpret_cast<uptr>(NewBlock) + ChunkOffset;
+    void *NewPtr = reinterpret_cast<void *>(NewUserPtr);
+    NewHeader.State = Chunk::State::Allocated;
+    NewHeader.SizeOrUnusedBytes =
+        (BlockEnd - (NewUserPtr + NewSize)) & Chunk::SizeOrUnusedBytesMask;
+    Chunk::storeHeader(Cookie, NewPtr, &NewHeader);
+
+    if (&__scudo_allocate_hook)
+      __scudo_allocate_hook(NewPtr, NewSize);
+    return NewPtr;
+  }
+
   // This only cares about valid busy chunks. This might change in the future.
   uptr getChunkFromBlock(uptr Block, uptr *Size) {
     u32 Offset = 0;
@@ -589,10 +1173,256 @@ private:
     Primary.getStats(Str);
     Secondary.getStats(Str);
     Quarantine.getStats(Str);
+    TSDRegistry.getStats(Str);
+    StatCounters S;
+    Stats.get(S);
+    Str->append("Stats: LocalCache: %zu refills, %zu drains\n", S[StatRefills],
+                S[StatDrains]);
+    if (atomic_load_relaxed(&ReleaseThread.State) == BackgroundThreadRunning)
+      Str->append(
+          "Stats: ReleaseThread: %zu passes, %zuK released, %zums spent\n",
+          atomic_load_relaxed(&ReleaseThread.Passes),
+          atomic_load_relaxed(&ReleaseThread.ReleasedBytes) >> 10,
+          static_cast<uptr>(atomic_load_relaxed(&ReleaseThread.TimeSpentNs) /
+                            1000000ULL));
+    if (atomic_load_relaxed(&RecycleThread.State) ==
+        BackgroundThreadRunning) {
+      const uptr Passes = atomic_load_relaxed(&RecycleThread.Passes);
+      const u64 TimeSpentNs = atomic_load_relaxed(&RecycleThread.TimeSpentNs);
+      Str->append("Stats: RecycleThread: %zu passes, %zu chunks recycled, "
+                  "%zums spent, %zuus per pass, %zuus longest pass\n",
+                  Passes, atomic_load_relaxed(&RecycleThread.RecycledChunks),
+                  static_cast<uptr>(TimeSpentNs / 1000000ULL),
+                  Passes ? static_cast<uptr>(TimeSpentNs / Passes / 1000ULL)
+                         : 0,
+                  static_cast<uptr>(
+                      atomic_load_relaxed(&RecycleThread.MaxPassNs) / 1000ULL));
+    }
     return Str->length();
   }
+
+  // Accounts for Bytes about to be committed, updates the RSS if due, and
+  // returns whether the RSS limit is exceeded. When crossing the limit, we
+  // attempt to get back under it by releasing memory to the OS first.
+  NOINLINE bool checkRssLimit(uptr Bytes) {
+    RssChecker.addCommittedBytes(Bytes);
+    if (RssChecker.tryStartUpdate()) {
+      bool Exceeded = RssChecker.update();
+      if (Exceeded) {
+        releaseToOS();
+        Exceeded = RssChecker.update();
+      }
+      RssChecker.finishUpdate(Exceeded);
+    }
+    return RssChecker.isLimitExceeded();
+  }
+
+  bool backgroundThreadsPending() const {
+    return (Options.ReleaseInBackground &&
+            atomic_load_relaxed(&ReleaseThread.State) ==
+                BackgroundThreadNotStarted) ||
+           (Options.RecycleInBackground &&
+            atomic_load_relaxed(&RecycleThread.State) ==
+                BackgroundThreadNotStarted);
+  }
+
+  NOINLINE void startBackgroundThreads() {
+    if (Options.ReleaseInBackground)
+      startReleaseThread();
+    if (Options.RecycleInBackground)
+      startRecycleThread();
+  }
+
+  // The background threads don't survive a fork, while their state does. The
+  // allocators that start some are listed, for the child handler to reset
+  // that state, the threads being then restarted lazily as they were
+  // initially.
+  void addToForkList() {
+    ScopedLock L(ForkMutex);
+    if (!ForkHandlerRegistered) {
+      pthread_atfork(forkPrepare, forkParent, forkChild);
+      ForkHandlerRegistered = true;
+    }
+    if (InForkList)
+      return;
+    NextInForkList = ForkList;
+    ForkList = this;
+    InForkList = true;
+  }
+
+  void removeFromForkList() {
+    ScopedLock L(ForkMutex);
+    if (!InForkList)
+      return;
+    ThisT **Link = &ForkList;
+    while (*Link != this)
+      Link = &(*Link)->NextInForkList;
+    *Link = NextInForkList;
+    InForkList = false;
+  }
+
+  static void forkPrepare() { ForkMutex.lock(); }
+  static void forkParent() { ForkMutex.unlock(); }
+  static void forkChild() {
+    for (ThisT *A = ForkList; A; A = A->NextInForkList)
+      A->resetBackgroundThreads();
+    ForkMutex.unlock();
+  }
+
+  void resetBackgroundThreads() {
+    if (atomic_load_relaxed(&ReleaseThread.State) !=
+        BackgroundThreadNotStarted) {
+      Primary.setBackgroundRelease(false);
+      atomic_store_relaxed(&ReleaseThread.State, BackgroundThreadNotStarted);
+    }
+    // The cache of the recycle thread is kept, with its contents, for the next
+    // one to use.
+    if (atomic_load_relaxed(&RecycleThread.State) !=
+        BackgroundThreadNotStarted) {
+      Quarantine.setBackgroundRecycle(false);
+      atomic_store_relaxed(&RecycleThread.State, BackgroundThreadNotStarted);
+    }
+  }
+
+  NOINLINE void startReleaseThread() {
+    u8 Expected = BackgroundThreadNotStarted;
+    // Only one thread gets to create the release thread. pthread_create will
+    // likely call back into the allocator, which will then skip this.
+    if (!atomic_compare_exchange_strong(&ReleaseThread.State, &Expected,
+                                        BackgroundThreadStarting,
+                                        memory_order_acquire))
+      return;
+    addToForkList();
+    if (pthread_create(&ReleaseThread.Thread, nullptr, releaseThreadMain,
+                       this) != 0) {
+      // Leave the State as Starting, memory will keep on being released on
+      // the deallocation path.
+      return;
+    }
+    Primary.setBackgroundRelease(true);
+    atomic_store(&ReleaseThread.State, BackgroundThreadRunning,
+                 memory_order_release);
+  }
+
+  void stopReleaseThread() {
+    if (atomic_load(&ReleaseThread.State, memory_order_acquire) !=
+        BackgroundThreadRunning)
+      return;
+    atomic_store_relaxed(&ReleaseThread.State, BackgroundThreadStopping);
+    pthread_join(ReleaseThread.Thread, nullptr);
+    Primary.setBackgroundRelease(false);
+  }
+
+  static void *releaseThreadMain(void *Arg) {
+    reinterpret_cast<ThisT *>(Arg)->releaseLoop();
+    return nullptr;
+  }
+
+  // Periodically drains the caches of the idle TSDs, and releases the dirty
+  // regions of the Primary and the blocks cached by the Secondary for long
+  // enough to the OS. We sleep in small increments so that the thread can be
+  // stopped promptly, and the interval is reloaded on every iteration.
+  void releaseLoop() {
+    constexpr s32 MaxSleepMs = 100;
+    u64 LastReleaseAtNs = getMonotonicTime();
+    while (atomic_load_relaxed(&ReleaseThread.State) !=
+           BackgroundThreadStopping) {
+      const s32 IntervalMs = atomic_load_relaxed(&ReleaseToOsIntervalMs);
+      sleepMilliseconds(static_cast<uptr>(
+          (IntervalMs < 0) ? MaxSleepMs : Max(Min(IntervalMs, MaxSleepMs), 1)));
+      if (IntervalMs < 0)
+        continue;
+      const u64 StartNs = getMonotonicTime();
+      if (StartNs < LastReleaseAtNs + static_cast<u64>(IntervalMs) * 1000000ULL)
+        continue;
+      drainIdleCaches();
+      const uptr ReleasedBytes =
+          Primary.releaseDirtyRegionsToOS() + Secondary.releaseOldBlocksToOS();
+      LastReleaseAtNs = getMonotonicTime();
+      atomic_fetch_add(&ReleaseThread.Passes, 1U, memory_order_relaxed);
+      atomic_fetch_add(&ReleaseThread.ReleasedBytes, ReleasedBytes,
+                       memory_order_relaxed);
+      atomic_fetch_add(&ReleaseThread.TimeSpentNs, LastReleaseAtNs - StartNs,
+                       memory_order_relaxed);
+    }
+  }
+
+  NOINLINE void startRecycleThread() {
+    u8 Expected = BackgroundThreadNotStarted;
+    // See startReleaseThread.
+    if (!atomic_compare_exchange_strong(&RecycleThread.State, &Expected,
+                                        BackgroundThreadStarting,
+                                        memory_order_acquire))
+      return;
+    addToForkList();
+    if (!RecycleThread.CacheInitialized) {
+      initCache(&RecycleThread.Cache);
+      RecycleThread.CacheInitialized = true;
+    }
+    if (pthread_create(&RecycleThread.Thread, nullptr, recycleThreadMain,
+                       this) != 0) {
+      // Leave the State as Starting, the quarantine will keep on being
+      // recycled on the deallocation path.
+      return;
+    }
+    Quarantine.setBackgroundRecycle(true);
+    atomic_store(&RecycleThread.State, BackgroundThreadRunning,
+                 memory_order_release);
+  }
+
+  void stopRecycleThread() {
+    if (atomic_load(&RecycleThread.State, memory_order_acquire) !=
+        BackgroundThreadRunning)
+      return;
+    Quarantine.setBackgroundRecycle(false);
+    atomic_store_relaxed(&RecycleThread.State, BackgroundThreadStopping);
+    pthread_join(RecycleThread.Thread, nullptr);
+    RecycleThread.Cache.destroy(&Stats);
+    RecycleThread.CacheInitialized = false;
+  }
+
+  static void *recycleThreadMain(void *Arg) {
+    reinterpret_cast<ThisT *>(Arg)->recycleLoop();
+    return nullptr;
+  }
+
+  // Recycles the quarantine shards over their limit. The thread polls the
+  // quarantine, backing off exponentially while there is nothing to recycle.
+  void recycleLoop() {
+    constexpr uptr MinSleepMs = 1;
+    constexpr uptr MaxSleepMs = 64;
+    uptr SleepMs = MinSleepMs;
+    while (atomic_load_relaxed(&RecycleThread.State) !=
+           BackgroundThreadStopping) {
+      sleepMilliseconds(SleepMs);
+      const u64 StartNs = getMonotonicTime();
+      const uptr Recycled = Quarantine.recycleInBackground(
+          QuarantineCallback(*this, RecycleThread.Cache));
+      if (!Recycled) {
+        SleepMs = Min(SleepMs * 2, MaxSleepMs);
+        continue;
+      }
+      SleepMs = MinSleepMs;
+      // The remainders of the recycled batches, and the QuarantineBatches
+      // freed, would otherwise sit in this cache until the thread stops, as
+      // it is not a TSD that gets drained along with the others.
+      RecycleThread.Cache.drain();
+      const u64 PassNs = getMonotonicTime() - StartNs;
+      atomic_fetch_add(&RecycleThread.Passes, 1U, memory_order_relaxed);
+      atomic_fetch_add(&RecycleThread.RecycledChunks, Recycled,
+                       memory_order_relaxed);
+      atomic_fetch_add(&RecycleThread.TimeSpentNs, PassNs,
+                       memory_order_relaxed);
+      if (PassNs > atomic_load_relaxed(&RecycleThread.MaxPassNs))
+        atomic_store_relaxed(&RecycleThread.MaxPassNs, PassNs);
+    }
+  }
 };
 
+template <class Params> HybridMutex Allocator<Params>::ForkMutex;
+template <class Params> bool Allocator<Params>::ForkHandlerRegistered;
+template <class Params> Allocator<Params> *Allocator<Params>::ForkList;
+
 } // namespace scudo
 
 #endif // SCUDO_COMBINED_H_
@@ -128,20 +128,57 @@ INLINE uptr getPageSizeCached() {
 
 u32 getNumberOfCPUs();
 
+// Returns the index of the CPU the calling thread is running on, which is only
+// a hint as the thread can migrate at any time, or 0 if it can't be determined.
+u32 getCurrentCPU();
+
+// Fills NodeOfCPU, of MaxCPUs entries, with the platform id of the NUMA node of
+// each CPU, or UnknownNumaNode for the CPUs not found on any node, and returns
+// the number of nodes found.
+constexpr u8 UnknownNumaNode = 0xff;
+u32 getNumaTopology(u8 *NodeOfCPU, u32 MaxCPUs);
+
+// Hints the platform to back the pages of a mapping with the memory of a NUMA
+// node. The pages already faulted in are not moved.
+void setPreferredNumaNode(void *Addr, uptr Size, u32 Node);
+
 const char *getEnv(const char *Name);
 
 u64 getMonotonicTime();
 
+void sleepMilliseconds(uptr Milliseconds);
+
+// Returns the resident set size of the process in bytes, or 0 if it can't be
+// determined.
+uptr getRSS();
+
 // Our randomness gathering function is limited to 256 bytes to ensure we get
 // as many bytes as requested, and avoid interruptions (on Linux).
 constexpr uptr MaxRandomLength = 256U;
 bool getRandom(void *Buffer, uptr Length, bool Blocking = false);
 
+// Options that can be changed at runtime, see Allocator::setOption.
+enum class Option : u8 {
+  ReleaseInterval,           // Release to OS interval in milliseconds.
+  QuarantineSize,            // Global quarantine size in bytes.
+  ThreadLocalQuarantineSize, // Thread local quarantine size in bytes.
+  QuarantineMaxChunkSize,    // Size of the largest chunk to quarantine.
+  MaxCacheEntriesCount,      // Number of blocks cached by the Secondary.
+  MaxCacheEntrySize,         // Size of the largest block cached by Secondary.
+  MaxCacheTotalSize,         // Total size of the blocks cached by Secondary.
+  MaxThreadCacheCount,       // Number of blocks cached per class by a thread.
+  MaxExclusiveThreads,       // Number of threads with an exclusive TSD.
+  HugePagesMaxSize,          // Size of the largest block on huge pages.
+  QuarantineReleaseMinSize,  // Size of the smallest quarantined chunk to have
+                             // its pages released.
+};
+
 // Platform memory mapping functions.
 
 #define MAP_ALLOWNOMEM (1U << 0)
 #define MAP_NOACCESS (1U << 1)
 #define MAP_RESIZABLE (1U << 2)
+#define MAP_HUGEPAGES (1U << 3)
 
 // Our platform memory mapping use is restricted to 3 scenarios:
 // - reserve memory at a random address (MAP_NOACCESS);
@@ -150,6 +187,8 @@ bool getRandom(void *Buffer, uptr Length, bool Blocking = false);
 // As such, only a subset of parameters combinations is valid, which is checked
 // by the function implementation. The Data parameter allows to pass opaque
 // platform specific data to the function.
+// When committing, MAP_HUGEPAGES hints the platform to back the memory with
+// huge pages, where the range allows for it.
 // Returns nullptr on error or dies if MAP_ALLOWNOMEM is not specified.
 void *map(void *Addr, uptr Size, const char *Name, uptr Flags = 0,
           MapPlatformData *Data = nullptr);
@@ -164,6 +203,30 @@ void unmap(void *Addr, uptr Size, uptr Flags = 0,
 void releasePagesToOS(uptr BaseAddress, uptr Offset, uptr Size,
                       MapPlatformData *Data = nullptr);
 
+// Moves the pages of the Size bytes of committed memory at Addr to NewAddr,
+// which must be a range of NewSize bytes previously reserved with map. If the
+// mapping grows, the new pages are zeroed. Returns false if the platform
+// doesn't support it, or if it failed, in which case nothing has changed.
+bool remap(void *Addr, uptr Size, void *NewAddr, uptr NewSize,
+           const char *Name, MapPlatformData *Data = nullptr);
+
+// Returns the amount of resident bytes in the range. On platforms where this
+// can't be queried per page (Fuchsia), the whole mapping described by Data is
+// accounted for, and the range is expected to cover all of it.
+uptr getResidentBytes(uptr BaseAddress, uptr Offset, uptr Size,
+                      MapPlatformData *Data = nullptr);
+
+// Returns the size of the huge pages MAP_HUGEPAGES can back memory with, or 0
+// if the platform doesn't support it, or has it disabled.
+uptr getHugePageSize();
+
+// Fills Bytes with the amount of bytes backed by huge pages in each of the
+// Count ranges [Begs[I], Ends[I]), which must be sorted and disjoint, in a
+// single pass over the mappings of the process. This is slow, and only meant
+// for statistics.
+void getHugePageBytes(const uptr *Begs, const uptr *Ends, uptr Count,
+                      uptr *Bytes);
+
 // Internal map & unmap fatal error. This must not call map().
 void NORETURN dieOnMapUnmapError(bool OutOfMemory = false);
 
@@ -145,6 +145,32 @@ void releasePagesToOS(UNUSED uptr BaseAddress, uptr Offset, uptr Size,
   CHECK_EQ(Status, ZX_OK);
 }
 
+// Moving pages between mappings is not supported, the Secondary falls back to
+// copying the contents of the chunk to a new block.
+bool remap(UNUSED void *Addr, UNUSED uptr Size, UNUSED void *NewAddr,
+           UNUSED uptr NewSize, UNUSED const char *Name,
+           UNUSED MapPlatformData *Data) {
+  return false;
+}
+
+uptr getResidentBytes(UNUSED uptr BaseAddress, UNUSED uptr Offset,
+                      UNUSED uptr Size, MapPlatformData *Data) {
+  if (!Data || Data->Vmo == ZX_HANDLE_INVALID)
+    return 0;
+  zx_info_vmo_t Info;
+  if (_zx_object_get_info(Data->Vmo, ZX_INFO_VMO, &Info, sizeof(Info), nullptr,
+                          nullptr) != ZX_OK)
+    return 0;
+  return Info.committed_bytes;
+}
+
+uptr getHugePageSize() { return 0U; }
+
+void getHugePageBytes(UNUSED const uptr *Begs, UNUSED const uptr *Ends,
+                      uptr Count, uptr *Bytes) {
+  memset(Bytes, 0, Count * sizeof(*Bytes));
+}
+
 const char *getEnv(const char *Name) { return getenv(Name); }
 
 // Note: we need to flag these methods with __TA_NO_THREAD_SAFETY_ANALYSIS
@@ -168,8 +194,31 @@ void HybridMutex::unlock() __TA_NO_THREAD_SAFETY_ANALYSIS {
 
 u64 getMonotonicTime() { return _zx_clock_get_monotonic(); }
 
+void sleepMilliseconds(uptr Milliseconds) {
+  _zx_nanosleep(_zx_deadline_after(ZX_MSEC(Milliseconds)));
+}
+
+uptr getRSS() {
+  zx_info_task_stats_t Info;
+  if (_zx_object_get_info(_zx_process_self(), ZX_INFO_TASK_STATS, &Info,
+                          sizeof(Info), nullptr, nullptr) != ZX_OK)
+    return 0;
+  return Info.mem_private_bytes + Info.mem_shared_bytes;
+}
+
 u32 getNumberOfCPUs() { return _zx_system_get_num_cpus(); }
 
+// There is no way to query the current CPU on Fuchsia.
+u32 getCurrentCPU() { return 0U; }
+
+u32 getNumaTopology(u8 *NodeOfCPU, u32 MaxCPUs) {
+  memset(NodeOfCPU, UnknownNumaNode, MaxCPUs);
+  return 0;
+}
+
+void setPreferredNumaNode(UNUSED void *Addr, UNUSED uptr Size,
+                          UNUSED u32 Node) {}
+
 bool getRandom(void *Buffer, uptr Length, UNUSED bool Blocking) {
   COMPILER_CHECK(MaxRandomLength <= ZX_CPRNG_DRAW_MAX_LEN);
   if (UNLIKELY(!Buffer || !Length || Length > MaxRandomLength))
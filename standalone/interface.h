@@ -22,6 +22,18 @@ WEAK INTERFACE void __scudo_deallocate_hook(void *ptr);
 
 WEAK INTERFACE void __scudo_print_stats(void);
 
+// Returns the blocks cached by the calling thread to the allocator, where
+// other threads can use them. To be called by a thread about to go idle.
+WEAK INTERFACE void __scudo_thread_cache_flush(void);
+
+// Allocates count chunks of size bytes, stored in ptrs, and returns the number
+// of chunks allocated. If that number is lower than count, errno is set. The
+// chunks can be freed individually, or together with __scudo_free_batch.
+// Not provided by Bionic, where the MallocDispatch has no batch entry points.
+WEAK INTERFACE size_t __scudo_malloc_batch(size_t size, size_t count,
+                                           void **ptrs);
+WEAK INTERFACE void __scudo_free_batch(void **ptrs, size_t count);
+
 typedef void (*iterate_callback)(uintptr_t base, size_t size, void *arg);
 
 } // extern "C"
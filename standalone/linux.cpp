@@ -65,6 +65,11 @@ void *map(void *Addr, uptr Size, UNUSED const char *Name, uptr Flags,
 #if SCUDO_ANDROID
   if (!(Flags & MAP_NOACCESS))
     prctl(ANDROID_PR_SET_VMA, ANDROID_PR_SET_VMA_ANON_NAME, P, Size, Name);
+#endif
+#ifdef MADV_HUGEPAGE
+  // This is only a hint, failing is not an issue.
+  if (Flags & MAP_HUGEPAGES)
+    madvise(P, Size, MADV_HUGEPAGE);
 #endif
   return P;
 }
@@ -82,6 +87,145 @@ void releasePagesToOS(uptr BaseAddress, uptr Offset, uptr Size,
   }
 }
 
+bool remap(void *Addr, uptr Size, void *NewAddr, uptr NewSize,
+           UNUSED const char *Name, UNUSED MapPlatformData *Data) {
+  void *P = mremap(Addr, Size, NewSize, MREMAP_MAYMOVE | MREMAP_FIXED, NewAddr);
+  if (P == MAP_FAILED)
+    return false;
+  DCHECK_EQ(P, NewAddr);
+#if SCUDO_ANDROID
+  prctl(ANDROID_PR_SET_VMA, ANDROID_PR_SET_VMA_ANON_NAME, P, NewSize, Name);
+#endif
+  return true;
+}
+
+uptr getResidentBytes(uptr BaseAddress, uptr Offset, uptr Size,
+                      UNUSED MapPlatformData *Data) {
+  const uptr PageSize = getPageSizeCached();
+  // mincore fills a byte per page, the least significant bit of which is set
+  // if the page is resident. We process the range in chunks of VectorSize
+  // pages, and count the resident pages 8 at a time.
+  constexpr uptr VectorSize = 4096U;
+  u64 Vector[VectorSize / sizeof(u64)];
+  uptr ResidentPages = 0;
+  uptr Addr = BaseAddress + Offset;
+  const uptr End = Addr + roundUpTo(Size, PageSize);
+  while (Addr < End) {
+    const uptr Pages = Min((End - Addr) / PageSize, VectorSize);
+    if (mincore(reinterpret_cast<void *>(Addr), Pages * PageSize,
+                reinterpret_cast<unsigned char *>(Vector)) != 0)
+      break;
+    // Clear the stale bytes past the last page of the chunk.
+    const uptr Words = roundUpTo(Pages, sizeof(u64)) / sizeof(u64);
+    memset(reinterpret_cast<unsigned char *>(Vector) + Pages, 0,
+           Words * sizeof(u64) - Pages);
+    for (uptr I = 0; I < Words; I++)
+      ResidentPages += static_cast<uptr>(
+          __builtin_popcountll(Vector[I] & 0x0101010101010101ULL));
+    Addr += Pages * PageSize;
+  }
+  return ResidentPages * PageSize;
+}
+
+namespace {
+
+uptr parseNumber(const char **P, uptr Base) {
+  uptr Value = 0;
+  for (;; (*P)++) {
+    const char C = **P;
+    uptr Digit;
+    if (C >= '0' && C <= '9')
+      Digit = static_cast<uptr>(C - '0');
+    else if (Base == 16 && C >= 'a' && C <= 'f')
+      Digit = static_cast<uptr>(C - 'a' + 10);
+    else
+      return Value;
+    Value = Value * Base + Digit;
+  }
+}
+
+// Reads a small file holding a line of text, returns false on failure.
+bool readFileLine(const char *Path, char *Buffer, uptr Size) {
+  const int FileDesc = open(Path, O_RDONLY);
+  if (FileDesc == -1)
+    return false;
+  const ssize_t ReadBytes = read(FileDesc, Buffer, Size - 1);
+  close(FileDesc);
+  if (ReadBytes <= 0)
+    return false;
+  Buffer[ReadBytes] = '\0';
+  return true;
+}
+
+} // namespace
+
+// Transparent huge pages can be used with madvise, unless they are disabled,
+// which /sys/kernel/mm/transparent_hugepage/enabled shows as "[never]".
+uptr getHugePageSize() {
+  char Buffer[64];
+  if (!readFileLine("/sys/kernel/mm/transparent_hugepage/enabled", Buffer,
+                    sizeof(Buffer)) ||
+      strstr(Buffer, "[never]"))
+    return 0U;
+  if (!readFileLine("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size",
+                    Buffer, sizeof(Buffer)))
+    return 0U;
+  const char *P = Buffer;
+  const uptr Size = parseNumber(&P, 10);
+  return isPowerOfTwo(Size) ? Size : 0U;
+}
+
+// /proc/self/smaps lists the mappings as a "<begin>-<end> ..." header line,
+// followed by field lines, AnonHugePages being the one of interest. Mappings
+// that only partially overlap a range are accounted for entirely. As both the
+// mappings and the ranges are sorted, the ranges overlapping the current
+// mapping are [First, Last).
+void getHugePageBytes(const uptr *Begs, const uptr *Ends, uptr Count,
+                      uptr *Bytes) {
+  memset(Bytes, 0, Count * sizeof(*Bytes));
+  const int FileDesc = open("/proc/self/smaps", O_RDONLY);
+  if (FileDesc == -1)
+    return;
+  uptr First = 0;
+  uptr Last = 0;
+  char Buffer[4096];
+  // Lines are truncated, which doesn't affect the fields we parse.
+  char Line[128];
+  uptr LineLength = 0;
+  ssize_t ReadBytes;
+  while ((ReadBytes = read(FileDesc, Buffer, sizeof(Buffer))) > 0) {
+    for (ssize_t I = 0; I < ReadBytes; I++) {
+      if (Buffer[I] != '\n') {
+        if (LineLength < sizeof(Line) - 1)
+          Line[LineLength++] = Buffer[I];
+        continue;
+      }
+      Line[LineLength] = '\0';
+      LineLength = 0;
+      const char *P = Line;
+      const uptr MappingBeg = parseNumber(&P, 16);
+      if (P != Line && *P == '-') {
+        P++;
+        const uptr MappingEnd = parseNumber(&P, 16);
+        while (First < Count && Ends[First] <= MappingBeg)
+          First++;
+        for (Last = First; Last < Count && Begs[Last] < MappingEnd; Last++) {
+        }
+        continue;
+      }
+      constexpr char Field[] = "AnonHugePages:";
+      if (First == Last || strncmp(Line, Field, sizeof(Field) - 1) != 0)
+        continue;
+      for (P = Line + sizeof(Field) - 1; *P == ' '; P++) {
+      }
+      const uptr HugePageBytes = parseNumber(&P, 10) << 10; // In kB.
+      for (uptr I = First; I < Last; I++)
+        Bytes[I] += HugePageBytes;
+    }
+  }
+  close(FileDesc);
+}
+
 // Calling getenv should be fine (c)(tm) at any time.
 const char *getEnv(const char *Name) { return getenv(Name); }
 
@@ -122,12 +266,97 @@ u64 getMonotonicTime() {
          static_cast<u64>(TS.tv_nsec);
 }
 
+void sleepMilliseconds(uptr Milliseconds) {
+  timespec TS;
+  TS.tv_sec = static_cast<time_t>(Milliseconds / 1000);
+  TS.tv_nsec = static_cast<long>(Milliseconds % 1000) * 1000000L;
+  nanosleep(&TS, nullptr);
+}
+
+uptr getRSS() {
+  // The second field of /proc/self/statm is the number of resident pages. We
+  // do not use any of the libc stream functions as they would allocate.
+  char Buffer[64];
+  const int FileDesc = open("/proc/self/statm", O_RDONLY);
+  if (FileDesc == -1)
+    return 0;
+  const ssize_t ReadBytes = read(FileDesc, Buffer, sizeof(Buffer) - 1);
+  close(FileDesc);
+  if (ReadBytes <= 0)
+    return 0;
+  Buffer[ReadBytes] = '\0';
+  const char *P = Buffer;
+  while (*P && *P != ' ')
+    P++;
+  while (*P == ' ')
+    P++;
+  uptr Pages = 0;
+  for (; *P >= '0' && *P <= '9'; P++)
+    Pages = Pages * 10 + static_cast<uptr>(*P - '0');
+  return Pages * getPageSizeCached();
+}
+
 u32 getNumberOfCPUs() {
   cpu_set_t CPUs;
   CHECK_EQ(sched_getaffinity(0, sizeof(cpu_set_t), &CPUs), 0);
   return static_cast<u32>(CPU_COUNT(&CPUs));
 }
 
+u32 getCurrentCPU() {
+  const int CPU = sched_getcpu();
+  return CPU < 0 ? 0U : static_cast<u32>(CPU);
+}
+
+// The CPUs of a node are listed in /sys/devices/system/node/node<N>/cpulist as
+// comma separated ranges, eg: "0-3,8-11".
+u32 getNumaTopology(u8 *NodeOfCPU, u32 MaxCPUs) {
+  constexpr u32 MaxNodes = 64U;
+  memset(NodeOfCPU, UnknownNumaNode, MaxCPUs);
+  u32 NumberOfNodes = 0;
+  for (u32 Node = 0; Node < MaxNodes; Node++) {
+    char Path[64] = "/sys/devices/system/node/node";
+    uptr Length = strlen(Path);
+    if (Node >= 10)
+      Path[Length++] = static_cast<char>('0' + Node / 10);
+    Path[Length++] = static_cast<char>('0' + Node % 10);
+    memcpy(&Path[Length], "/cpulist", sizeof("/cpulist"));
+    const int FileDesc = open(Path, O_RDONLY);
+    if (FileDesc == -1)
+      continue;
+    char Buffer[256];
+    const ssize_t ReadBytes = read(FileDesc, Buffer, sizeof(Buffer) - 1);
+    close(FileDesc);
+    if (ReadBytes <= 0)
+      continue;
+    Buffer[ReadBytes] = '\0';
+    NumberOfNodes++;
+    for (const char *P = Buffer; *P >= '0' && *P <= '9';) {
+      u32 First = 0;
+      for (; *P >= '0' && *P <= '9'; P++)
+        First = First * 10 + static_cast<u32>(*P - '0');
+      u32 Last = First;
+      if (*P == '-') {
+        Last = 0;
+        for (P++; *P >= '0' && *P <= '9'; P++)
+          Last = Last * 10 + static_cast<u32>(*P - '0');
+      }
+      for (u32 CPU = First; CPU <= Last && CPU < MaxCPUs; CPU++)
+        NodeOfCPU[CPU] = static_cast<u8>(Node);
+      if (*P == ',')
+        P++;
+    }
+  }
+  return NumberOfNodes;
+}
+
+void setPreferredNumaNode(void *Addr, uptr Size, u32 Node) {
+  constexpr int MpolPreferred = 1; // MPOL_PREFERRED
+  unsigned long NodeMask = 1UL << Node;
+  // Failing is not an issue, the pages will just end up on any node.
+  syscall(SYS_mbind, Addr, Size, MpolPreferred, &NodeMask,
+          sizeof(NodeMask) * 8, 0);
+}
+
 // Blocking is possibly unused if the getrandom block is not compiled in.
 bool getRandom(void *Buffer, uptr Length, UNUSED bool Blocking) {
   if (!Buffer || !Length || Length > MaxRandomLength)
@@ -93,8 +93,8 @@ template <class SizeClassAllocator> struct SizeClassAllocatorLocalCache {
     // We still have to initialize the cache in the event that the first heap
     // operation in a thread is a deallocation.
     initCacheMaybe(C);
-    if (C->Count == C->MaxCount)
-      drain(C, ClassId);
+    if (UNLIKELY(C->Count >= C->MaxCount))
+      makeRoom(C, ClassId);
     // See comment in allocate() about memory accesses.
     const uptr ClassSize = C->ClassSize;
     C->Chunks[C->Count++] = P;
@@ -102,6 +102,48 @@ template <class SizeClassAllocator> struct SizeClassAllocatorLocalCache {
     Stats.add(StatFree, ClassSize);
   }
 
+  // Bulk versions of the above, copying the blocks in and out of the cache
+  // array directly, and only accounting for the stats once. allocateBatch
+  // returns the number of blocks obtained, which is lower than N only if the
+  // Primary ran out of memory.
+  u32 allocateBatch(uptr ClassId, void **Array, u32 N) {
+    DCHECK_LT(ClassId, NumClasses);
+    PerClass *C = &PerClassArray[ClassId];
+    u32 Allocated = 0;
+    while (Allocated < N) {
+      if (C->Count == 0 && UNLIKELY(!refill(C, ClassId)))
+        break;
+      const u32 Count = Min(N - Allocated, C->Count);
+      C->Count -= Count;
+      memcpy(&Array[Allocated], &C->Chunks[C->Count], sizeof(void *) * Count);
+      Allocated += Count;
+    }
+    if (Allocated) {
+      const uptr Bytes = Allocated * C->ClassSize;
+      Stats.add(StatAllocated, Bytes);
+      Stats.sub(StatFree, Bytes);
+    }
+    return Allocated;
+  }
+
+  void deallocateBatch(uptr ClassId, void **Array, u32 N) {
+    CHECK_LT(ClassId, NumClasses);
+    PerClass *C = &PerClassArray[ClassId];
+    initCacheMaybe(C);
+    u32 Deallocated = 0;
+    while (Deallocated < N) {
+      if (C->Count >= C->MaxCount)
+        makeRoom(C, ClassId);
+      const u32 Count = Min(N - Deallocated, C->MaxCount - C->Count);
+      memcpy(&C->Chunks[C->Count], &Array[Deallocated], sizeof(void *) * Count);
+      C->Count += Count;
+      Deallocated += Count;
+    }
+    const uptr Bytes = N * C->ClassSize;
+    Stats.sub(StatAllocated, Bytes);
+    Stats.add(StatFree, Bytes);
+  }
+
   void drain() {
     for (uptr I = 0; I < NumClasses; I++) {
       PerClass *C = &PerClassArray[I];
@@ -110,6 +152,52 @@ template <class SizeClassAllocator> struct SizeClassAllocatorLocalCache {
     }
   }
 
+  // Takes over the cached blocks, and the sizing, of From, which is left empty
+  // and uninitialized. This cache must not have been used yet. The stats stay
+  // as they are, the blocks are free either way.
+  void moveFrom(SizeClassAllocatorLocalCache *From) {
+    DCHECK_EQ(MaxCapacityBytes, 0U);
+    for (uptr I = 0; I < NumClasses; I++) {
+      PerClass *C = &PerClassArray[I];
+      PerClass *F = &From->PerClassArray[I];
+      memcpy(C, F, offsetof(PerClass, Chunks));
+      memcpy(C->Chunks, F->Chunks, F->Count * sizeof(C->Chunks[0]));
+      memset(F, 0, offsetof(PerClass, Chunks));
+    }
+    CapacityBytes = From->CapacityBytes;
+    MaxCapacityBytes = From->MaxCapacityBytes;
+    EventsSinceSweep = From->EventsSinceSweep;
+    From->CapacityBytes = From->MaxCapacityBytes = 0;
+    From->EventsSinceSweep = 0;
+  }
+
+  // Returns blocks straight to the Primary, in full TransferBatches, for the
+  // blocks that are unlikely to be reused soon by this thread, eg: the ones
+  // recycled from the quarantine. Only the remainder goes through the array of
+  // the class. With a NUMA aware Primary, the blocks must all be of one node.
+  void deallocateToPrimary(uptr ClassId, void **Array, u32 N) {
+    CHECK_LT(ClassId, NumClasses);
+    PerClass *C = &PerClassArray[ClassId];
+    initCacheMaybe(C);
+    const u32 MaxCached = TransferBatch::getMaxCached(C->ClassSize);
+    u32 Pushed = 0;
+    for (; N - Pushed >= MaxCached; Pushed += MaxCached) {
+      TransferBatch *B = createBatch(ClassId, Array[Pushed]);
+      if (UNLIKELY(!B))
+        reportOutOfMemory(
+            SizeClassAllocator::getSizeByClassId(SizeClassMap::BatchClassId));
+      B->setFromArray(&Array[Pushed], MaxCached);
+      Allocator->pushBatch(ClassId, B);
+    }
+    if (Pushed) {
+      const uptr Bytes = Pushed * C->ClassSize;
+      Stats.sub(StatAllocated, Bytes);
+      Stats.add(StatFree, Bytes);
+    }
+    if (N - Pushed)
+      deallocateBatch(ClassId, &Array[Pushed], N - Pushed);
+  }
+
   TransferBatch *createBatch(uptr ClassId, void *B) {
     if (ClassId != SizeClassMap::BatchClassId)
       B = allocate(SizeClassMap::BatchClassId);
@@ -118,17 +206,42 @@ template <class SizeClassAllocator> struct SizeClassAllocatorLocalCache {
 
   LocalStats &getStats() { return Stats; }
 
+  // Whether the next allocation for ClassId will have to refill the cache.
+  bool needsRefill(uptr ClassId) const {
+    DCHECK_LT(ClassId, NumClasses);
+    return PerClassArray[ClassId].Count == 0;
+  }
+
 private:
   static const uptr NumClasses = SizeClassMap::NumClasses;
+  // The capacity of the cache of a class adapts to its usage: it doubles after
+  // a few round-trips between an empty and a full cache, and is halved when
+  // the class was idle for a period, that period being measured in slow path
+  // events of the whole cache. It never goes below a full TransferBatch, so
+  // that the batches exchanged with the Primary stay full. The total capacity
+  // never exceeds the one of the initial, static, sizing, which is what bounds
+  // the bytes held per thread.
+  static const u32 MaxCountLimit = 2 * TransferBatch::MaxNumCached;
+  static const u16 RoundTripsToGrow = 4U;
+  static const u32 EventsPerSweep = 256U;
+  enum : u8 { NoEvent = 0, RefillEvent, DrainEvent };
   struct PerClass {
     u32 Count;
     u32 MaxCount;
     uptr ClassSize;
-    void *Chunks[2 * TransferBatch::MaxNumCached];
+    // Only used on the slow paths.
+    u32 CountAtSweep;
+    u16 RoundTrips;
+    u8 LastEvent;
+    bool Active;
+    void *Chunks[MaxCountLimit];
   };
   PerClass PerClassArray[NumClasses];
   LocalStats Stats;
   SizeClassAllocator *Allocator;
+  uptr CapacityBytes;
+  uptr MaxCapacityBytes;
+  u32 EventsSinceSweep;
 
   ALWAYS_INLINE void initCacheMaybe(PerClass *C) {
     if (LIKELY(C->MaxCount))
@@ -141,8 +254,83 @@ private:
     for (uptr I = 0; I < NumClasses; I++) {
       PerClass *P = &PerClassArray[I];
       const uptr Size = SizeClassAllocator::getSizeByClassId(I);
-      P->MaxCount = 2 * TransferBatch::getMaxCached(Size);
+      const u32 MaxCount = 2 * TransferBatch::getMaxCached(Size);
+      P->MaxCount = Min(MaxCount, getMaxCountLimit());
       P->ClassSize = Size;
+      MaxCapacityBytes += MaxCount * Size;
+      CapacityBytes += P->MaxCount * Size;
+    }
+  }
+
+  // A limit set at runtime can lower the maximum, below a full batch, down to
+  // 2 blocks.
+  u32 getMaxCountLimit() const {
+    const u32 Limit = Allocator->getMaxThreadCacheCount();
+    return Limit ? Max(2U, Min(MaxCountLimit, Limit)) : MaxCountLimit;
+  }
+
+  void setMaxCount(PerClass *C, u32 MaxCount) {
+    CapacityBytes -= C->MaxCount * C->ClassSize;
+    CapacityBytes += MaxCount * C->ClassSize;
+    C->MaxCount = MaxCount;
+  }
+
+  // Drains half of the cache, in full batches, or more if the limit was
+  // lowered at runtime, making Count larger than MaxCount.
+  NOINLINE void makeRoom(PerClass *C, uptr ClassId) {
+    noteEvent(C, ClassId, DrainEvent);
+    do
+      drain(C, ClassId);
+    while (C->Count > C->MaxCount / 2);
+  }
+
+  void noteEvent(PerClass *C, uptr ClassId, u8 Event) {
+    Stats.add(Event == RefillEvent ? StatRefills : StatDrains, 1U);
+    // Blocks of the batch class are only used internally.
+    if (ClassId == SizeClassMap::BatchClassId)
+      return;
+    C->Active = true;
+    if (C->LastEvent != NoEvent && C->LastEvent != Event &&
+        ++C->RoundTrips >= RoundTripsToGrow) {
+      C->RoundTrips = 0;
+      grow(C);
+    }
+    C->LastEvent = Event;
+    if (++EventsSinceSweep >= EventsPerSweep) {
+      EventsSinceSweep = 0;
+      shrinkIdleClasses();
+    }
+  }
+
+  void grow(PerClass *C) {
+    const u32 MaxCount = Min(2 * C->MaxCount, getMaxCountLimit());
+    if (MaxCount <= C->MaxCount)
+      return;
+    const uptr ExtraBytes = (MaxCount - C->MaxCount) * C->ClassSize;
+    if (CapacityBytes + ExtraBytes > MaxCapacityBytes) {
+      shrinkIdleClasses();
+      if (CapacityBytes + ExtraBytes > MaxCapacityBytes)
+        return;
+    }
+    setMaxCount(C, MaxCount);
+  }
+
+  // A class is deemed idle if it didn't go through the slow path since the
+  // last sweep, and its number of cached blocks didn't change.
+  void shrinkIdleClasses() {
+    for (uptr I = 0; I < NumClasses; I++) {
+      PerClass *C = &PerClassArray[I];
+      if (I == SizeClassMap::BatchClassId)
+        continue;
+      const u32 MinCount = TransferBatch::getMaxCached(C->ClassSize);
+      if (!C->Active && C->Count == C->CountAtSweep &&
+          C->MaxCount > MinCount) {
+        setMaxCount(C, Max(MinCount, C->MaxCount / 2));
+        while (C->Count > C->MaxCount)
+          drain(C, I);
+      }
+      C->Active = false;
+      C->CountAtSweep = C->Count;
     }
   }
 
@@ -153,6 +341,7 @@ private:
 
   NOINLINE bool refill(PerClass *C, uptr ClassId) {
     initCacheMaybe(C);
+    noteEvent(C, ClassId, RefillEvent);
     TransferBatch *B = Allocator->popBatch(this, ClassId);
     if (UNLIKELY(!B))
       return false;
@@ -160,11 +349,38 @@ private:
     C->Count = B->getCount();
     B->copyToArray(C->Chunks);
     destroyBatch(ClassId, B);
+    // With a limit lowered at runtime, the batch might not fit in the cache,
+    // the surplus goes back to the Primary right away.
+    const u32 Limit = getMaxCountLimit();
+    if (UNLIKELY(C->MaxCount > Limit))
+      setMaxCount(C, Limit);
+    if (UNLIKELY(C->Count > C->MaxCount))
+      drain(C, ClassId, C->Count - C->MaxCount);
     return true;
   }
 
+  // With a NUMA aware Primary, a TransferBatch must only hold blocks of a
+  // single node. This moves up to Count blocks of the node of the last cached
+  // block to the end of the array, and returns how many were moved.
+  u32 gatherBlocksOfNode(PerClass *C, u32 Count) {
+    const u32 Node = Allocator->getNodeOfBlock(C->Chunks[C->Count - 1]);
+    u32 N = 0;
+    for (sptr I = static_cast<sptr>(C->Count) - 1; I >= 0 && N < Count; I--) {
+      if (Allocator->getNodeOfBlock(C->Chunks[I]) != Node)
+        continue;
+      Swap(C->Chunks[I], C->Chunks[C->Count - 1 - N]);
+      N++;
+    }
+    return N;
+  }
+
   NOINLINE void drain(PerClass *C, uptr ClassId) {
-    const u32 Count = Min(C->MaxCount / 2, C->Count);
+    drain(C, ClassId, Min(TransferBatch::getMaxCached(C->ClassSize), C->Count));
+  }
+
+  void drain(PerClass *C, uptr ClassId, u32 Count) {
+    if (SizeClassAllocator::MaxNumaNodes > 1U)
+      Count = gatherBlocksOfNode(C, Count);
     const uptr FirstIndexToDrain = C->Count - Count;
     TransferBatch *B = createBatch(ClassId, C->Chunks[FirstIndexToDrain]);
     if (UNLIKELY(!B))
@@ -173,6 +389,10 @@ private:
     B->setFromArray(&C->Chunks[FirstIndexToDrain], Count);
     C->Count -= Count;
     Allocator->pushBatch(ClassId, B);
+    // Picks up a lowered limit.
+    const u32 Limit = getMaxCountLimit();
+    if (UNLIKELY(C->MaxCount > Limit))
+      setMaxCount(C, Limit);
   }
 };
 
@@ -0,0 +1,97 @@
+//===-- numa.h --------------------------------------------------*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef SCUDO_NUMA_H_
+#define SCUDO_NUMA_H_
+
+#include "common.h"
+
+namespace scudo {
+
+// The NUMA node of each CPU, discovered at runtime. The node ids of the
+// platform can be sparse, so the nodes are indexed in the order they are
+// discovered, the index being what the Primary works with, and the id what
+// memory placement is requested with. Nodes past MaxNodes are folded onto the
+// first ones. A fake topology, where CPU I is on node I % NumberOfNodes, allows
+// for exercising the NUMA code paths on a single node machine, no memory
+// placement being requested in that case.
+class NumaTopology {
+public:
+  static const u32 MaxCPUs = 256U;
+
+  void init(u32 MaxNodes) {
+    u8 NodeIdOfCPU[MaxCPUs];
+    getNumaTopology(NodeIdOfCPU, MaxCPUs);
+    initFromNodeIds(NodeIdOfCPU, MaxNodes);
+    Fake = false;
+  }
+
+  // Indexes the nodes of a CPU to node id table, as filled by
+  // getNumaTopology.
+  void initFromNodeIds(const u8 *NodeIdOfCPU, u32 MaxNodes) {
+    constexpr u8 NoIndex = 0xff;
+    u8 IndexOfNodeId[256];
+    memset(IndexOfNodeId, NoIndex, sizeof(IndexOfNodeId));
+    u32 Discovered = 0;
+    NumberOfNodes = 0;
+    for (u32 I = 0; I < MaxCPUs; I++) {
+      const u8 Id = NodeIdOfCPU[I];
+      if (Id == UnknownNumaNode) {
+        NodeOfCPU[I] = 0;
+        continue;
+      }
+      if (IndexOfNodeId[Id] == NoIndex) {
+        const u32 Index = Discovered++ % MaxNodes;
+        IndexOfNodeId[Id] = static_cast<u8>(Index);
+        if (Index == NumberOfNodes)
+          NodeIds[NumberOfNodes++] = Id;
+      }
+      NodeOfCPU[I] = IndexOfNodeId[Id];
+    }
+    if (!NumberOfNodes) {
+      NodeIds[0] = 0;
+      NumberOfNodes = 1U;
+    }
+  }
+
+  void initFake(u32 Nodes, u32 MaxNodes) {
+    NumberOfNodes = Min(Max(Nodes, 1U), MaxNodes);
+    for (u32 I = 0; I < MaxCPUs; I++)
+      NodeOfCPU[I] = static_cast<u8>(I % NumberOfNodes);
+    for (u32 I = 0; I < NumberOfNodes; I++)
+      NodeIds[I] = static_cast<u8>(I);
+    Fake = true;
+  }
+
+  u32 getNumberOfNodes() const { return NumberOfNodes; }
+
+  // Whether memory should actually be placed on the nodes.
+  bool isReal() const { return !Fake && NumberOfNodes > 1; }
+
+  u32 getNodeOfCPU(u32 CPU) const {
+    return CPU < MaxCPUs ? NodeOfCPU[CPU] : 0U;
+  }
+
+  u32 getCurrentNode() const {
+    return NumberOfNodes > 1 ? getNodeOfCPU(getCurrentCPU()) : 0U;
+  }
+
+  // Returns the platform id of the node at Index.
+  u32 getNodeId(u32 Index) const { return NodeIds[Index]; }
+
+private:
+  u32 NumberOfNodes;
+  bool Fake;
+  u8 NodeOfCPU[MaxCPUs];
+  // A node has at least a CPU, so there can't be more than MaxCPUs of them.
+  u8 NodeIds[MaxCPUs];
+};
+
+} // namespace scudo
+
+#endif // SCUDO_NUMA_H_
@@ -36,7 +36,8 @@ namespace scudo {
 // the thread specific freelist for said class, and back.
 //
 // Memory used by this allocator is never unmapped but can be partially
-// reclaimed if the platform allows for it.
+// reclaimed if the platform allows for it. As in the 64-bit primary, that
+// release can be deferred to a background thread.
 
 template <class SizeClassMapT, uptr RegionSizeLog> class SizeClassAllocator32 {
 public:
@@ -55,6 +56,14 @@ public:
 
   static bool canAllocate(uptr Size) { return Size <= SizeClassMap::MaxSize; }
 
+  // This Primary is not NUMA aware.
+  static const u32 MaxNumaNodes = 1U;
+  u32 getNodeOfBlock(UNUSED void *Block) const { return 0U; }
+
+  uptr getClassIdOfBlock(void *Block) {
+    return PossibleRegions[computeRegionId(reinterpret_cast<uptr>(Block))];
+  }
+
   void initLinkerInitialized(s32 ReleaseToOsInterval) {
     if (SCUDO_FUCHSIA)
       reportError("SizeClassAllocator32 is not supported on Fuchsia");
@@ -72,11 +81,10 @@ public:
       SizeClassInfo *Sci = getSizeClassInfo(I);
       Sci->RandState = getRandomU32(&Seed);
       // See comment in the 64-bit primary about releasing smaller size classes.
-      Sci->CanRelease = (ReleaseToOsInterval >= 0) &&
-                        (I != SizeClassMap::BatchClassId) &&
+      Sci->CanRelease = (I != SizeClassMap::BatchClassId) &&
                         (getSizeByClassId(I) >= (PageSize / 32));
     }
-    ReleaseToOsIntervalMs = ReleaseToOsInterval;
+    atomic_store_relaxed(&ReleaseToOsIntervalMs, ReleaseToOsInterval);
   }
   void init(s32 ReleaseToOsInterval) {
     memset(this, 0, sizeof(*this));
@@ -92,6 +100,7 @@ public:
       if (PossibleRegions[I])
         unmap(reinterpret_cast<void *>(I * RegionSize), RegionSize);
     PossibleRegions.unmapTestOnly();
+    Counters.unmapTestOnly();
   }
 
   TransferBatch *popBatch(CacheT *C, uptr ClassId) {
@@ -107,7 +116,7 @@ public:
         return nullptr;
     }
     DCHECK_GT(B->getCount(), 0);
-    Sci->Stats.PoppedBlocks += B->getCount();
+    addToStat(&Sci->Stats.PoppedBlocks, B->getCount());
     return B;
   }
 
@@ -117,9 +126,13 @@ public:
     SizeClassInfo *Sci = getSizeClassInfo(ClassId);
     ScopedLock L(Sci->Mutex);
     Sci->FreeList.push_front(B);
-    Sci->Stats.PushedBlocks += B->getCount();
-    if (Sci->CanRelease)
-      releaseToOSMaybe(Sci, ClassId);
+    addToStat(&Sci->Stats.PushedBlocks, B->getCount());
+    if (Sci->CanRelease) {
+      if (atomic_load_relaxed(&ReleaseInBackground))
+        markDirty(Sci);
+      else
+        releaseToOSMaybe(Sci, ClassId);
+    }
   }
 
   void disable() {
@@ -144,21 +157,39 @@ public:
   }
 
   void getStats(ScopedString *Str) {
-    // TODO(kostyak): get the RSS per region.
     uptr TotalMapped = 0;
+    uptr TotalResident = 0;
     uptr PoppedBlocks = 0;
     uptr PushedBlocks = 0;
+    PrimaryClassStats ClassStats[NumClasses];
+    getClassStats(ClassStats);
     for (uptr I = 0; I < NumClasses; I++) {
-      SizeClassInfo *Sci = getSizeClassInfo(I);
-      TotalMapped += Sci->AllocatedUser;
-      PoppedBlocks += Sci->Stats.PoppedBlocks;
-      PushedBlocks += Sci->Stats.PushedBlocks;
+      TotalMapped += ClassStats[I].MappedBytes;
+      TotalResident += ClassStats[I].ResidentBytes;
+      PoppedBlocks += ClassStats[I].PoppedBlocks;
+      PushedBlocks += ClassStats[I].PushedBlocks;
     }
-    Str->append("Stats: SizeClassAllocator32: %zuM mapped in %zu allocations; "
-                "remains %zu\n",
-                TotalMapped >> 20, PoppedBlocks, PoppedBlocks - PushedBlocks);
+    Str->append("Stats: SizeClassAllocator32: %zuM mapped (%zuM rss) in %zu "
+                "allocations; remains %zu\n",
+                TotalMapped >> 20, TotalResident >> 20, PoppedBlocks,
+                PoppedBlocks - PushedBlocks);
     for (uptr I = 0; I < NumClasses; I++)
-      getStats(Str, I, 0);
+      getStats(Str, &ClassStats[I]);
+  }
+
+  // See the 64-bit primary.
+  uptr getClassStats(PrimaryClassStats *Stats, uptr Size) {
+    PrimaryClassStats ClassStats[NumClasses];
+    getClassStats(ClassStats);
+    uptr Count = 0;
+    for (uptr I = 0; I < NumClasses; I++) {
+      if (ClassStats[I].MappedBytes == 0)
+        continue;
+      if (Count < Size)
+        Stats[Count] = ClassStats[I];
+      Count++;
+    }
+    return Count;
   }
 
   uptr releaseToOS() {
@@ -168,7 +199,42 @@ public:
         continue;
       SizeClassInfo *Sci = getSizeClassInfo(I);
       ScopedLock L(Sci->Mutex);
-      TotalReleasedBytes += releaseToOSMaybe(Sci, I, /*Force=*/true);
+      TotalReleasedBytes += releaseToOSMaybe(Sci, I, ReleaseToOS::ForceAll);
+    }
+    return TotalReleasedBytes;
+  }
+
+  bool setOption(Option O, sptr Value) {
+    if (O == Option::ReleaseInterval) {
+      atomic_store_relaxed(&ReleaseToOsIntervalMs, static_cast<s32>(Value));
+      return true;
+    }
+    if (O == Option::MaxThreadCacheCount) {
+      atomic_store_relaxed(&MaxThreadCacheCount, static_cast<u32>(Value));
+      return true;
+    }
+    return false;
+  }
+
+  // The caches check this on every drain, 0 meaning no limit.
+  u32 getMaxThreadCacheCount() const {
+    return atomic_load_relaxed(&MaxThreadCacheCount);
+  }
+
+  void setBackgroundRelease(bool Background) {
+    atomic_store_relaxed(&ReleaseInBackground, Background);
+  }
+
+  // See the 64-bit primary.
+  uptr releaseDirtyRegionsToOS() {
+    uptr TotalReleasedBytes = 0;
+    for (uptr I = 0; I < NumClasses; I++) {
+      SizeClassInfo *Sci = getSizeClassInfo(I);
+      if (!atomic_load_relaxed(&Sci->Dirty))
+        continue;
+      ScopedLock L(Sci->Mutex);
+      atomic_store_relaxed(&Sci->Dirty, 0);
+      TotalReleasedBytes += releaseToOSMaybe(Sci, I, ReleaseToOS::Force);
     }
     return TotalReleasedBytes;
   }
@@ -183,9 +249,10 @@ private:
   typedef TwoLevelByteMap<(NumRegions >> 12), 1UL << 12> ByteMap;
 #endif
 
+  // Only updated with the class mutex held, but read without it by getStats.
   struct SizeClassStats {
-    uptr PoppedBlocks;
-    uptr PushedBlocks;
+    atomic_uptr PoppedBlocks;
+    atomic_uptr PushedBlocks;
   };
 
   struct ReleaseToOsInfo {
@@ -200,6 +267,7 @@ private:
     SinglyLinkedList<TransferBatch> FreeList;
     SizeClassStats Stats;
     bool CanRelease;
+    atomic_u8 Dirty;
     u32 RandState;
     uptr AllocatedUser;
     ReleaseToOsInfo ReleaseInfo;
@@ -260,6 +328,17 @@ private:
     return Region;
   }
 
+  static void markDirty(SizeClassInfo *Sci) {
+    if (!atomic_load_relaxed(&Sci->Dirty))
+      atomic_store_relaxed(&Sci->Dirty, 1);
+  }
+
+  // The stores are made with release semantics so that the PushedBlocks can be
+  // read before the PoppedBlocks without holding the mutex.
+  static void addToStat(atomic_uptr *Stat, uptr V) {
+    atomic_store(Stat, atomic_load_relaxed(Stat) + V, memory_order_release);
+  }
+
   SizeClassInfo *getSizeClassInfo(uptr ClassId) {
     DCHECK_LT(ClassId, NumClasses);
     return &SizeClassInfoArray[ClassId];
@@ -328,38 +407,64 @@ private:
     return B;
   }
 
-  void getStats(ScopedString *Str, uptr ClassId, uptr Rss) {
-    SizeClassInfo *Sci = getSizeClassInfo(ClassId);
-    if (Sci->AllocatedUser == 0)
+  // Fills the statistics of all the size classes. The resident bytes are
+  // gathered in a single pass over the regions.
+  void getClassStats(PrimaryClassStats *ClassStats) {
+    for (uptr I = 0; I < NumClasses; I++) {
+      SizeClassInfo *Sci = getSizeClassInfo(I);
+      PrimaryClassStats *S = &ClassStats[I];
+      S->ClassId = I;
+      S->BlockSize = getSizeByClassId(I);
+      S->MappedBytes = Sci->AllocatedUser;
+      S->ResidentBytes = 0;
+      // Loading PushedBlocks first guarantees that InUse is not negative.
+      S->PushedBlocks = atomic_load(&Sci->Stats.PushedBlocks,
+                                    memory_order_acquire);
+      S->PoppedBlocks = atomic_load_relaxed(&Sci->Stats.PoppedBlocks);
+      S->TotalBlocks = Sci->AllocatedUser / S->BlockSize;
+    }
+    if (MinRegionIndex > MaxRegionIndex)
+      return;
+    for (uptr I = MinRegionIndex; I <= MaxRegionIndex; I++) {
+      const uptr ClassId = PossibleRegions[I];
+      if (ClassId)
+        ClassStats[ClassId].ResidentBytes +=
+            getResidentBytes(I * RegionSize, 0, RegionSize);
+    }
+  }
+
+  void getStats(ScopedString *Str, const PrimaryClassStats *S) {
+    if (S->MappedBytes == 0)
       return;
-    const uptr InUse = Sci->Stats.PoppedBlocks - Sci->Stats.PushedBlocks;
-    const uptr AvailableChunks = Sci->AllocatedUser / getSizeByClassId(ClassId);
     Str->append("  %02zu (%6zu): mapped: %6zuK popped: %7zu pushed: %7zu "
                 "inuse: %6zu avail: %6zu rss: %6zuK\n",
-                ClassId, getSizeByClassId(ClassId), Sci->AllocatedUser >> 10,
-                Sci->Stats.PoppedBlocks, Sci->Stats.PushedBlocks, InUse,
-                AvailableChunks, Rss >> 10);
+                S->ClassId, S->BlockSize, S->MappedBytes >> 10,
+                S->PoppedBlocks, S->PushedBlocks,
+                S->PoppedBlocks - S->PushedBlocks, S->TotalBlocks,
+                S->ResidentBytes >> 10);
   }
 
-  NOINLINE uptr releaseToOSMaybe(SizeClassInfo *Sci, uptr ClassId,
-                                 bool Force = false) {
+  NOINLINE uptr
+  releaseToOSMaybe(SizeClassInfo *Sci, uptr ClassId,
+                   ReleaseToOS ReleaseType = ReleaseToOS::Normal) {
     const uptr BlockSize = getSizeByClassId(ClassId);
     const uptr PageSize = getPageSizeCached();
 
-    CHECK_GE(Sci->Stats.PoppedBlocks, Sci->Stats.PushedBlocks);
+    const uptr PoppedBlocks = atomic_load_relaxed(&Sci->Stats.PoppedBlocks);
+    const uptr PushedBlocks = atomic_load_relaxed(&Sci->Stats.PushedBlocks);
+    CHECK_GE(PoppedBlocks, PushedBlocks);
     const uptr BytesInFreeList =
-        Sci->AllocatedUser -
-        (Sci->Stats.PoppedBlocks - Sci->Stats.PushedBlocks) * BlockSize;
+        Sci->AllocatedUser - (PoppedBlocks - PushedBlocks) * BlockSize;
     if (BytesInFreeList < PageSize)
       return 0; // No chance to release anything.
-    if ((Sci->Stats.PushedBlocks - Sci->ReleaseInfo.PushedBlocksAtLastRelease) *
+    if ((PushedBlocks - Sci->ReleaseInfo.PushedBlocksAtLastRelease) *
             BlockSize <
         PageSize) {
       return 0; // Nothing new to release.
     }
 
-    if (!Force) {
-      const s32 IntervalMs = ReleaseToOsIntervalMs;
+    if (ReleaseType == ReleaseToOS::Normal) {
+      const s32 IntervalMs = atomic_load_relaxed(&ReleaseToOsIntervalMs);
       if (IntervalMs < 0)
         return 0;
       if (Sci->ReleaseInfo.LastReleaseAtNs +
@@ -377,9 +482,10 @@ private:
       if (PossibleRegions[I] == ClassId) {
         ReleaseRecorder Recorder(I * RegionSize);
         releaseFreeMemoryToOS(Sci->FreeList, I * RegionSize,
-                              RegionSize / PageSize, BlockSize, &Recorder);
+                              RegionSize / PageSize, BlockSize, &Recorder,
+                              &Counters);
         if (Recorder.getReleasedRangesCount() > 0) {
-          Sci->ReleaseInfo.PushedBlocksAtLastRelease = Sci->Stats.PushedBlocks;
+          Sci->ReleaseInfo.PushedBlocksAtLastRelease = PushedBlocks;
           Sci->ReleaseInfo.RangesReleased += Recorder.getReleasedRangesCount();
           Sci->ReleaseInfo.LastReleasedBytes = Recorder.getReleasedBytes();
           TotalReleasedBytes += Sci->ReleaseInfo.LastReleasedBytes;
@@ -397,7 +503,10 @@ private:
   // through the whole NumRegions.
   uptr MinRegionIndex;
   uptr MaxRegionIndex;
-  s32 ReleaseToOsIntervalMs;
+  atomic_s32 ReleaseToOsIntervalMs;
+  atomic_u32 MaxThreadCacheCount;
+  atomic_u8 ReleaseInBackground;
+  PackedCounterBuffer Counters;
   // Unless several threads request regions simultaneously from different size
   // classes, the stash rarely contains more than 1 entry.
   static constexpr uptr MaxStashedRegions = 4;
@@ -13,6 +13,7 @@
 #include "common.h"
 #include "list.h"
 #include "local_cache.h"
+#include "numa.h"
 #include "release.h"
 #include "stats.h"
 #include "string_utils.h"
@@ -37,11 +38,39 @@ namespace scudo {
 //
 // The memory used by this allocator is never unmapped, but can be partially
 // released if the platform allows for it.
-
-template <class SizeClassMapT, uptr RegionSizeLog> class SizeClassAllocator64 {
+//
+// When LockFreeFreeList is true, the per-region free lists of TransferBatches
+// are lock-free stacks: popBatch & pushBatch do not take the Region mutex,
+// which is then only needed to populate a free list and to release memory.
+// A release takes the whole free list for its duration, making the pops that
+// miss meanwhile wait on the mutex, so pushBatch never releases inline in that
+// mode: it only flags the Region as dirty, as when releasing in the
+// background, memory being released by releaseDirtyRegionsToOS or releaseToOS.
+//
+// The periodic release of memory to the OS is incremental: the free blocks are
+// accounted for per group as they are pushed and popped, and only the groups
+// that became entirely free since the last release are visited. An explicit
+// releaseToOS still goes through the whole free list.
+//
+// When releasing in the background, pushBatch doesn't attempt to release memory
+// to the OS, it only flags the Region as dirty, and releaseDirtyRegionsToOS is
+// expected to be called periodically by a dedicated thread.
+//
+// With NumaNodesLog > 0, there is a set of Regions per NUMA node, up to
+// 2^NumaNodesLog nodes, the actual number of nodes being discovered at runtime.
+// The memory of the Regions of a node is placed on it, blocks are popped from
+// the Regions of the node of the current CPU, and pushed back to the Regions
+// of their own node. The TransferBatches pushed must then hold blocks of a
+// single node, which the local cache takes care of.
+
+template <class SizeClassMapT, uptr RegionSizeLog,
+          bool LockFreeFreeList = false, uptr NumaNodesLog = 0>
+class SizeClassAllocator64 {
 public:
   typedef SizeClassMapT SizeClassMap;
-  typedef SizeClassAllocator64<SizeClassMap, RegionSizeLog> ThisT;
+  typedef SizeClassAllocator64<SizeClassMap, RegionSizeLog, LockFreeFreeList,
+                               NumaNodesLog>
+      ThisT;
   typedef SizeClassAllocatorLocalCache<ThisT> CacheT;
   typedef typename CacheT::TransferBatch TransferBatch;
 
@@ -53,13 +82,36 @@ public:
 
   static bool canAllocate(uptr Size) { return Size <= SizeClassMap::MaxSize; }
 
+  static const u32 MaxNumaNodes = 1U << NumaNodesLog;
+  // The lock-free free lists rely on the TransferBatches being in the Region of
+  // the batch class, which doesn't hold with a Region per node.
+  COMPILER_CHECK(!LockFreeFreeList || MaxNumaNodes == 1U);
+
   void initLinkerInitialized(s32 ReleaseToOsInterval) {
-    // Reserve the space required for the Primary.
-    PrimaryBase = reinterpret_cast<uptr>(
-        map(nullptr, PrimarySize, "scudo:primary", MAP_NOACCESS, &Data));
+    if (MaxNumaNodes > 1U)
+      Topology.init(MaxNumaNodes);
+
+    // Reserve the space required for the Primary. If huge pages are supported,
+    // the base is aligned on their size, as are the Regions then.
+    HugePageSize = scudo::getHugePageSize();
+    if (HugePageSize > RegionSize)
+      HugePageSize = 0;
+    const uptr ReservedBase = reinterpret_cast<uptr>(
+        map(nullptr, PrimarySize + HugePageSize, "scudo:primary", MAP_NOACCESS,
+            &Data));
+    PrimaryBase = ReservedBase;
+    if (HugePageSize) {
+      PrimaryBase = roundUpTo(ReservedBase, HugePageSize);
+      const uptr HeadSize = PrimaryBase - ReservedBase;
+      if (HeadSize)
+        unmap(reinterpret_cast<void *>(ReservedBase), HeadSize);
+      if (HugePageSize - HeadSize)
+        unmap(reinterpret_cast<void *>(PrimaryBase + PrimarySize),
+              HugePageSize - HeadSize);
+    }
 
     RegionInfoArray = reinterpret_cast<RegionInfo *>(
-        map(nullptr, sizeof(RegionInfo) * NumClasses, "scudo:regioninfo"));
+        map(nullptr, sizeof(RegionInfo) * NumRegions, "scudo:regioninfo"));
     DCHECK_EQ(reinterpret_cast<uptr>(RegionInfoArray) % SCUDO_CACHE_LINE_SIZE,
               0);
 
@@ -67,11 +119,12 @@ public:
     if (UNLIKELY(!getRandom(reinterpret_cast<void *>(&Seed), sizeof(Seed))))
       Seed = static_cast<u32>(getMonotonicTime() ^ (PrimaryBase >> 12));
     const uptr PageSize = getPageSizeCached();
-    for (uptr I = 0; I < NumClasses; I++) {
-      RegionInfo *Region = getRegionInfo(I);
+    for (uptr J = 0; J < NumRegions; J++) {
+      RegionInfo *Region = &RegionInfoArray[J];
+      const uptr I = J % NumClasses;
       // The actual start of a region is offseted by a random number of pages.
       Region->RegionBeg =
-          getRegionBaseByClassId(I) + (getRandomModN(&Seed, 16) + 1) * PageSize;
+          getRegionBase(Region) + (getRandomModN(&Seed, 16) + 1) * PageSize;
       // Releasing smaller size classes doesn't necessarily yield to a
       // meaningful RSS impact: there are more blocks per page, they are
       // randomized around, and thus pages are less likely to be entirely empty.
@@ -79,12 +132,13 @@ public:
       // memory accesses which ends up being fairly costly. The current lower
       // limit is mostly arbitrary and based on empirical observations.
       // TODO(kostyak): make the lower limit a runtime option
-      Region->CanRelease = (ReleaseToOsInterval >= 0) &&
-                           (I != SizeClassMap::BatchClassId) &&
+      // The release interval can be changed at runtime, so this doesn't depend
+      // on it.
+      Region->CanRelease = (I != SizeClassMap::BatchClassId) &&
                            (getSizeByClassId(I) >= (PageSize / 32));
       Region->RandState = getRandomU32(&Seed);
     }
-    ReleaseToOsIntervalMs = ReleaseToOsInterval;
+    atomic_store_relaxed(&ReleaseToOsIntervalMs, ReleaseToOsInterval);
   }
   void init(s32 ReleaseToOsInterval) {
     memset(this, 0, sizeof(*this));
@@ -92,14 +146,40 @@ public:
   }
 
   void unmapTestOnly() {
+    for (uptr I = 0; I < NumRegions; I++)
+      RegionInfoArray[I].Groups.unmapTestOnly();
+    Counters.unmapTestOnly();
     unmap(reinterpret_cast<void *>(PrimaryBase), PrimarySize, UNMAP_ALL, &Data);
     unmap(reinterpret_cast<void *>(RegionInfoArray),
-          sizeof(RegionInfo) * NumClasses);
+          sizeof(RegionInfo) * NumRegions);
   }
 
   TransferBatch *popBatch(CacheT *C, uptr ClassId) {
+    return popBatch(C, ClassId,
+                    MaxNumaNodes > 1U ? Topology.getCurrentNode() : 0U);
+  }
+
+  TransferBatch *popBatch(CacheT *C, uptr ClassId, u32 Node) {
     DCHECK_LT(ClassId, NumClasses);
-    RegionInfo *Region = getRegionInfo(ClassId);
+    RegionInfo *Region = getRegionInfo(ClassId, Node);
+    if (LockFreeFreeList) {
+      TransferBatch *B = popBatchLockFree(Region);
+      if (UNLIKELY(!B)) {
+        ScopedLock L(Region->Mutex);
+        // Another thread might have populated the free list, or a release
+        // might have been holding on to it, while we were waiting.
+        B = popBatchLockFree(Region);
+        if (!B) {
+          B = populateFreeList(C, ClassId, Region);
+          if (UNLIKELY(!B))
+            return nullptr;
+        }
+      }
+      DCHECK_GT(B->getCount(), 0);
+      atomic_fetch_add(&Region->Stats.PoppedBlocks, B->getCount(),
+                       memory_order_relaxed);
+      return B;
+    }
     ScopedLock L(Region->Mutex);
     TransferBatch *B = Region->FreeList.front();
     if (B) {
@@ -110,35 +190,75 @@ public:
         return nullptr;
     }
     DCHECK_GT(B->getCount(), 0);
-    Region->Stats.PoppedBlocks += B->getCount();
+    addToStat(&Region->Stats.PoppedBlocks, B->getCount());
+    if (Region->Groups.isEnabled()) {
+      for (u32 I = 0; I < B->getCount(); I++)
+        Region->Groups.markUsed(getBlockOffset(Region, B->get(I)));
+    }
     return B;
   }
 
   void pushBatch(uptr ClassId, TransferBatch *B) {
     DCHECK_GT(B->getCount(), 0);
-    RegionInfo *Region = getRegionInfo(ClassId);
+    RegionInfo *Region = getRegionInfo(ClassId, getNodeOfBlock(B->get(0)));
+    if (LockFreeFreeList) {
+      // See addToStat, the blocks were popped before being pushed back.
+      atomic_fetch_add(&Region->Stats.PushedBlocks, B->getCount(),
+                       memory_order_release);
+      pushBatchesLockFree(Region, B, B);
+      if (Region->CanRelease)
+        markDirty(Region);
+      return;
+    }
     ScopedLock L(Region->Mutex);
     Region->FreeList.push_front(B);
-    Region->Stats.PushedBlocks += B->getCount();
-    if (Region->CanRelease)
-      releaseToOSMaybe(Region, ClassId);
+    addToStat(&Region->Stats.PushedBlocks, B->getCount());
+    if (Region->Groups.isEnabled()) {
+      for (u32 I = 0; I < B->getCount(); I++)
+        Region->Groups.markFree(getBlockOffset(Region, B->get(I)));
+    }
+    if (Region->CanRelease) {
+      if (atomic_load_relaxed(&ReleaseInBackground))
+        markDirty(Region);
+      else
+        releaseToOSMaybe(Region, ClassId);
+    }
   }
 
+  // Returns the NUMA node of the Regions a block belongs to.
+  u32 getNodeOfBlock(void *Block) const {
+    if (MaxNumaNodes == 1U)
+      return 0U;
+    return static_cast<u32>(
+        ((reinterpret_cast<uptr>(Block) - PrimaryBase) >> RegionSizeLog) /
+        NumClasses);
+  }
+
+  // Returns the class of the Regions a block belongs to.
+  uptr getClassIdOfBlock(void *Block) const {
+    return ((reinterpret_cast<uptr>(Block) - PrimaryBase) >> RegionSizeLog) %
+           NumClasses;
+  }
+
+  // Mostly meant to set up a fake topology for testing, before any use.
+  NumaTopology *getTopology() { return &Topology; }
+
   void disable() {
-    for (uptr I = 0; I < NumClasses; I++)
-      getRegionInfo(I)->Mutex.lock();
+    for (uptr I = 0; I < NumRegions; I++)
+      RegionInfoArray[I].Mutex.lock();
   }
 
   void enable() {
-    for (sptr I = static_cast<sptr>(NumClasses) - 1; I >= 0; I--)
-      getRegionInfo(static_cast<uptr>(I))->Mutex.unlock();
+    for (sptr I = static_cast<sptr>(NumRegions) - 1; I >= 0; I--)
+      RegionInfoArray[I].Mutex.unlock();
   }
 
   template <typename F> void iterateOverBlocks(F Callback) const {
-    for (uptr I = 0; I < NumClasses; I++) {
+    for (uptr J = 0; J < NumRegions; J++) {
+      const uptr I = J % NumClasses;
       if (I == SizeClassMap::BatchClassId)
         continue;
-      const RegionInfo *Region = getRegionInfo(I);
+      const RegionInfo *Region = &RegionInfoArray[J];
       const uptr BlockSize = getSizeByClassId(I);
       const uptr From = Region->RegionBeg;
       const uptr To = From + Region->AllocatedUser;
@@ -148,34 +268,82 @@ public:
   }
 
   void getStats(ScopedString *Str) const {
-    // TODO(kostyak): get the RSS per region.
-    uptr TotalMapped = 0;
-    uptr PoppedBlocks = 0;
-    uptr PushedBlocks = 0;
+    getStats(Str, /*HugePageStats=*/true);
+  }
+
+  // Fills up to Size elements of the Stats array with the statistics of the
+  // size classes that have memory mapped, and returns the number of those.
+  uptr getClassStats(PrimaryClassStats *Stats, uptr Size) const {
+    uptr Count = 0;
     for (uptr I = 0; I < NumClasses; I++) {
-      RegionInfo *Region = getRegionInfo(I);
-      if (Region->MappedUser)
-        TotalMapped += Region->MappedUser;
-      PoppedBlocks += Region->Stats.PoppedBlocks;
-      PushedBlocks += Region->Stats.PushedBlocks;
+      uptr MappedUser = 0;
+      for (u32 Node = 0; Node < MaxNumaNodes; Node++)
+        MappedUser += getRegionInfo(I, Node)->MappedUser;
+      if (MappedUser == 0)
+        continue;
+      if (Count < Size)
+        getClassStats(I, &Stats[Count]);
+      Count++;
     }
-    Str->append("Stats: SizeClassAllocator64: %zuM mapped (%zuM rss) in %zu "
-                "allocations; remains %zu\n",
-                TotalMapped >> 20, 0, PoppedBlocks,
-                PoppedBlocks - PushedBlocks);
-
-    for (uptr I = 0; I < NumClasses; I++)
-      getStats(Str, I, 0);
+    return Count;
   }
 
   uptr releaseToOS() {
     uptr TotalReleasedBytes = 0;
-    for (uptr I = 0; I < NumClasses; I++) {
+    for (uptr J = 0; J < NumRegions; J++) {
+      const uptr I = J % NumClasses;
       if (I == SizeClassMap::BatchClassId)
         continue;
-      RegionInfo *Region = getRegionInfo(I);
+      RegionInfo *Region = &RegionInfoArray[J];
+      ScopedLock L(Region->Mutex);
+      TotalReleasedBytes += releaseToOSMaybe(Region, I, ReleaseToOS::ForceAll);
+    }
+    return TotalReleasedBytes;
+  }
+
+  bool setOption(Option O, sptr Value) {
+    if (O == Option::ReleaseInterval) {
+      atomic_store_relaxed(&ReleaseToOsIntervalMs, static_cast<s32>(Value));
+      return true;
+    }
+    if (O == Option::MaxThreadCacheCount) {
+      atomic_store_relaxed(&MaxThreadCacheCount, static_cast<u32>(Value));
+      return true;
+    }
+    if (O == Option::HugePagesMaxSize) {
+      if (!HugePageSize)
+        return false;
+      atomic_store_relaxed(&HugePagesMaxSize, static_cast<uptr>(Value));
+      return true;
+    }
+    return false;
+  }
+
+  // The size of the huge pages the Regions can be backed with, 0 if not
+  // supported.
+  uptr getHugePageSize() const { return HugePageSize; }
+
+  // The caches check this on every drain, 0 meaning no limit.
+  u32 getMaxThreadCacheCount() const {
+    return atomic_load_relaxed(&MaxThreadCacheCount);
+  }
+
+  void setBackgroundRelease(bool Background) {
+    atomic_store_relaxed(&ReleaseInBackground, Background);
+  }
+
+  // Releases the Regions that have been flagged as dirty since the last call,
+  // bypassing the release interval, which is up to the caller to enforce.
+  uptr releaseDirtyRegionsToOS() {
+    uptr TotalReleasedBytes = 0;
+    for (uptr J = 0; J < NumRegions; J++) {
+      RegionInfo *Region = &RegionInfoArray[J];
+      if (!atomic_load_relaxed(&Region->Dirty))
+        continue;
       ScopedLock L(Region->Mutex);
-      TotalReleasedBytes += releaseToOSMaybe(Region, I, /*Force=*/true);
+      atomic_store_relaxed(&Region->Dirty, 0);
+      TotalReleasedBytes +=
+          releaseToOSMaybe(Region, J % NumClasses, ReleaseToOS::Force);
     }
     return TotalReleasedBytes;
   }
@@ -183,50 +351,163 @@ public:
 private:
   static const uptr RegionSize = 1UL << RegionSizeLog;
   static const uptr NumClasses = SizeClassMap::NumClasses;
-  static const uptr PrimarySize = RegionSize * NumClasses;
+  // The Regions of node N are the ones of index N * NumClasses + ClassId.
+  static const uptr NumRegions = NumClasses * MaxNumaNodes;
+  static const uptr PrimarySize = RegionSize * NumRegions;
 
   // Call map for user memory with at least this size.
   static const uptr MapSizeIncrement = 1UL << 17;
 
+  // The counters are only ever updated with the Region mutex held, unless the
+  // free list is lock-free, in which case atomic additions are used.
   struct RegionStats {
-    uptr PoppedBlocks;
-    uptr PushedBlocks;
+    atomic_uptr PoppedBlocks;
+    atomic_uptr PushedBlocks;
   };
 
   struct ReleaseToOsInfo {
     uptr PushedBlocksAtLastRelease;
     uptr RangesReleased;
     uptr LastReleasedBytes;
-    u64 LastReleaseAtNs;
+    atomic_u64 LastReleaseAtNs;
   };
 
   struct ALIGNED(SCUDO_CACHE_LINE_SIZE) RegionInfo {
     HybridMutex Mutex;
     SinglyLinkedList<TransferBatch> FreeList;
+    // Head of the lock-free free list, see popBatchLockFree.
+    atomic_u64 FreeListHead;
     RegionStats Stats;
     bool CanRelease;
     bool Exhausted;
+    bool HugePages; // Whether the mappings are backed by huge pages.
+    atomic_u8 Dirty;
     u32 RandState;
     uptr RegionBeg;
     uptr MappedUser;    // Bytes mapped for user memory.
     uptr AllocatedUser; // Bytes allocated for user memory.
     MapPlatformData Data;
     ReleaseToOsInfo ReleaseInfo;
+    FreeBlockGroups Groups;
   };
   COMPILER_CHECK(sizeof(RegionInfo) % SCUDO_CACHE_LINE_SIZE == 0);
 
   uptr PrimaryBase;
   RegionInfo *RegionInfoArray;
   MapPlatformData Data;
-  s32 ReleaseToOsIntervalMs;
-
-  RegionInfo *getRegionInfo(uptr ClassId) const {
+  atomic_s32 ReleaseToOsIntervalMs;
+  atomic_u32 MaxThreadCacheCount;
+  atomic_u8 ReleaseInBackground;
+  NumaTopology Topology;
+  uptr HugePageSize;
+  atomic_uptr HugePagesMaxSize;
+  PackedCounterBuffer Counters;
+
+  RegionInfo *getRegionInfo(uptr ClassId, u32 Node = 0) const {
     DCHECK_LT(ClassId, NumClasses);
-    return &RegionInfoArray[ClassId];
+    DCHECK_LT(Node, MaxNumaNodes);
+    return &RegionInfoArray[Node * NumClasses + ClassId];
+  }
+
+  uptr getRegionBase(const RegionInfo *Region) const {
+    return PrimaryBase +
+           (static_cast<uptr>(Region - RegionInfoArray) << RegionSizeLog);
   }
 
   uptr getRegionBaseByClassId(uptr ClassId) const {
-    return PrimaryBase + (ClassId << RegionSizeLog);
+    return getRegionBase(getRegionInfo(ClassId));
+  }
+
+  static uptr getBlockOffset(const RegionInfo *Region, void *Block) {
+    return reinterpret_cast<uptr>(Block) - Region->RegionBeg;
+  }
+
+  // The stores are made with release semantics so that the PushedBlocks can be
+  // read before the PoppedBlocks without holding the mutex: reading a number
+  // of PushedBlocks with acquire semantics guarantees that the popping of
+  // those blocks, which happened before, is visible.
+  static void addToStat(atomic_uptr *Stat, uptr V) {
+    atomic_store(Stat, atomic_load_relaxed(Stat) + V, memory_order_release);
+  }
+
+  // The lock-free free list is a Treiber stack. TransferBatches are always
+  // allocated from the region of the batch class, so the head of the stack is
+  // encoded as the offset of the top batch within that region (0 meaning an
+  // empty stack, as a region never starts at its base), with the upper bits
+  // holding a tag that is incremented on every update to prevent ABA issues.
+  // The memory backing the TransferBatches is never unmapped, which makes it
+  // safe to read the Next field of a batch that was concurrently popped.
+  static constexpr u64 FreeListOffsetMask = (1ULL << RegionSizeLog) - 1;
+
+  TransferBatch *decodeFreeListHead(u64 Head) const {
+    const uptr Offset = static_cast<uptr>(Head & FreeListOffsetMask);
+    if (!Offset)
+      return nullptr;
+    return reinterpret_cast<TransferBatch *>(
+        getRegionBaseByClassId(SizeClassMap::BatchClassId) + Offset);
+  }
+
+  u64 encodeFreeListHead(TransferBatch *B, u64 OldHead) const {
+    const u64 Tag = (OldHead | FreeListOffsetMask) + 1;
+    if (!B)
+      return Tag;
+    const uptr Offset = reinterpret_cast<uptr>(B) -
+                        getRegionBaseByClassId(SizeClassMap::BatchClassId);
+    DCHECK_LT(Offset, RegionSize);
+    return Tag | Offset;
+  }
+
+  TransferBatch *popBatchLockFree(RegionInfo *Region) {
+    u64 Head = atomic_load(&Region->FreeListHead, memory_order_acquire);
+    while (true) {
+      TransferBatch *B = decodeFreeListHead(Head);
+      if (!B)
+        return nullptr;
+      TransferBatch *Next = __atomic_load_n(&B->Next, __ATOMIC_RELAXED);
+      if (atomic_compare_exchange_weak(&Region->FreeListHead, &Head,
+                                       encodeFreeListHead(Next, Head),
+                                       memory_order_acquire))
+        return B;
+      Head = atomic_load(&Region->FreeListHead, memory_order_acquire);
+    }
+  }
+
+  // Pushes the chain of batches First -> ... -> Last on the lock-free stack.
+  void pushBatchesLockFree(RegionInfo *Region, TransferBatch *First,
+                           TransferBatch *Last) {
+    u64 Head = atomic_load_relaxed(&Region->FreeListHead);
+    do {
+      __atomic_store_n(&Last->Next, decodeFreeListHead(Head), __ATOMIC_RELAXED);
+    } while (!atomic_compare_exchange_weak(&Region->FreeListHead, &Head,
+                                           encodeFreeListHead(First, Head),
+                                           memory_order_release));
+  }
+
+  // Takes ownership of the whole lock-free stack, appending its batches to L.
+  void popAllBatchesLockFree(RegionInfo *Region,
+                             SinglyLinkedList<TransferBatch> *L) {
+    u64 Head = atomic_load(&Region->FreeListHead, memory_order_acquire);
+    while (!atomic_compare_exchange_weak(&Region->FreeListHead, &Head,
+                                         encodeFreeListHead(nullptr, Head),
+                                         memory_order_acquire)) {
+    }
+    for (TransferBatch *B = decodeFreeListHead(Head); B;) {
+      TransferBatch *Next = B->Next;
+      L->push_back(B);
+      B = Next;
+    }
+  }
+
+  static void markDirty(RegionInfo *Region) {
+    if (!atomic_load_relaxed(&Region->Dirty))
+      atomic_store_relaxed(&Region->Dirty, 1);
+  }
+
+  void pushFreeList(RegionInfo *Region, TransferBatch *B) {
+    if (LockFreeFreeList)
+      pushBatchesLockFree(Region, B, B);
+    else
+      Region->FreeList.push_back(B);
   }
 
   bool populateBatches(CacheT *C, RegionInfo *Region, uptr ClassId,
@@ -238,7 +519,7 @@ private:
     TransferBatch *B = *CurrentBatch;
     for (uptr I = 0; I < Count; I++) {
       if (B && B->getCount() == MaxCount) {
-        Region->FreeList.push_back(B);
+        pushFreeList(Region, B);
         B = nullptr;
       }
       if (!B) {
@@ -263,15 +544,24 @@ private:
     const uptr TotalUserBytes = Region->AllocatedUser + MaxCount * Size;
     // Map more space for blocks, if necessary.
     if (TotalUserBytes > MappedUser) {
-      // Do the mmap for the user memory.
+      // The Regions of classes up to HugePagesMaxSize are backed by huge pages
+      // from their next mapping on. The mappings then end on a huge page
+      // boundary, so that the huge pages are entirely mapped. Note that the
+      // first one of a Region, holding the random offset, can't be.
+      if (!Region->HugePages && HugePageSize &&
+          Size <= atomic_load_relaxed(&HugePagesMaxSize))
+        Region->HugePages = true;
       const uptr UserMapSize =
-          roundUpTo(TotalUserBytes - MappedUser, MapSizeIncrement);
-      const uptr RegionBase = RegionBeg - getRegionBaseByClassId(ClassId);
+          Region->HugePages
+              ? roundUpTo(RegionBeg + TotalUserBytes, HugePageSize) -
+                    (RegionBeg + MappedUser)
+              : roundUpTo(TotalUserBytes - MappedUser, MapSizeIncrement);
+      const uptr RegionBase = RegionBeg - getRegionBase(Region);
       if (UNLIKELY(RegionBase + MappedUser + UserMapSize > RegionSize)) {
         if (!Region->Exhausted) {
           Region->Exhausted = true;
           ScopedString Str(1024);
-          getStats(&Str);
+          getStats(&Str, /*HugePageStats=*/false);
           Str.append(
               "Scudo OOM: The process has Exhausted %zuM for size class %zu.\n",
               RegionSize >> 20, Size);
@@ -283,10 +573,24 @@ private:
         Region->Data = Data;
       if (UNLIKELY(!map(reinterpret_cast<void *>(RegionBeg + MappedUser),
                         UserMapSize, "scudo:primary",
-                        MAP_ALLOWNOMEM | MAP_RESIZABLE, &Region->Data)))
+                        MAP_ALLOWNOMEM | MAP_RESIZABLE |
+                            (Region->HugePages ? MAP_HUGEPAGES : 0),
+                        &Region->Data)))
         return nullptr;
+      // The placement has to be requested before the pages are touched.
+      if (MaxNumaNodes > 1U && Topology.isReal())
+        setPreferredNumaNode(reinterpret_cast<void *>(RegionBeg + MappedUser),
+                             UserMapSize,
+                             Topology.getNodeId(static_cast<u32>(
+                                 (Region - RegionInfoArray) / NumClasses)));
       Region->MappedUser += UserMapSize;
       C->getStats().add(StatMapped, UserMapSize);
+      // The free blocks of the region are tracked per group to make the
+      // periodic release incremental. In lock-free mode, the free list can't
+      // be kept in sync with the groups, so we stick to the full release.
+      // Failing to allocate the groups is not fatal.
+      if (UNLIKELY(MappedUser == 0) && Region->CanRelease && !LockFreeFreeList)
+        Region->Groups.init(RegionSize - RegionBase, Size);
     }
 
     const uptr NumberOfBlocks = Min(
@@ -317,72 +621,189 @@ private:
     DCHECK_GT(B->getCount(), 0);
 
     C->getStats().add(StatFree, AllocatedUser);
+    if (Region->Groups.isEnabled())
+      Region->Groups.addBlocks(Region->AllocatedUser,
+                               Region->AllocatedUser + AllocatedUser);
     Region->AllocatedUser += AllocatedUser;
     Region->Exhausted = false;
     if (Region->CanRelease)
-      Region->ReleaseInfo.LastReleaseAtNs = getMonotonicTime();
+      atomic_store_relaxed(&Region->ReleaseInfo.LastReleaseAtNs,
+                           getMonotonicTime());
 
     return B;
   }
 
-  void getStats(ScopedString *Str, uptr ClassId, uptr Rss) const {
-    RegionInfo *Region = getRegionInfo(ClassId);
-    if (Region->MappedUser == 0)
+  // The statistics of a class are summed over the NUMA nodes.
+  void getClassStats(uptr ClassId, PrimaryClassStats *S) const {
+    S->ClassId = ClassId;
+    S->BlockSize = getSizeByClassId(ClassId);
+    S->MappedBytes = S->ResidentBytes = 0;
+    S->PushedBlocks = S->PoppedBlocks = S->TotalBlocks = 0;
+    for (u32 Node = 0; Node < MaxNumaNodes; Node++) {
+      RegionInfo *Region = getRegionInfo(ClassId, Node);
+      S->MappedBytes += Region->MappedUser;
+      if (Region->MappedUser)
+        S->ResidentBytes += getResidentBytes(Region->RegionBeg, 0,
+                                             Region->MappedUser, &Region->Data);
+      // Loading PushedBlocks first guarantees that InUse is not negative.
+      S->PushedBlocks +=
+          atomic_load(&Region->Stats.PushedBlocks, memory_order_acquire);
+      S->PoppedBlocks += atomic_load_relaxed(&Region->Stats.PoppedBlocks);
+      S->TotalBlocks += Region->AllocatedUser / S->BlockSize;
+    }
+  }
+
+  // Gathering the huge page coverage requires parsing /proc/self/smaps, which
+  // the OOM report, made with a Region mutex held, does without.
+  void getStats(ScopedString *Str, bool HugePageStats) const {
+    uptr TotalMapped = 0;
+    uptr TotalResident = 0;
+    uptr PoppedBlocks = 0;
+    uptr PushedBlocks = 0;
+    PrimaryClassStats ClassStats[NumClasses];
+    for (uptr I = 0; I < NumClasses; I++) {
+      getClassStats(I, &ClassStats[I]);
+      TotalMapped += ClassStats[I].MappedBytes;
+      TotalResident += ClassStats[I].ResidentBytes;
+      PoppedBlocks += ClassStats[I].PoppedBlocks;
+      PushedBlocks += ClassStats[I].PushedBlocks;
+    }
+    Str->append("Stats: SizeClassAllocator64: %zuM mapped (%zuM rss) in %zu "
+                "allocations; remains %zu\n",
+                TotalMapped >> 20, TotalResident >> 20, PoppedBlocks,
+                PoppedBlocks - PushedBlocks);
+    if (MaxNumaNodes > 1U)
+      Str->append("Stats: SizeClassAllocator64: %u NUMA nodes%s\n",
+                  Topology.getNumberOfNodes(),
+                  Topology.isReal() ? "" : " (fake)");
+
+    uptr HugePageBytes[NumClasses] = {};
+    if (HugePageStats && HugePageSize)
+      collectHugePageBytes(HugePageBytes);
+    for (uptr I = 0; I < NumClasses; I++)
+      getStats(Str, &ClassStats[I],
+               HugePageStats ? &HugePageBytes[I] : nullptr);
+  }
+
+  void getStats(ScopedString *Str, const PrimaryClassStats *S,
+                const uptr *HugePageBytes) const {
+    if (S->MappedBytes == 0)
       return;
-    const uptr InUse = Region->Stats.PoppedBlocks - Region->Stats.PushedBlocks;
-    const uptr TotalChunks = Region->AllocatedUser / getSizeByClassId(ClassId);
+    // The Region related values are the ones of the first node.
+    RegionInfo *Region = getRegionInfo(S->ClassId);
     Str->append("%s %02zu (%6zu): mapped: %6zuK popped: %7zu pushed: %7zu "
                 "inuse: %6zu total: %6zu rss: %6zuK releases: %6zu last "
-                "released: %6zuK region: 0x%zx (0x%zx)\n",
-                Region->Exhausted ? "F" : " ", ClassId,
-                getSizeByClassId(ClassId), Region->MappedUser >> 10,
-                Region->Stats.PoppedBlocks, Region->Stats.PushedBlocks, InUse,
-                TotalChunks, Rss >> 10, Region->ReleaseInfo.RangesReleased,
+                "released: %6zuK region: 0x%zx (0x%zx)",
+                Region->Exhausted ? "F" : " ", S->ClassId, S->BlockSize,
+                S->MappedBytes >> 10, S->PoppedBlocks, S->PushedBlocks,
+                S->PoppedBlocks - S->PushedBlocks, S->TotalBlocks,
+                S->ResidentBytes >> 10, Region->ReleaseInfo.RangesReleased,
                 Region->ReleaseInfo.LastReleasedBytes >> 10, Region->RegionBeg,
-                getRegionBaseByClassId(ClassId));
+                getRegionBaseByClassId(S->ClassId));
+    // The huge page coverage of the resident memory.
+    bool HugePages = false;
+    for (u32 Node = 0; Node < MaxNumaNodes; Node++)
+      HugePages |= getRegionInfo(S->ClassId, Node)->HugePages;
+    if (HugePages && HugePageBytes)
+      Str->append(" huge: %6zuK (%zu%%)", *HugePageBytes >> 10,
+                  S->ResidentBytes ? *HugePageBytes * 100 / S->ResidentBytes
+                                   : 0);
+    Str->append("\n");
   }
 
-  NOINLINE uptr releaseToOSMaybe(RegionInfo *Region, uptr ClassId,
-                                 bool Force = false) {
+  // Sums up the bytes backed by huge pages of the Regions of each class, with
+  // a single pass over the mappings of the process.
+  void collectHugePageBytes(uptr *HugePageBytes) const {
+    uptr Begs[NumRegions];
+    uptr Ends[NumRegions];
+    uptr Bytes[NumRegions];
+    uptr ClassIds[NumRegions];
+    uptr Count = 0;
+    // The Regions are sorted by address.
+    for (uptr I = 0; I < NumRegions; I++) {
+      const RegionInfo *Region = &RegionInfoArray[I];
+      if (!Region->HugePages || !Region->MappedUser)
+        continue;
+      Begs[Count] = Region->RegionBeg;
+      Ends[Count] = Region->RegionBeg + Region->MappedUser;
+      ClassIds[Count++] = I % NumClasses;
+    }
+    if (!Count)
+      return;
+    getHugePageBytes(Begs, Ends, Count, Bytes);
+    for (uptr I = 0; I < Count; I++)
+      HugePageBytes[ClassIds[I]] += Bytes[I];
+  }
+
+  NOINLINE uptr
+  releaseToOSMaybe(RegionInfo *Region, uptr ClassId,
+                   ReleaseToOS ReleaseType = ReleaseToOS::Normal) {
     const uptr BlockSize = getSizeByClassId(ClassId);
     const uptr PageSize = getPageSizeCached();
 
-    CHECK_GE(Region->Stats.PoppedBlocks, Region->Stats.PushedBlocks);
+    // In lock-free mode, the counters might be updated concurrently. Loading
+    // PushedBlocks first, with acquire semantics, guarantees that it is not
+    // greater than PoppedBlocks, see addToStat.
+    const uptr PushedBlocks =
+        atomic_load(&Region->Stats.PushedBlocks, memory_order_acquire);
+    const uptr PoppedBlocks = atomic_load_relaxed(&Region->Stats.PoppedBlocks);
+    CHECK_GE(PoppedBlocks, PushedBlocks);
     const uptr BytesInFreeList =
-        Region->AllocatedUser -
-        (Region->Stats.PoppedBlocks - Region->Stats.PushedBlocks) * BlockSize;
+        Region->AllocatedUser - (PoppedBlocks - PushedBlocks) * BlockSize;
     if (BytesInFreeList < PageSize)
       return 0; // No chance to release anything.
-    if ((Region->Stats.PushedBlocks -
-         Region->ReleaseInfo.PushedBlocksAtLastRelease) *
+    if ((PushedBlocks - Region->ReleaseInfo.PushedBlocksAtLastRelease) *
             BlockSize <
         PageSize) {
       return 0; // Nothing new to release.
     }
 
-    if (!Force) {
-      const s32 IntervalMs = ReleaseToOsIntervalMs;
+    if (ReleaseType == ReleaseToOS::Normal) {
+      const s32 IntervalMs = atomic_load_relaxed(&ReleaseToOsIntervalMs);
       if (IntervalMs < 0)
         return 0;
-      if (Region->ReleaseInfo.LastReleaseAtNs +
+      if (atomic_load_relaxed(&Region->ReleaseInfo.LastReleaseAtNs) +
               static_cast<uptr>(IntervalMs) * 1000000ULL >
           getMonotonicTime()) {
         return 0; // Memory was returned recently.
       }
     }
 
-    ReleaseRecorder Recorder(Region->RegionBeg, &Region->Data);
-    releaseFreeMemoryToOS(Region->FreeList, Region->RegionBeg,
-                          roundUpTo(Region->AllocatedUser, PageSize) / PageSize,
-                          BlockSize, &Recorder);
+    // Only whole huge pages are released, not to break them up.
+    ReleaseRecorder Recorder(Region->RegionBeg, &Region->Data,
+                             Region->HugePages ? HugePageSize : 0);
+    const uptr AllocatedPagesCount =
+        roundUpTo(Region->AllocatedUser, PageSize) / PageSize;
+    if (Region->Groups.isEnabled() && ReleaseType != ReleaseToOS::ForceAll) {
+      Region->Groups.releaseFreeGroups(AllocatedPagesCount * PageSize,
+                                       &Recorder);
+    } else if (LockFreeFreeList) {
+      // Take the whole free list for the duration of the release, so that
+      // none of the blocks it holds can be handed out in the meantime. Any
+      // batch pushed concurrently will not be accounted for, which is safe.
+      SinglyLinkedList<TransferBatch> FreeList;
+      FreeList.clear();
+      popAllBatchesLockFree(Region, &FreeList);
+      if (FreeList.empty())
+        return 0;
+      releaseFreeMemoryToOS(FreeList, Region->RegionBeg, AllocatedPagesCount,
+                            BlockSize, &Recorder, &Counters);
+      pushBatchesLockFree(Region, FreeList.front(), FreeList.back());
+    } else {
+      releaseFreeMemoryToOS(Region->FreeList, Region->RegionBeg,
+                            AllocatedPagesCount, BlockSize, &Recorder,
+                            &Counters);
+      if (Region->Groups.isEnabled())
+        Region->Groups.clearPending();
+    }
 
     if (Recorder.getReleasedRangesCount() > 0) {
-      Region->ReleaseInfo.PushedBlocksAtLastRelease =
-          Region->Stats.PushedBlocks;
+      Region->ReleaseInfo.PushedBlocksAtLastRelease = PushedBlocks;
       Region->ReleaseInfo.RangesReleased += Recorder.getReleasedRangesCount();
       Region->ReleaseInfo.LastReleasedBytes = Recorder.getReleasedBytes();
     }
-    Region->ReleaseInfo.LastReleaseAtNs = getMonotonicTime();
+    atomic_store_relaxed(&Region->ReleaseInfo.LastReleaseAtNs,
+                         getMonotonicTime());
     return Recorder.getReleasedBytes();
   }
 };
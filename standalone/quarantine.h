@@ -168,31 +168,53 @@ private:
 };
 
 // The callback interface is:
-// void Callback::recycle(Node *Ptr);
+// void Callback::recycleBatch(Node **Ptrs, uptr Count);
 // void *Callback::allocate(uptr Size);
 // void Callback::deallocate(void *Ptr);
-template <typename Callback, typename Node> class GlobalQuarantine {
+// recycleBatch is handed all the chunks of a QuarantineBatch at once, which
+// allows for processing them in bulk. It can modify the array.
+//
+// The global quarantine is split into shards, each with its own share of the
+// size limits and its own recycler, a thread draining its cache to the shard
+// of its current CPU. Recycling is FIFO within a shard. The number of shards
+// is set at initialization, and kept low enough for a shard to hold a few
+// thread local caches, so that the recycling doesn't get too eager.
+template <typename Callback, typename Node, u32 MaxNumberOfShards = 8U>
+class GlobalQuarantine {
 public:
   typedef QuarantineCache<Callback> CacheT;
 
   void initLinkerInitialized(uptr Size, uptr CacheSize) {
+    CHECK(setLimits(Size, CacheSize));
+    NumberOfShards = Min(Max(1U, getNumberOfCPUs()), MaxNumberOfShards);
+    if (CacheSize)
+      NumberOfShards = static_cast<u32>(Min(static_cast<uptr>(NumberOfShards),
+                                            Max(1UL, Size / CacheSize / 4)));
+    for (u32 I = 0; I < NumberOfShards; I++)
+      Shards[I].Cache.initLinkerInitialized();
+  }
+  void init(uptr Size, uptr CacheSize) {
+    memset(this, 0, sizeof(*this));
+    initLinkerInitialized(Size, CacheSize);
+  }
+
+  // Can be called at runtime. Chunks in excess of lowered limits are recycled
+  // on the next drain. Returns false if the limits are invalid. The number of
+  // shards is not affected.
+  bool setLimits(uptr Size, uptr CacheSize) {
     // Thread local quarantine size can be zero only when global quarantine size
     // is zero (it allows us to perform just one atomic read per put() call).
-    CHECK((Size == 0 && CacheSize == 0) || CacheSize != 0);
-
+    if (!((Size == 0 && CacheSize == 0) || CacheSize != 0))
+      return false;
     atomic_store_relaxed(&MaxSize, Size);
     atomic_store_relaxed(&MinSize, Size / 10 * 9); // 90% of max size.
     atomic_store_relaxed(&MaxCacheSize, CacheSize);
-
-    Cache.initLinkerInitialized();
-  }
-  void init(uptr Size, uptr CacheSize) {
-    memset(this, 0, sizeof(*this));
-    initLinkerInitialized(Size, CacheSize);
+    return true;
   }
 
   uptr getMaxSize() const { return atomic_load_relaxed(&MaxSize); }
   uptr getCacheSize() const { return atomic_load_relaxed(&MaxCacheSize); }
+  u32 getNumberOfShards() const { return NumberOfShards; }
 
   void put(CacheT *C, Callback Cb, Node *Ptr, uptr Size) {
     C->enqueue(Cb, Ptr, Size);
@@ -200,52 +222,182 @@ public:
       drain(C, Cb);
   }
 
+  // When recycling in the background, a thread draining its cache only
+  // recycles if the shard exceeds HardCapFactor times its limit, throttling
+  // the threads that quarantine faster than the background can recycle.
   void NOINLINE drain(CacheT *C, Callback Cb) {
+    Shard *S = &Shards[getCurrentShardIndex()];
+    {
+      ScopedLock L(S->CacheMutex);
+      S->Cache.transfer(C);
+    }
+    const uptr ShardMaxSize = getMaxSize() / NumberOfShards;
+    if (S->Cache.getSize() <= ShardMaxSize)
+      return;
+    if (atomic_load_relaxed(&BackgroundRecycle)) {
+      if (S->Cache.getSize() <= ShardMaxSize * HardCapFactor)
+        return;
+      atomic_fetch_add(&Stalls, 1U, memory_order_relaxed);
+      S->RecycleMutex.lock();
+      recycle(S, atomic_load_relaxed(&MinSize) / NumberOfShards, Cb);
+      return;
+    }
+    if (S->RecycleMutex.tryLock())
+      recycle(S, atomic_load_relaxed(&MinSize) / NumberOfShards, Cb);
+  }
+
+  // Leaves the recycling to a dedicated thread, that has to periodically call
+  // recycleInBackground.
+  void setBackgroundRecycle(bool Background) {
+    atomic_store_relaxed(&BackgroundRecycle, Background);
+  }
+
+  // Recycles the shards that exceed their limit, and returns the number of
+  // chunks recycled.
+  uptr recycleInBackground(Callback Cb) {
+    const uptr ShardMaxSize = getMaxSize() / NumberOfShards;
+    uptr Recycled = 0;
+    for (u32 I = 0; I < NumberOfShards; I++) {
+      Shard *S = &Shards[I];
+      if (S->Cache.getSize() > ShardMaxSize && S->RecycleMutex.tryLock())
+        Recycled +=
+            recycle(S, atomic_load_relaxed(&MinSize) / NumberOfShards, Cb);
+    }
+    return Recycled;
+  }
+
+  // The bytes in excess of the shard limits, waiting to be recycled.
+  uptr getBacklog() const {
+    const uptr ShardMaxSize = getMaxSize() / NumberOfShards;
+    uptr Backlog = 0;
+    for (u32 I = 0; I < NumberOfShards; I++) {
+      const uptr Size = Shards[I].Cache.getSize();
+      if (Size > ShardMaxSize)
+        Backlog += Size - ShardMaxSize;
+    }
+    return Backlog;
+  }
+
+  // The number of drains that had to recycle despite the background recycle.
+  uptr getStalls() const { return atomic_load_relaxed(&Stalls); }
+
+  // The pages entirely within the chunks of at least Size bytes are released
+  // to the OS as they get quarantined, 0 disabling it. Only the chunk contents
+  // are affected, the header in front of it stays resident for the recycling
+  // to validate it. The platform has to support releasing pages without any
+  // MapPlatformData. Only whole pages are released, hence the page size floor.
+  // The release is up to the callers of put, with releaseChunkPagesMaybe,
+  // which allows for doing it outside of the locks they hold around put.
+  void setReleaseMinSize(uptr Size) {
+    atomic_store_relaxed(&ReleaseMinSize,
+                         Size ? Max(Size, getPageSizeCached()) : 0);
+  }
+
+  uptr getReleasedBytes() const { return atomic_load_relaxed(&ReleasedBytes); }
+
+  // To be called before putting the chunk in the quarantine, as the chunk could
+  // be recycled, and reused, by another thread as soon as it is put.
+  void releaseChunkPagesMaybe(Node *Ptr, uptr Size) {
+    const uptr MinReleaseSize = atomic_load_relaxed(&ReleaseMinSize);
+    if (UNLIKELY(MinReleaseSize && Size >= MinReleaseSize))
+      releaseChunkPages(Ptr, Size);
+  }
+
+  // Drains the cache, and brings the shards exceeding their limit back down to
+  // their share of MinSize, as a regular drain would. Meant to enforce lowered
+  // limits right away, without giving up on the rest of the quarantine.
+  void NOINLINE drainToLimits(CacheT *C, Callback Cb) {
     {
-      ScopedLock L(CacheMutex);
-      Cache.transfer(C);
+      Shard *S = &Shards[getCurrentShardIndex()];
+      ScopedLock L(S->CacheMutex);
+      S->Cache.transfer(C);
+    }
+    const uptr ShardMaxSize = getMaxSize() / NumberOfShards;
+    for (u32 I = 0; I < NumberOfShards; I++) {
+      if (Shards[I].Cache.getSize() <= ShardMaxSize)
+        continue;
+      Shards[I].RecycleMutex.lock();
+      recycle(&Shards[I], atomic_load_relaxed(&MinSize) / NumberOfShards, Cb);
     }
-    if (Cache.getSize() > getMaxSize() && RecyleMutex.tryLock())
-      recycle(atomic_load_relaxed(&MinSize), Cb);
   }
 
   void NOINLINE drainAndRecycle(CacheT *C, Callback Cb) {
     {
-      ScopedLock L(CacheMutex);
-      Cache.transfer(C);
+      Shard *S = &Shards[getCurrentShardIndex()];
+      ScopedLock L(S->CacheMutex);
+      S->Cache.transfer(C);
+    }
+    for (u32 I = 0; I < NumberOfShards; I++) {
+      Shards[I].RecycleMutex.lock();
+      recycle(&Shards[I], 0, Cb);
     }
-    RecyleMutex.lock();
-    recycle(0, Cb);
   }
 
-  void getStats(ScopedString *Str) const {
-    // It assumes that the world is stopped, just as the allocator's printStats.
-    Cache.getStats(Str);
-    Str->append("Quarantine limits: global: %zuK; thread local: %zuK\n",
-                getMaxSize() >> 10, getCacheSize() >> 10);
+  void getStats(ScopedString *Str) {
+    for (u32 I = 0; I < NumberOfShards; I++) {
+      // Only the batches list requires the lock, the sizes are atomic.
+      ScopedLock L(Shards[I].CacheMutex);
+      Shards[I].Cache.getStats(Str);
+    }
+    Str->append("Quarantine limits: global: %zuK; thread local: %zuK; shards: "
+                "%u\n",
+                getMaxSize() >> 10, getCacheSize() >> 10, NumberOfShards);
+    if (atomic_load_relaxed(&BackgroundRecycle))
+      Str->append("Quarantine background recycle: backlog: %zuK; stalls: %zu\n",
+                  getBacklog() >> 10, getStalls());
+    if (atomic_load_relaxed(&ReleaseMinSize))
+      Str->append("Quarantine release: chunks from %zuK; released: %zuK\n",
+                  atomic_load_relaxed(&ReleaseMinSize) >> 10,
+                  getReleasedBytes() >> 10);
   }
 
 private:
+  struct alignas(SCUDO_CACHE_LINE_SIZE) Shard {
+    HybridMutex CacheMutex;
+    CacheT Cache;
+    alignas(SCUDO_CACHE_LINE_SIZE) HybridMutex RecycleMutex;
+  };
+
+  static const uptr HardCapFactor = 2U;
+
   // Read-only data.
-  alignas(SCUDO_CACHE_LINE_SIZE) HybridMutex CacheMutex;
-  CacheT Cache;
-  alignas(SCUDO_CACHE_LINE_SIZE) HybridMutex RecyleMutex;
+  u32 NumberOfShards;
+  atomic_u8 BackgroundRecycle;
+  atomic_uptr Stalls;
+  atomic_uptr ReleaseMinSize;
+  atomic_uptr ReleasedBytes;
   atomic_uptr MinSize;
   atomic_uptr MaxSize;
   alignas(SCUDO_CACHE_LINE_SIZE) atomic_uptr MaxCacheSize;
+  Shard Shards[MaxNumberOfShards];
 
-  void NOINLINE recycle(uptr MinSize, Callback Cb) {
+  u32 getCurrentShardIndex() const {
+    return NumberOfShards == 1U ? 0U : getCurrentCPU() % NumberOfShards;
+  }
+
+  NOINLINE void releaseChunkPages(Node *Ptr, uptr Size) {
+    const uptr PageSize = getPageSizeCached();
+    const uptr Beg = roundUpTo(reinterpret_cast<uptr>(Ptr), PageSize);
+    const uptr End = roundDownTo(reinterpret_cast<uptr>(Ptr) + Size, PageSize);
+    if (Beg >= End)
+      return;
+    releasePagesToOS(Beg, 0, End - Beg);
+    atomic_fetch_add(&ReleasedBytes, End - Beg, memory_order_relaxed);
+  }
+
+  uptr NOINLINE recycle(Shard *S, uptr MinSize, Callback Cb) {
     CacheT Tmp;
     Tmp.init();
     {
-      ScopedLock L(CacheMutex);
+      ScopedLock L(S->CacheMutex);
+      CacheT *Cache = &S->Cache;
       // Go over the batches and merge partially filled ones to
       // save some memory, otherwise batches themselves (since the memory used
       // by them is counted against quarantine limit) can overcome the actual
       // user's quarantined chunks, which diminishes the purpose of the
       // quarantine.
-      const uptr CacheSize = Cache.getSize();
-      const uptr OverheadSize = Cache.getOverheadSize();
+      const uptr CacheSize = Cache->getSize();
+      const uptr OverheadSize = Cache->getOverheadSize();
       DCHECK_GE(CacheSize, OverheadSize);
       // Do the merge only when overhead exceeds this predefined limit (might
       // require some tuning). It saves us merge attempt when the batch list
@@ -254,33 +406,29 @@ private:
       if (CacheSize > OverheadSize &&
           OverheadSize * (100 + OverheadThresholdPercents) >
               CacheSize * OverheadThresholdPercents) {
-        Cache.mergeBatches(&Tmp);
+        Cache->mergeBatches(&Tmp);
       }
       // Extract enough chunks from the quarantine to get below the max
       // quarantine size and leave some leeway for the newly quarantined chunks.
-      while (Cache.getSize() > MinSize)
-        Tmp.enqueueBatch(Cache.dequeueBatch());
+      while (Cache->getSize() > MinSize)
+        Tmp.enqueueBatch(Cache->dequeueBatch());
     }
-    RecyleMutex.unlock();
-    doRecycle(&Tmp, Cb);
+    S->RecycleMutex.unlock();
+    return doRecycle(&Tmp, Cb);
   }
 
-  void NOINLINE doRecycle(CacheT *C, Callback Cb) {
+  // Returns the number of chunks recycled.
+  uptr NOINLINE doRecycle(CacheT *C, Callback Cb) {
+    uptr Recycled = 0;
     while (QuarantineBatch *B = C->dequeueBatch()) {
       const u32 Seed = static_cast<u32>(
           (reinterpret_cast<uptr>(B) ^ reinterpret_cast<uptr>(C)) >> 4);
       B->shuffle(Seed);
-      constexpr uptr NumberOfPrefetch = 8UL;
-      CHECK(NumberOfPrefetch <= ARRAY_SIZE(B->Batch));
-      for (uptr I = 0; I < NumberOfPrefetch; I++)
-        PREFETCH(B->Batch[I]);
-      for (uptr I = 0, Count = B->Count; I < Count; I++) {
-        if (I + NumberOfPrefetch < Count)
-          PREFETCH(B->Batch[I + NumberOfPrefetch]);
-        Cb.recycle(reinterpret_cast<Node *>(B->Batch[I]));
-      }
+      Cb.recycleBatch(reinterpret_cast<Node **>(B->Batch), B->Count);
+      Recycled += B->Count;
       Cb.deallocate(B);
     }
+    return Recycled;
   }
 };
 
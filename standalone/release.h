@@ -11,13 +11,23 @@
 
 #include "common.h"
 #include "list.h"
+#include "mutex.h"
 
 namespace scudo {
 
+enum class ReleaseToOS : u8 {
+  Normal,   // Subject to the release interval.
+  Force,    // Bypass the release interval.
+  ForceAll, // Bypass the release interval, and go through the whole free list.
+};
+
+// With a non-zero Granularity, only the parts of the ranges aligned on it are
+// released, which avoids breaking up the huge pages backing a range.
 class ReleaseRecorder {
 public:
-  ReleaseRecorder(uptr BaseAddress, MapPlatformData *Data = nullptr)
-      : BaseAddress(BaseAddress), Data(Data) {}
+  ReleaseRecorder(uptr BaseAddress, MapPlatformData *Data = nullptr,
+                  uptr Granularity = 0)
+      : BaseAddress(BaseAddress), Data(Data), Granularity(Granularity) {}
 
   uptr getReleasedRangesCount() const { return ReleasedRangesCount; }
 
@@ -25,6 +35,14 @@ public:
 
   // Releases [From, To) range of pages back to OS.
   void releasePageRangeToOS(uptr From, uptr To) {
+    if (Granularity) {
+      const uptr Beg = roundUpTo(BaseAddress + From, Granularity);
+      const uptr End = roundDownTo(BaseAddress + To, Granularity);
+      if (Beg >= End)
+        return;
+      From = Beg - BaseAddress;
+      To = End - BaseAddress;
+    }
     const uptr Size = To - From;
     releasePagesToOS(BaseAddress, From, Size, Data);
     ReleasedRangesCount++;
@@ -36,17 +54,76 @@ private:
   uptr ReleasedBytes = 0;
   uptr BaseAddress = 0;
   MapPlatformData *Data = nullptr;
+  uptr Granularity = 0;
+};
+
+// A scratch buffer for the counters of a release, reused from one release to
+// the next rather than mapping and unmapping a buffer every time. It is only
+// remapped to grow, to a power of two number of pages, and is otherwise zeroed
+// with memset. A single release can use it at a time, the others falling back
+// to mapping their own buffer. The mappings are counted for the benchmarks.
+class PackedCounterBuffer {
+public:
+  // Returns a zeroed buffer of at least Size bytes, or nullptr if it is in use
+  // or could not be mapped. A successful acquire has to be paired with a
+  // release.
+  uptr *acquire(uptr Size) {
+    if (!Mutex.tryLock())
+      return nullptr;
+    if (Size <= Capacity) {
+      memset(Buffer, 0, Size);
+      return Buffer;
+    }
+    if (Buffer)
+      unmap(reinterpret_cast<void *>(Buffer), Capacity);
+    Capacity = roundUpToPowerOfTwo(roundUpTo(Size, getPageSizeCached()));
+    Buffer = reinterpret_cast<uptr *>(
+        map(nullptr, Capacity, "scudo:counters", MAP_ALLOWNOMEM));
+    atomic_fetch_add(&MapCount, 1U, memory_order_relaxed);
+    if (UNLIKELY(!Buffer)) {
+      Capacity = 0;
+      Mutex.unlock();
+    }
+    return Buffer;
+  }
+
+  void release() { Mutex.unlock(); }
+
+  // A release that could not use the buffer mapped its own.
+  void recordFallbackMap() {
+    atomic_fetch_add(&MapCount, 1U, memory_order_relaxed);
+  }
+
+  uptr getCapacity() const { return Capacity; }
+
+  uptr getMapCount() const { return atomic_load_relaxed(&MapCount); }
+
+  void unmapTestOnly() {
+    if (Buffer)
+      unmap(reinterpret_cast<void *>(Buffer), Capacity);
+    Buffer = nullptr;
+    Capacity = 0;
+  }
+
+private:
+  HybridMutex Mutex;
+  uptr *Buffer;
+  uptr Capacity;
+  atomic_uptr MapCount;
 };
 
 // A packed array of Counters. Each counter occupies 2^N bits, enough to store
-// counter's MaxValue. Ctor will try to allocate the required Buffer via map()
-// and the caller is expected to check whether the initialization was successful
-// by checking isAllocated() result. For the performance sake, none of the
-// accessors check the validity of the arguments, It is assumed that Index is
-// always in [0, N) range and the value is not incremented past MaxValue.
+// counter's MaxValue. Ctor will try to get the required Buffer from Scratch if
+// provided, or to allocate it via map() otherwise, and the caller is expected
+// to check whether the initialization was successful by checking isAllocated()
+// result. For the performance sake, none of the accessors check the validity of
+// the arguments, It is assumed that Index is always in [0, N) range and the
+// value is not incremented past MaxValue.
 class PackedCounterArray {
 public:
-  PackedCounterArray(uptr NumCounters, uptr MaxValue) : N(NumCounters) {
+  PackedCounterArray(uptr NumCounters, uptr MaxValue,
+                     PackedCounterBuffer *Scratch = nullptr)
+      : N(NumCounters) {
     CHECK_GT(NumCounters, 0);
     CHECK_GT(MaxValue, 0);
     constexpr uptr MaxCounterBits = sizeof(*Buffer) * 8UL;
@@ -66,11 +143,21 @@ public:
     BufferSize = (roundUpTo(N, static_cast<uptr>(1U) << PackingRatioLog) >>
                   PackingRatioLog) *
                  sizeof(*Buffer);
+    if (Scratch) {
+      Buffer = Scratch->acquire(BufferSize);
+      if (Buffer) {
+        this->Scratch = Scratch;
+        return;
+      }
+      Scratch->recordFallbackMap();
+    }
     Buffer = reinterpret_cast<uptr *>(
         map(nullptr, BufferSize, "scudo:counters", MAP_ALLOWNOMEM));
   }
   ~PackedCounterArray() {
-    if (isAllocated())
+    if (Scratch)
+      Scratch->release();
+    else if (isAllocated())
       unmap(reinterpret_cast<void *>(Buffer), BufferSize);
   }
 
@@ -110,6 +197,124 @@ private:
 
   uptr BufferSize;
   uptr *Buffer;
+  PackedCounterBuffer *Scratch = nullptr;
+};
+
+// Tracks the number of free blocks within groups of contiguous blocks of a
+// region, as well as the groups that became entirely free since the last
+// release. Releasing memory then only has to visit those groups, rather than
+// counting every block of the free list for every page of the region, making
+// its cost proportional to the recent churn instead of to the size of the heap.
+// Groups span at least 2^GroupSizeLog bytes, and always hold a whole number of
+// blocks. The blocks past the end of the allocated part of the region are
+// accounted for as free. This is not thread-safe, the caller is expected to
+// hold the lock of the region.
+class FreeBlockGroups {
+public:
+  static const uptr GroupSizeLog = 16U;
+
+  bool init(uptr RegionSize, uptr BlockSize) {
+    BlocksPerGroup =
+        Max(static_cast<uptr>(1U), (1UL << GroupSizeLog) / BlockSize);
+    CHECK_LE(BlocksPerGroup, static_cast<u16>(~0U));
+    GroupSize = BlocksPerGroup * BlockSize;
+    NumGroups = RegionSize / GroupSize + 1;
+    const uptr PendingSize = roundUpTo(NumGroups, BitsPerWord) / BitsPerWord;
+    BufferSize = roundUpTo(PendingSize * sizeof(uptr) + NumGroups * sizeof(u16),
+                           getPageSizeCached());
+    Pending = reinterpret_cast<uptr *>(
+        map(nullptr, BufferSize, "scudo:groups", MAP_ALLOWNOMEM));
+    if (!Pending)
+      return false;
+    FreeCounts = reinterpret_cast<u16 *>(Pending + PendingSize);
+    return true;
+  }
+
+  void unmapTestOnly() {
+    if (isEnabled())
+      unmap(reinterpret_cast<void *>(Pending), BufferSize);
+  }
+
+  bool isEnabled() const { return !!Pending; }
+
+  // The allocated part of the region grew from From to To bytes, the new
+  // blocks all being free. The group straddling From was accounted for already.
+  void addBlocks(uptr From, uptr To) {
+    for (uptr I = (From + GroupSize - 1) / GroupSize; I * GroupSize < To; I++)
+      FreeCounts[I] = static_cast<u16>(BlocksPerGroup);
+  }
+
+  // Offset is the offset of a block from the beginning of the region.
+  void markFree(uptr Offset) {
+    const uptr I = Offset / GroupSize;
+    DCHECK_LT(FreeCounts[I], BlocksPerGroup);
+    if (++FreeCounts[I] == BlocksPerGroup)
+      Pending[I / BitsPerWord] |= static_cast<uptr>(1U) << (I % BitsPerWord);
+  }
+
+  void markUsed(uptr Offset) {
+    const uptr I = Offset / GroupSize;
+    DCHECK_GT(FreeCounts[I], 0);
+    FreeCounts[I]--;
+  }
+
+  // Releases the pages of the groups that are still entirely free out of the
+  // ones that became so since the last call, merging contiguous groups.
+  // AllocatedSize is the page rounded size of the allocated part of the region.
+  template <class ReleaseRecorderT>
+  void releaseFreeGroups(uptr AllocatedSize, ReleaseRecorderT *Recorder) {
+    const uptr PageSize = getPageSizeCached();
+    const uptr PendingSize =
+        roundUpTo((AllocatedSize + GroupSize - 1) / GroupSize, BitsPerWord) /
+        BitsPerWord;
+    uptr RangeBeg = 0;
+    uptr RangeEnd = 0;
+    for (uptr I = 0; I < PendingSize; I++) {
+      uptr Bits = Pending[I];
+      if (!Bits)
+        continue;
+      Pending[I] = 0;
+      while (Bits) {
+        const uptr J = I * BitsPerWord + getLeastSignificantSetBitIndex(Bits);
+        Bits &= Bits - 1;
+        if (FreeCounts[J] != BlocksPerGroup)
+          continue;
+        const uptr Beg = J * GroupSize;
+        if (Beg != RangeEnd) {
+          releaseRange(RangeBeg, RangeEnd, PageSize, Recorder);
+          RangeBeg = Beg;
+        }
+        RangeEnd = Min(Beg + GroupSize, AllocatedSize);
+      }
+    }
+    releaseRange(RangeBeg, RangeEnd, PageSize, Recorder);
+  }
+
+  // To be called after a full release of the free list, which took care of
+  // the pending groups as well.
+  void clearPending() {
+    memset(Pending, 0, roundUpTo(NumGroups, BitsPerWord) / BitsPerWord *
+                           sizeof(uptr));
+  }
+
+private:
+  static const uptr BitsPerWord = sizeof(uptr) * 8UL;
+
+  template <class ReleaseRecorderT>
+  static void releaseRange(uptr Beg, uptr End, uptr PageSize,
+                           ReleaseRecorderT *Recorder) {
+    Beg = roundUpTo(Beg, PageSize);
+    End = roundDownTo(End, PageSize);
+    if (Beg < End)
+      Recorder->releasePageRangeToOS(Beg, End);
+  }
+
+  uptr BlocksPerGroup;
+  uptr GroupSize;
+  uptr NumGroups;
+  uptr BufferSize;
+  uptr *Pending;
+  u16 *FreeCounts;
 };
 
 template <class ReleaseRecorderT> class FreePagesRangeTracker {
@@ -151,7 +356,8 @@ template <class TransferBatchT, class ReleaseRecorderT>
 NOINLINE void
 releaseFreeMemoryToOS(const IntrusiveList<TransferBatchT> &FreeList, uptr Base,
                       uptr AllocatedPagesCount, uptr BlockSize,
-                      ReleaseRecorderT *Recorder) {
+                      ReleaseRecorderT *Recorder,
+                      PackedCounterBuffer *Scratch = nullptr) {
   const uptr PageSize = getPageSizeCached();
 
   // Figure out the number of chunks per page and whether we can take a fast
@@ -188,7 +394,8 @@ releaseFreeMemoryToOS(const IntrusiveList<TransferBatchT> &FreeList, uptr Base,
     }
   }
 
-  PackedCounterArray Counters(AllocatedPagesCount, FullPagesBlockCountMax);
+  PackedCounterArray Counters(AllocatedPagesCount, FullPagesBlockCountMax,
+                             Scratch);
   if (!Counters.isAllocated())
     return;
 
@@ -105,6 +105,11 @@ void NORETURN reportOutOfMemory(uptr RequestedSize) {
   Report.append("out of memory trying to allocate %zu bytes\n", RequestedSize);
 }
 
+void NORETURN reportRssLimitExceeded(uptr RssLimitMb) {
+  ScopedErrorReport Report;
+  Report.append("RSS limit of %zuMB exceeded\n", RssLimitMb);
+}
+
 static const char *stringifyAction(AllocatorAction Action) {
   switch (Action) {
   case AllocatorAction::Recycling:
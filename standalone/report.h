@@ -33,6 +33,7 @@ void NORETURN reportAlignmentTooBig(uptr Alignment, uptr MaxAlignment);
 void NORETURN reportAllocationSizeTooBig(uptr UserSize, uptr TotalSize,
                                          uptr MaxSize);
 void NORETURN reportOutOfMemory(uptr RequestedSize);
+void NORETURN reportRssLimitExceeded(uptr RssLimitMb);
 enum class AllocatorAction : u8 {
   Recycling,
   Deallocating,
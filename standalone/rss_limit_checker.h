@@ -0,0 +1,88 @@
+//===-- rss_limit_checker.h -------------------------------------*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef SCUDO_RSS_LIMIT_CHECKER_H_
+#define SCUDO_RSS_LIMIT_CHECKER_H_
+
+#include "atomic_helpers.h"
+#include "common.h"
+
+namespace scudo {
+
+// Keeps an approximation of the RSS of the process, in order to enforce the
+// rss_limit_mb flag. Measuring the RSS requires a system call, so it is only
+// updated at a bounded rate. In between updates, the bytes that were about to
+// be committed are added to the last measured RSS: this estimate crossing the
+// limit triggers an early update, unless the limit was already exceeded at the
+// last one, which must not trigger one update per allocation. The outcome of the last update is a single
+// boolean, cheap enough to be checked on every allocation.
+class RssLimitChecker {
+public:
+  static const u64 UpdateIntervalNs = 250ULL * 1000000ULL;
+
+  void initLinkerInitialized(s32 RssLimitMb) {
+    LimitMb = RssLimitMb > 0 ? static_cast<uptr>(RssLimitMb) : 0;
+  }
+  void init(s32 RssLimitMb) {
+    memset(this, 0, sizeof(*this));
+    initLinkerInitialized(RssLimitMb);
+  }
+
+  bool isEnabled() const { return LimitMb != 0; }
+
+  uptr getLimitMb() const { return LimitMb; }
+
+  bool isLimitExceeded() const {
+    return atomic_load_relaxed(&LimitExceeded) != 0;
+  }
+
+  void addCommittedBytes(uptr Bytes) {
+    if (Bytes)
+      atomic_fetch_add(&CommittedBytes, Bytes, memory_order_relaxed);
+  }
+
+  // Returns true if an update is due, in which case the caller is the only one
+  // in charge of the update until it calls finishUpdate.
+  bool tryStartUpdate() {
+    const uptr EstimatedRss = atomic_load_relaxed(&LastRss) +
+                              atomic_load_relaxed(&CommittedBytes);
+    if (getMonotonicTime() < atomic_load_relaxed(&NextUpdateAtNs) &&
+        (isLimitExceeded() || EstimatedRss <= (LimitMb << 20)))
+      return false;
+    return atomic_exchange(&Updating, 1U, memory_order_acquire) == 0;
+  }
+
+  // Measures the RSS, and returns true if it is past the limit.
+  bool update() {
+    const uptr Rss = getRSS();
+    atomic_store_relaxed(&LastRss, Rss);
+    atomic_store_relaxed(&CommittedBytes, 0);
+    atomic_store_relaxed(&NextUpdateAtNs,
+                         getMonotonicTime() + UpdateIntervalNs);
+    return Rss > (LimitMb << 20);
+  }
+
+  void finishUpdate(bool Exceeded) {
+    atomic_store_relaxed(&LimitExceeded, Exceeded ? 1U : 0U);
+    atomic_store(&Updating, 0U, memory_order_release);
+  }
+
+  uptr getLastRss() const { return atomic_load_relaxed(&LastRss); }
+
+private:
+  uptr LimitMb;
+  atomic_u8 LimitExceeded;
+  atomic_u8 Updating;
+  atomic_uptr LastRss;
+  atomic_uptr CommittedBytes;
+  atomic_u64 NextUpdateAtNs;
+};
+
+} // namespace scudo
+
+#endif // SCUDO_RSS_LIMIT_CHECKER_H_
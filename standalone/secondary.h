@@ -31,6 +31,9 @@ struct Header {
   uptr BlockEnd;
   uptr MapBase;
   uptr MapSize;
+  // Time at which a cached block was freed, or 0 if its pages were released.
+  u64 Time;
+  u32 ShardIndex;
   MapPlatformData Data;
 };
 
@@ -47,17 +50,41 @@ static Header *getHeader(const void *Ptr) {
 }
 
 } // namespace LargeBlock
-
+// Freed blocks are kept in a cache, bucketed by size, to be reused for
+// allocations of a similar size. The pages of a cached block are only released
+// to the OS once it has been in the cache for release_to_os_interval_ms, so
+// that a block that is quickly reused doesn't have to be faulted in again.
+// The cache is bounded both in number of blocks, and in total size.
+// In order to reduce contention, the allocator is split into shards, each with
+// its own mutex, in-use list and cache. Allocations are serviced by the shard
+// of the CPU the thread runs on, falling back to the caches of the other
+// shards, and blocks are returned to their own shard. The limits of the cache
+// are shared by all the shards.
 template <uptr MaxFreeListSize = 32U> class MapAllocator {
 public:
-  void initLinkerInitialized(GlobalStats *S) {
-    Stats.initLinkerInitialized();
-    if (LIKELY(S))
-      S->link(&Stats);
+  static const uptr DefaultMaxCachedBytes =
+      static_cast<uptr>(FIRST_32_SECOND_64(16U, 64U)) << 20;
+  static const u32 MaxNumberOfShards = 16U;
+
+  void initLinkerInitialized(GlobalStats *S, s32 ReleaseToOsInterval = -1) {
+    NumberOfShards = Min(Max(1U, getNumberOfCPUs()), MaxNumberOfShards);
+    for (u32 I = 0; I < NumberOfShards; I++) {
+      ShardInfo *Shard = &Shards[I];
+      Shard->Stats.initLinkerInitialized();
+      if (LIKELY(S))
+        S->link(&Shard->Stats);
+      Shard->InUseBlocks.clear();
+      for (uptr J = 0; J < NumBuckets; J++)
+        Shard->Buckets[J].clear();
+    }
+    atomic_store_relaxed(&MaxFreeListCount, static_cast<u32>(MaxFreeListSize));
+    atomic_store_relaxed(&MaxFreeBlockSize, ~static_cast<uptr>(0));
+    atomic_store_relaxed(&MaxCachedBytes, DefaultMaxCachedBytes);
+    atomic_store_relaxed(&ReleaseToOsIntervalMs, ReleaseToOsInterval);
   }
-  void init(GlobalStats *S) {
+  void init(GlobalStats *S, s32 ReleaseToOsInterval = -1) {
     memset(this, 0, sizeof(*this));
-    initLinkerInitialized(S);
+    initLinkerInitialized(S, ReleaseToOsInterval);
   }
 
   void *allocate(uptr Size, uptr AlignmentHint = 0, uptr *BlockEnd = nullptr,
@@ -65,6 +92,8 @@ public:
 
   void deallocate(void *Ptr);
 
+  void *reallocate(void *Ptr, uptr Size, uptr *BlockEnd = nullptr);
+
   static uptr getBlockEnd(void *Ptr) {
     return LargeBlock::getHeader(Ptr)->BlockEnd;
   }
@@ -75,28 +104,151 @@ public:
 
   void getStats(ScopedString *Str) const;
 
-  void disable() { Mutex.lock(); }
+  void disable() {
+    for (u32 I = 0; I < NumberOfShards; I++)
+      Shards[I].Mutex.lock();
+  }
 
-  void enable() { Mutex.unlock(); }
+  void enable() {
+    for (s32 I = static_cast<s32>(NumberOfShards) - 1; I >= 0; I--)
+      Shards[I].Mutex.unlock();
+  }
 
   template <typename F> void iterateOverBlocks(F Callback) const {
-    for (const auto &H : InUseBlocks)
-      Callback(reinterpret_cast<uptr>(&H) + LargeBlock::getHeaderSize());
+    for (u32 I = 0; I < NumberOfShards; I++)
+      for (const auto &H : Shards[I].InUseBlocks)
+        Callback(reinterpret_cast<uptr>(&H) + LargeBlock::getHeaderSize());
   }
 
   static uptr getMaxFreeListSize(void) { return MaxFreeListSize; }
 
+  // The number of cached blocks can only be lowered from the compile time
+  // maximum. Blocks in excess of the new limits are unmapped right away.
+  bool setOption(Option O, sptr Value) {
+    if (O == Option::ReleaseInterval) {
+      atomic_store_relaxed(&ReleaseToOsIntervalMs, static_cast<s32>(Value));
+      return true;
+    }
+    if (Value < 0)
+      return false;
+    const uptr V = static_cast<uptr>(Value);
+    if (O == Option::MaxCacheEntriesCount)
+      atomic_store_relaxed(&MaxFreeListCount,
+                           static_cast<u32>(Min(V, MaxFreeListSize)));
+    else if (O == Option::MaxCacheEntrySize)
+      atomic_store_relaxed(&MaxFreeBlockSize, V);
+    else if (O == Option::MaxCacheTotalSize)
+      atomic_store_relaxed(&MaxCachedBytes, V);
+    else
+      return false;
+    trimFreeBlocks();
+    return true;
+  }
+
+  // Releases the pages of the cached blocks that have been freed for longer
+  // than the release interval, or of all of them for releaseToOS. Returns the
+  // number of bytes released.
+  uptr releaseOldBlocksToOS() {
+    const s32 IntervalMs = atomic_load_relaxed(&ReleaseToOsIntervalMs);
+    if (IntervalMs < 0)
+      return 0;
+    const u64 Now = getMonotonicTime();
+    const u64 IntervalNs = static_cast<u64>(IntervalMs) * 1000000ULL;
+    if (Now < IntervalNs)
+      return 0;
+    uptr ReleasedBytes = 0;
+    for (u32 I = 0; I < NumberOfShards; I++) {
+      ScopedLock L(Shards[I].Mutex);
+      ReleasedBytes += releaseOlderThan(&Shards[I], Now - IntervalNs);
+    }
+    return ReleasedBytes;
+  }
+  uptr releaseToOS() {
+    uptr ReleasedBytes = 0;
+    for (u32 I = 0; I < NumberOfShards; I++) {
+      ScopedLock L(Shards[I].Mutex);
+      ReleasedBytes += releaseOlderThan(&Shards[I], ~static_cast<u64>(0));
+    }
+    return ReleasedBytes;
+  }
+
 private:
-  HybridMutex Mutex;
-  DoublyLinkedList<LargeBlock::Header> InUseBlocks;
-  // The free list is sorted based on the committed size of blocks.
-  DoublyLinkedList<LargeBlock::Header> FreeBlocks;
-  uptr AllocatedBytes;
-  uptr FreedBytes;
-  uptr LargestSize;
-  u32 NumberOfAllocs;
-  u32 NumberOfFrees;
-  LocalStats Stats;
+  // Buckets hold blocks of an exact number of pages up to 8 pages, and then
+  // 4 buckets per power of 2, the last one holding all the larger blocks.
+  static const uptr NumBuckets = 64U;
+
+  struct ALIGNED(SCUDO_CACHE_LINE_SIZE) ShardInfo {
+    HybridMutex Mutex;
+    DoublyLinkedList<LargeBlock::Header> InUseBlocks;
+    // Each bucket is used as a stack, the most recently freed blocks first, as
+    // they are the least likely to have had their pages released.
+    DoublyLinkedList<LargeBlock::Header> Buckets[NumBuckets];
+    // Lower bound of the free time of the cached blocks that still have their
+    // pages, to avoid looking through the cache when nothing is due for
+    // release.
+    u64 OldestTime;
+    // The counters are only ever updated with the mutex held, but can be read
+    // without it, see getStats.
+    atomic_uptr AllocatedBytes;
+    atomic_uptr FreedBytes;
+    atomic_uptr LargestSize;
+    atomic_u32 NumberOfAllocs;
+    atomic_u32 NumberOfFrees;
+    LocalStats Stats;
+  };
+
+  static uptr getBucketIndex(uptr Size) {
+    const uptr Pages = Size >> getLog2(getPageSizeCached());
+    DCHECK_GT(Pages, 0U);
+    if (Pages <= 8U)
+      return Pages - 1;
+    const uptr L = getMostSignificantSetBitIndex(Pages);
+    return Min(8U + ((L - 3U) << 2) + ((Pages >> (L - 2U)) & 3U),
+               NumBuckets - 1);
+  }
+
+  static uptr getCommitSize(const LargeBlock::Header *H) {
+    return H->BlockEnd - reinterpret_cast<uptr>(H);
+  }
+
+  u32 getCurrentShardIndex() const {
+    return NumberOfShards == 1U ? 0U : getCurrentCPU() % NumberOfShards;
+  }
+
+  // Stores with release semantics, so that the frees can be read before the
+  // allocations without the mutex, and never exceed them.
+  template <typename T> static void addToStat(T *Stat, typename T::Type V) {
+    atomic_store(Stat, atomic_load_relaxed(Stat) + V, memory_order_release);
+  }
+
+  static void unmapBlock(LargeBlock::Header *H) {
+    MapPlatformData Data = H->Data;
+    unmap(reinterpret_cast<void *>(H->MapBase), H->MapSize, UNMAP_ALL, &Data);
+  }
+
+  void reuseCachedBlock(ShardInfo *Shard, LargeBlock::Header *H) {
+    const uptr FreeBlockSize = getCommitSize(H);
+    Shard->InUseBlocks.push_back(H);
+    addToStat(&Shard->AllocatedBytes, FreeBlockSize);
+    addToStat(&Shard->NumberOfAllocs, 1U);
+    Shard->Stats.add(StatAllocated, FreeBlockSize);
+  }
+
+  LargeBlock::Header *retrieveFromCache(ShardInfo *Shard, uptr Size);
+  LargeBlock::Header *retrieveFromOtherShards(u32 ShardIndex, uptr Size);
+  bool storeInCache(ShardInfo *Shard, LargeBlock::Header *H);
+  uptr releaseOlderThan(ShardInfo *Shard, u64 Time);
+  void trimFreeBlocks();
+
+  ShardInfo Shards[MaxNumberOfShards];
+  u32 NumberOfShards;
+  // Number and total size of the blocks cached by all the shards.
+  atomic_uptr CachedCount;
+  atomic_uptr CachedBytes;
+  atomic_u32 MaxFreeListCount;
+  atomic_uptr MaxFreeBlockSize;
+  atomic_uptr MaxCachedBytes;
+  atomic_s32 ReleaseToOsIntervalMs;
 };
 
 // As with the Primary, the size passed to this function includes any desired
@@ -118,27 +270,33 @@ void *MapAllocator<MaxFreeListSize>::allocate(uptr Size, uptr AlignmentHint,
   const uptr PageSize = getPageSizeCached();
   const uptr RoundedSize =
       roundUpTo(Size + LargeBlock::getHeaderSize(), PageSize);
+  const u32 ShardIndex = getCurrentShardIndex();
+  ShardInfo *Shard = &Shards[ShardIndex];
 
   if (MaxFreeListSize && AlignmentHint < PageSize) {
-    ScopedLock L(Mutex);
-    for (auto &H : FreeBlocks) {
-      const uptr FreeBlockSize = H.BlockEnd - reinterpret_cast<uptr>(&H);
-      if (FreeBlockSize < RoundedSize)
-        continue;
-      // Candidate free block should only be at most 4 pages larger.
-      if (FreeBlockSize > RoundedSize + 4 * PageSize)
-        break;
-      FreeBlocks.remove(&H);
-      InUseBlocks.push_back(&H);
-      AllocatedBytes += FreeBlockSize;
-      NumberOfAllocs++;
-      Stats.add(StatAllocated, FreeBlockSize);
+    LargeBlock::Header *H;
+    {
+      ScopedLock L(Shard->Mutex);
+      H = retrieveFromCache(Shard, RoundedSize);
+      if (H)
+        reuseCachedBlock(Shard, H);
+    }
+    if (!H && NumberOfShards > 1U) {
+      H = retrieveFromOtherShards(ShardIndex, RoundedSize);
+      if (H) {
+        ScopedLock L(Shard->Mutex);
+        H->ShardIndex = ShardIndex;
+        Shard->Stats.add(StatMapped, H->MapSize);
+        reuseCachedBlock(Shard, H);
+      }
+    }
+    if (H) {
       if (BlockEnd)
-        *BlockEnd = H.BlockEnd;
-      void *Ptr = reinterpret_cast<void *>(reinterpret_cast<uptr>(&H) +
+        *BlockEnd = H->BlockEnd;
+      void *Ptr = reinterpret_cast<void *>(reinterpret_cast<uptr>(H) +
                                            LargeBlock::getHeaderSize());
       if (ZeroContents)
-        memset(Ptr, 0, H.BlockEnd - reinterpret_cast<uptr>(Ptr));
+        memset(Ptr, 0, H->BlockEnd - reinterpret_cast<uptr>(Ptr));
       return Ptr;
     }
   }
@@ -186,16 +344,18 @@ void *MapAllocator<MaxFreeListSize>::allocate(uptr Size, uptr AlignmentHint,
   H->MapBase = MapBase;
   H->MapSize = MapEnd - MapBase;
   H->BlockEnd = CommitBase + CommitSize;
+  H->Time = 0;
+  H->ShardIndex = ShardIndex;
   H->Data = Data;
   {
-    ScopedLock L(Mutex);
-    InUseBlocks.push_back(H);
-    AllocatedBytes += CommitSize;
-    if (LargestSize < CommitSize)
-      LargestSize = CommitSize;
-    NumberOfAllocs++;
-    Stats.add(StatAllocated, CommitSize);
-    Stats.add(StatMapped, H->MapSize);
+    ScopedLock L(Shard->Mutex);
+    Shard->InUseBlocks.push_back(H);
+    addToStat(&Shard->AllocatedBytes, CommitSize);
+    if (atomic_load_relaxed(&Shard->LargestSize) < CommitSize)
+      atomic_store_relaxed(&Shard->LargestSize, CommitSize);
+    addToStat(&Shard->NumberOfAllocs, 1U);
+    Shard->Stats.add(StatAllocated, CommitSize);
+    Shard->Stats.add(StatMapped, H->MapSize);
   }
   if (BlockEnd)
     *BlockEnd = CommitBase + CommitSize;
@@ -205,50 +365,274 @@ void *MapAllocator<MaxFreeListSize>::allocate(uptr Size, uptr AlignmentHint,
 template <uptr MaxFreeListSize>
 void MapAllocator<MaxFreeListSize>::deallocate(void *Ptr) {
   LargeBlock::Header *H = LargeBlock::getHeader(Ptr);
+  ShardInfo *Shard = &Shards[H->ShardIndex];
   {
-    ScopedLock L(Mutex);
-    InUseBlocks.remove(H);
-    const uptr CommitSize = H->BlockEnd - reinterpret_cast<uptr>(H);
-    FreedBytes += CommitSize;
-    NumberOfFrees++;
-    Stats.sub(StatAllocated, CommitSize);
-    if (MaxFreeListSize && FreeBlocks.size() < MaxFreeListSize) {
-      bool Inserted = false;
-      for (auto &F : FreeBlocks) {
-        const uptr FreeBlockSize = F.BlockEnd - reinterpret_cast<uptr>(&F);
-        if (FreeBlockSize >= CommitSize) {
-          FreeBlocks.insert(H, &F);
-          Inserted = true;
-          break;
+    ScopedLock L(Shard->Mutex);
+    Shard->InUseBlocks.remove(H);
+    const uptr CommitSize = getCommitSize(H);
+    addToStat(&Shard->FreedBytes, CommitSize);
+    addToStat(&Shard->NumberOfFrees, 1U);
+    Shard->Stats.sub(StatAllocated, CommitSize);
+    if (MaxFreeListSize && storeInCache(Shard, H))
+      return;
+    Shard->Stats.sub(StatMapped, H->MapSize);
+  }
+  unmapBlock(H);
+}
+
+// Returns a cached block of at least Size bytes, and at most 4 pages larger,
+// or null if there is none. This only looks at the buckets that can hold such
+// blocks, the first fitting block of a bucket being the most recently freed.
+template <uptr MaxFreeListSize>
+LargeBlock::Header *
+MapAllocator<MaxFreeListSize>::retrieveFromCache(ShardInfo *Shard,
+                                                 uptr Size) {
+  if (!atomic_load_relaxed(&CachedCount))
+    return nullptr;
+  const uptr MaxSize = Size + 4 * getPageSizeCached();
+  const uptr LastIndex = getBucketIndex(MaxSize);
+  for (uptr I = getBucketIndex(Size); I <= LastIndex; I++) {
+    for (auto &H : Shard->Buckets[I]) {
+      const uptr FreeBlockSize = getCommitSize(&H);
+      if (FreeBlockSize < Size || FreeBlockSize > MaxSize)
+        continue;
+      Shard->Buckets[I].remove(&H);
+      atomic_fetch_sub(&CachedCount, 1U, memory_order_relaxed);
+      atomic_fetch_sub(&CachedBytes, FreeBlockSize, memory_order_relaxed);
+      return &H;
+    }
+  }
+  return nullptr;
+}
+
+// Looks for a cached block in the shards other than ShardIndex, skipping those
+// that are busy. The block is returned unaccounted for in its former shard.
+template <uptr MaxFreeListSize>
+LargeBlock::Header *
+MapAllocator<MaxFreeListSize>::retrieveFromOtherShards(u32 ShardIndex,
+                                                       uptr Size) {
+  for (u32 I = 1; I < NumberOfShards; I++) {
+    if (!atomic_load_relaxed(&CachedCount))
+      return nullptr;
+    ShardInfo *Shard = &Shards[(ShardIndex + I) % NumberOfShards];
+    if (!Shard->Mutex.tryLock())
+      continue;
+    LargeBlock::Header *H = retrieveFromCache(Shard, Size);
+    if (H)
+      Shard->Stats.sub(StatMapped, H->MapSize);
+    Shard->Mutex.unlock();
+    if (H)
+      return H;
+  }
+  return nullptr;
+}
+
+// Puts a freed block in the cache, provided it fits within the limits. With a
+// negative release interval, its pages are released right away, otherwise it
+// is timestamped, and the blocks freed for long enough get released.
+template <uptr MaxFreeListSize>
+bool MapAllocator<MaxFreeListSize>::storeInCache(ShardInfo *Shard,
+                                                 LargeBlock::Header *H) {
+  const uptr CommitSize = getCommitSize(H);
+  if (CommitSize > atomic_load_relaxed(&MaxFreeBlockSize))
+    return false;
+  // Reserve some room in the cache, which is shared with the other shards.
+  // Only what was reserved is given back if either limit is exceeded.
+  if (atomic_fetch_add(&CachedCount, 1U, memory_order_relaxed) >=
+      atomic_load_relaxed(&MaxFreeListCount)) {
+    atomic_fetch_sub(&CachedCount, 1U, memory_order_relaxed);
+    return false;
+  }
+  if (atomic_fetch_add(&CachedBytes, CommitSize, memory_order_relaxed) +
+          CommitSize >
+      atomic_load_relaxed(&MaxCachedBytes)) {
+    atomic_fetch_sub(&CachedCount, 1U, memory_order_relaxed);
+    atomic_fetch_sub(&CachedBytes, CommitSize, memory_order_relaxed);
+    return false;
+  }
+  Shard->Buckets[getBucketIndex(CommitSize)].push_front(H);
+  const s32 IntervalMs = atomic_load_relaxed(&ReleaseToOsIntervalMs);
+  H->Time = getMonotonicTime();
+  if (!Shard->OldestTime)
+    Shard->OldestTime = H->Time;
+  if (IntervalMs < 0) {
+    releaseOlderThan(Shard, H->Time);
+  } else {
+    const u64 IntervalNs = static_cast<u64>(IntervalMs) * 1000000ULL;
+    if (H->Time >= IntervalNs && Shard->OldestTime <= H->Time - IntervalNs)
+      releaseOlderThan(Shard, H->Time - IntervalNs);
+  }
+  return true;
+}
+
+template <uptr MaxFreeListSize>
+uptr MapAllocator<MaxFreeListSize>::releaseOlderThan(ShardInfo *Shard,
+                                                     u64 Time) {
+  if (!Shard->OldestTime || Shard->OldestTime > Time)
+    return 0;
+  const uptr PageSize = getPageSizeCached();
+  uptr ReleasedBytes = 0;
+  u64 NewOldestTime = 0;
+  for (uptr I = 0; I < NumBuckets; I++) {
+    for (auto &H : Shard->Buckets[I]) {
+      if (!H.Time)
+        continue;
+      if (H.Time > Time) {
+        if (!NewOldestTime || H.Time < NewOldestTime)
+          NewOldestTime = H.Time;
+        continue;
+      }
+      const uptr RoundedAllocationStart = roundUpTo(
+          reinterpret_cast<uptr>(&H) + LargeBlock::getHeaderSize(), PageSize);
+      MapPlatformData Data = H.Data;
+      releasePagesToOS(H.MapBase, RoundedAllocationStart - H.MapBase,
+                       H.BlockEnd - RoundedAllocationStart, &Data);
+      ReleasedBytes += H.BlockEnd - RoundedAllocationStart;
+      H.Time = 0;
+    }
+  }
+  Shard->OldestTime = NewOldestTime;
+  return ReleasedBytes;
+}
+
+// The larger blocks of each shard are evicted first when there are too many,
+// or their total size is too large.
+template <uptr MaxFreeListSize>
+void MapAllocator<MaxFreeListSize>::trimFreeBlocks() {
+  const uptr MaxCount = atomic_load_relaxed(&MaxFreeListCount);
+  const uptr MaxSize = atomic_load_relaxed(&MaxFreeBlockSize);
+  const uptr MaxBytes = atomic_load_relaxed(&MaxCachedBytes);
+  for (u32 S = 0; S < NumberOfShards; S++) {
+    ShardInfo *Shard = &Shards[S];
+    DoublyLinkedList<LargeBlock::Header> Trimmed;
+    Trimmed.clear();
+    {
+      ScopedLock L(Shard->Mutex);
+      for (uptr I = NumBuckets; I-- > 0;) {
+        auto &Bucket = Shard->Buckets[I];
+        for (LargeBlock::Header *H = Bucket.front(); H;) {
+          LargeBlock::Header *Next = H->Next;
+          const uptr FreeBlockSize = getCommitSize(H);
+          if (atomic_load_relaxed(&CachedCount) > MaxCount ||
+              atomic_load_relaxed(&CachedBytes) > MaxBytes ||
+              FreeBlockSize > MaxSize) {
+            Bucket.remove(H);
+            atomic_fetch_sub(&CachedCount, 1U, memory_order_relaxed);
+            atomic_fetch_sub(&CachedBytes, FreeBlockSize,
+                             memory_order_relaxed);
+            Trimmed.push_back(H);
+            Shard->Stats.sub(StatMapped, H->MapSize);
+          }
+          H = Next;
         }
       }
-      if (!Inserted)
-        FreeBlocks.push_back(H);
-      const uptr RoundedAllocationStart =
-          roundUpTo(reinterpret_cast<uptr>(H) + LargeBlock::getHeaderSize(),
-                    getPageSizeCached());
-      MapPlatformData Data = H->Data;
-      // TODO(kostyak): use release_to_os_interval_ms
-      releasePagesToOS(H->MapBase, RoundedAllocationStart - H->MapBase,
-                       H->BlockEnd - RoundedAllocationStart, &Data);
-      return;
     }
-    Stats.sub(StatMapped, H->MapSize);
+    while (!Trimmed.empty()) {
+      LargeBlock::Header *H = Trimmed.front();
+      Trimmed.remove(H);
+      unmapBlock(H);
+    }
+  }
+}
+
+// Resizes the block at Ptr to hold Size bytes (with the same meaning as for
+// allocate, minus the alignment) by moving its pages to a new mapping, rather
+// than copying its contents. The new mapping has its own guard pages, and the
+// old one is unmapped. Returns the new block, or null if the platform is not
+// able to, in which case the original block is left untouched.
+template <uptr MaxFreeListSize>
+void *MapAllocator<MaxFreeListSize>::reallocate(void *Ptr, uptr Size,
+                                                uptr *BlockEnd) {
+  LargeBlock::Header *H = LargeBlock::getHeader(Ptr);
+  const u32 ShardIndex = H->ShardIndex;
+  ShardInfo *Shard = &Shards[ShardIndex];
+  const uptr PageSize = getPageSizeCached();
+  const uptr CommitSize = H->BlockEnd - reinterpret_cast<uptr>(H);
+  const uptr NewCommitSize =
+      roundUpTo(Size + LargeBlock::getHeaderSize(), PageSize);
+
+  MapPlatformData Data = {};
+  const uptr NewMapSize = NewCommitSize + 2 * PageSize;
+  const uptr NewMapBase =
+      reinterpret_cast<uptr>(map(nullptr, NewMapSize, "scudo:secondary",
+                                 MAP_NOACCESS | MAP_ALLOWNOMEM, &Data));
+  if (UNLIKELY(!NewMapBase))
+    return nullptr;
+  const uptr NewCommitBase = NewMapBase + PageSize;
+
+  // The block can't be in the list while it's being moved, as its neighbours
+  // would be pointing to its old header. The shard lock is held across the
+  // move so that iterateOverChunks and getStats don't miss the chunk.
+  const uptr MapBase = H->MapBase;
+  const uptr MapSize = H->MapSize;
+  const uptr CommitBase = reinterpret_cast<uptr>(H);
+  {
+    ScopedLock L(Shard->Mutex);
+    Shard->InUseBlocks.remove(H);
+    MapPlatformData OldData = H->Data;
+    if (UNLIKELY(!remap(H, CommitSize, reinterpret_cast<void *>(NewCommitBase),
+                        NewCommitSize, "scudo:secondary", &OldData))) {
+      Shard->InUseBlocks.push_back(H);
+      unmap(reinterpret_cast<void *>(NewMapBase), NewMapSize, UNMAP_ALL,
+            &Data);
+      return nullptr;
+    }
+    H = reinterpret_cast<LargeBlock::Header *>(NewCommitBase);
+    H->MapBase = NewMapBase;
+    H->MapSize = NewMapSize;
+    H->BlockEnd = NewCommitBase + NewCommitSize;
+    H->Time = 0;
+    H->ShardIndex = ShardIndex;
+    H->Data = Data;
+    Shard->InUseBlocks.push_back(H);
+    // The block is accounted for as if it had been allocated again, then
+    // freed, in that order for getStats.
+    addToStat(&Shard->AllocatedBytes, NewCommitSize);
+    addToStat(&Shard->NumberOfAllocs, 1U);
+    addToStat(&Shard->FreedBytes, CommitSize);
+    addToStat(&Shard->NumberOfFrees, 1U);
+    if (atomic_load_relaxed(&Shard->LargestSize) < NewCommitSize)
+      atomic_store_relaxed(&Shard->LargestSize, NewCommitSize);
+    Shard->Stats.sub(StatAllocated, CommitSize);
+    Shard->Stats.add(StatAllocated, NewCommitSize);
+    Shard->Stats.sub(StatMapped, MapSize);
+    Shard->Stats.add(StatMapped, NewMapSize);
   }
-  void *Addr = reinterpret_cast<void *>(H->MapBase);
-  const uptr Size = H->MapSize;
-  MapPlatformData Data = H->Data;
-  unmap(Addr, Size, UNMAP_ALL, &Data);
+  // The committed pages were moved out of the old mapping, and the hole they
+  // left could already be reused by another mapping, so only what remains on
+  // either side of it is unmapped: the guard pages and the extra reserved
+  // space.
+  if (CommitBase > MapBase)
+    unmap(reinterpret_cast<void *>(MapBase), CommitBase - MapBase);
+  const uptr MapEnd = MapBase + MapSize;
+  if (MapEnd > CommitBase + CommitSize)
+    unmap(reinterpret_cast<void *>(CommitBase + CommitSize),
+          MapEnd - (CommitBase + CommitSize));
+  if (BlockEnd)
+    *BlockEnd = H->BlockEnd;
+  return reinterpret_cast<void *>(NewCommitBase + LargeBlock::getHeaderSize());
 }
 
 template <uptr MaxFreeListSize>
 void MapAllocator<MaxFreeListSize>::getStats(ScopedString *Str) const {
+  u32 Allocs = 0, Frees = 0;
+  uptr Allocated = 0, Freed = 0, LargestSize = 0;
+  for (u32 I = 0; I < NumberOfShards; I++) {
+    const ShardInfo *Shard = &Shards[I];
+    // Loading the frees first guarantees that the remaining counts are not
+    // negative, the frees being published after the matching allocations.
+    Frees += atomic_load(&Shard->NumberOfFrees, memory_order_acquire);
+    Freed += atomic_load(&Shard->FreedBytes, memory_order_acquire);
+    Allocs += atomic_load_relaxed(&Shard->NumberOfAllocs);
+    Allocated += atomic_load_relaxed(&Shard->AllocatedBytes);
+    LargestSize = Max(LargestSize, atomic_load_relaxed(&Shard->LargestSize));
+  }
   Str->append(
       "Stats: MapAllocator: allocated %zu times (%zuK), freed %zu times "
-      "(%zuK), remains %zu (%zuK) max %zuM\n",
-      NumberOfAllocs, AllocatedBytes >> 10, NumberOfFrees, FreedBytes >> 10,
-      NumberOfAllocs - NumberOfFrees, (AllocatedBytes - FreedBytes) >> 10,
-      LargestSize >> 20);
+      "(%zuK), remains %zu (%zuK) max %zuM, %zu shards\n",
+      Allocs, Allocated >> 10, Frees, Freed >> 10, Allocs - Frees,
+      (Allocated - Freed) >> 10, LargestSize >> 20,
+      static_cast<uptr>(NumberOfShards));
 }
 
 } // namespace scudo
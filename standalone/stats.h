@@ -18,7 +18,14 @@
 namespace scudo {
 
 // Memory allocator statistics
-enum StatType { StatAllocated, StatFree, StatMapped, StatCount };
+enum StatType {
+  StatAllocated,
+  StatFree,
+  StatMapped,
+  StatRefills, // Number of times a thread cache was refilled.
+  StatDrains,  // Number of times a full thread cache was drained.
+  StatCount
+};
 
 typedef uptr StatCounters[StatCount];
 
@@ -53,6 +60,17 @@ private:
   atomic_uptr StatsArray[StatCount];
 };
 
+// Statistics of a size class of the Primary.
+struct PrimaryClassStats {
+  uptr ClassId;
+  uptr BlockSize;
+  uptr MappedBytes;
+  uptr ResidentBytes;
+  uptr PoppedBlocks;
+  uptr PushedBlocks;
+  uptr TotalBlocks;
+};
+
 // Global stats, used for aggregation and querying.
 class GlobalStats : public LocalStats {
 public:
@@ -11,10 +11,16 @@
 
 #include "gtest/gtest.h"
 
+#include <algorithm>
+#include <chrono>
 #include <condition_variable>
 #include <mutex>
+#include <set>
 #include <thread>
 
+#include <sys/wait.h>
+#include <unistd.h>
+
 static std::mutex Mutex;
 static std::condition_variable Cv;
 static bool Ready = false;
@@ -25,7 +31,22 @@ static constexpr scudo::Chunk::Origin Origin = scudo::Chunk::Origin::Malloc;
 // parameters are on the low end, to avoid having to loop excessively in some
 // tests.
 static bool UseQuarantine = false;
+static bool UseBackgroundRelease = false;
+static bool UseBackgroundRecycle = false;
+static char RssLimitOptions[32];
 extern "C" const char *__scudo_default_options() {
+  if (RssLimitOptions[0])
+    return RssLimitOptions;
+  if (UseBackgroundRelease && UseBackgroundRecycle)
+    return "release_to_os_in_background=true:release_to_os_interval_ms=10:"
+           "quarantine_size_kb=256:thread_local_quarantine_size_kb=32:"
+           "quarantine_recycle_in_background=true";
+  if (UseBackgroundRelease)
+    return "release_to_os_in_background=true:release_to_os_interval_ms=10";
+  if (UseBackgroundRecycle)
+    return "quarantine_size_kb=256:thread_local_quarantine_size_kb=32:"
+           "quarantine_max_chunk_size=1024:"
+           "quarantine_recycle_in_background=true";
   if (!UseQuarantine)
     return "";
   return "quarantine_size_kb=256:thread_local_quarantine_size_kb=128:"
@@ -111,6 +132,23 @@ template <class Config> static void testAllocator() {
   }
   Allocator->deallocate(P, Origin);
 
+  // Grow a Secondary backed chunk by doubling its size, which moves its pages
+  // rather than copying them, verifying that we preserve the data.
+  Size = MaxSize * 2;
+  P = Allocator->allocate(Size, Origin);
+  memset(P, Marker, Size);
+  for (scudo::uptr I = 0; I < 4U; I++) {
+    void *NewP = Allocator->reallocate(P, Size * 2);
+    EXPECT_NE(NewP, nullptr);
+    EXPECT_EQ(Allocator->getUsableSize(NewP), Size * 2);
+    for (scudo::uptr J = 0; J < Size; J += 64U)
+      EXPECT_EQ((reinterpret_cast<char *>(NewP))[J], Marker);
+    Size *= 2;
+    memset(NewP, Marker, Size);
+    P = NewP;
+  }
+  Allocator->deallocate(P, Origin);
+
   // Check that reallocating a chunk to a slightly smaller or larger size
   // returns the same chunk. This requires that all the sizes we iterate on use
   // the same block size, but that should be the case for 2048 with our default
@@ -149,6 +187,22 @@ template <class Config> static void testAllocator() {
     }
   }
 
+  // Allocate and deallocate chunks in bulk, for sizes serviced by the Primary
+  // and the Secondary, verifying that the chunks are usable and distinct.
+  for (scudo::uptr Size : {0UL, 1UL, 100UL, 4000UL, MaxSize * 2}) {
+    void *Ptrs[200];
+    const scudo::uptr Count = ARRAY_SIZE(Ptrs);
+    EXPECT_EQ(Allocator->allocateBatch(Size, Count, Ptrs), Count);
+    for (scudo::uptr I = 0; I < Count; I++) {
+      EXPECT_NE(Ptrs[I], nullptr);
+      EXPECT_EQ(Allocator->getUsableSize(Ptrs[I]), Size);
+      memset(Ptrs[I], Marker, Size);
+    }
+    std::sort(Ptrs, Ptrs + Count);
+    EXPECT_EQ(std::adjacent_find(Ptrs, Ptrs + Count), Ptrs + Count);
+    Allocator->deallocateBatch(Ptrs, Count);
+  }
+
   Allocator->releaseToOS();
 
   scudo::uptr BufferSize = 8192;
@@ -165,6 +219,15 @@ template <class Config> static void testAllocator() {
   EXPECT_NE(Stats.find("Stats: SizeClassAllocator"), std::string::npos);
   EXPECT_NE(Stats.find("Stats: MapAllocator"), std::string::npos);
   EXPECT_NE(Stats.find("Stats: Quarantine"), std::string::npos);
+
+  std::vector<scudo::PrimaryClassStats> ClassStats(
+      Allocator->getPrimaryClassStats(nullptr, 0));
+  EXPECT_GT(ClassStats.size(), 0U);
+  EXPECT_EQ(Allocator->getPrimaryClassStats(ClassStats.data(),
+                                            ClassStats.size()),
+            ClassStats.size());
+  for (const auto &S : ClassStats)
+    EXPECT_GT(S.MappedBytes, 0U);
 }
 
 TEST(ScudoCombinedTest, BasicCombined) {
@@ -177,6 +240,13 @@ TEST(ScudoCombinedTest, BasicCombined) {
   testAllocator<scudo::AndroidConfig>();
   UseQuarantine = false;
   testAllocator<scudo::AndroidSvelteConfig>();
+#if SCUDO_LINUX
+  testAllocator<scudo::PerCpuConfig>();
+#endif
+#if SCUDO_LINUX && SCUDO_CAN_USE_PRIMARY64
+  testAllocator<scudo::NumaConfig>();
+#endif
+  testAllocator<scudo::HybridConfig>();
 }
 
 template <typename AllocatorT> static void stressAllocator(AllocatorT *A) {
@@ -217,6 +287,15 @@ template <class Config> static void testAllocatorThreaded() {
     Ready = true;
     Cv.notify_all();
   }
+  // The statistics can be gathered while the other threads are allocating.
+  // This is done from yet another thread, as the main thread's exclusive TSD
+  // might already be initialized for a previous instance of the allocator.
+  std::thread StatsThread([&Allocator]() {
+    std::vector<char> Buffer(4096U);
+    for (scudo::uptr I = 0; I < 8U; I++)
+      EXPECT_GT(Allocator->getStats(Buffer.data(), Buffer.size()), 0U);
+  });
+  StatsThread.join();
   for (auto &T : Threads)
     T.join();
   Allocator->releaseToOS();
@@ -231,6 +310,362 @@ TEST(ScudoCombinedTest, ThreadedCombined) {
   testAllocatorThreaded<scudo::AndroidConfig>();
   UseQuarantine = false;
   testAllocatorThreaded<scudo::AndroidSvelteConfig>();
+#if SCUDO_LINUX
+  testAllocatorThreaded<scudo::PerCpuConfig>();
+#endif
+#if SCUDO_LINUX && SCUDO_CAN_USE_PRIMARY64
+  testAllocatorThreaded<scudo::NumaConfig>();
+#endif
+  testAllocatorThreaded<scudo::HybridConfig>();
+}
+
+// A distinct config is required for the thread specific data of the exclusive
+// TSD registry to not already be initialized for the main thread.
+struct BackgroundReleaseConfig : public scudo::DefaultConfig {};
+
+// Verify that, with the background release enabled, the release thread gets
+// created, does some work, and is stopped properly with the allocator.
+TEST(ScudoCombinedTest, BackgroundReleaseCombined) {
+  using AllocatorT = scudo::Allocator<BackgroundReleaseConfig>;
+  auto Deleter = [](AllocatorT *A) {
+    A->unmapTestOnly();
+    delete A;
+  };
+  UseBackgroundRelease = true;
+  std::unique_ptr<AllocatorT, decltype(Deleter)> Allocator(new AllocatorT,
+                                                           Deleter);
+  Allocator->reset();
+
+  const scudo::uptr Size = scudo::getPageSizeCached() * 2;
+  std::vector<void *> V;
+  for (scudo::uptr I = 0; I < 256U; I++)
+    V.push_back(Allocator->allocate(Size, Origin));
+  for (void *P : V)
+    Allocator->deallocate(P, Origin);
+
+  std::string Stats;
+  for (scudo::uptr I = 0; I < 200U; I++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    std::vector<char> Buffer(Allocator->getStats(nullptr, 0));
+    Allocator->getStats(Buffer.data(), Buffer.size());
+    Stats = Buffer.data();
+    const std::string::size_type Pos = Stats.find("Stats: ReleaseThread: ");
+    if (Pos != std::string::npos && Stats.compare(Pos + 22, 2, "0 ") != 0)
+      break;
+  }
+  EXPECT_NE(Stats.find("Stats: ReleaseThread: "), std::string::npos);
+  EXPECT_EQ(Stats.find("Stats: ReleaseThread: 0 passes"), std::string::npos);
+  Allocator.reset();
+  UseBackgroundRelease = false;
+}
+
+struct ForkConfig : public scudo::DefaultConfig {};
+
+// The background threads don't survive a fork: their state is reset in the
+// child, where they are started again by the next allocation on the slow path.
+TEST(ScudoCombinedTest, BackgroundThreadsFork) {
+  using AllocatorT = scudo::Allocator<ForkConfig>;
+  auto Deleter = [](AllocatorT *A) {
+    A->unmapTestOnly();
+    delete A;
+  };
+  UseBackgroundRelease = true;
+  UseBackgroundRecycle = true;
+  std::unique_ptr<AllocatorT, decltype(Deleter)> Allocator(new AllocatorT,
+                                                           Deleter);
+  Allocator->reset();
+  const scudo::uptr Alignment = 1U << SCUDO_MIN_ALIGNMENT_LOG;
+  auto GetStats = [&Allocator]() {
+    std::vector<char> Buffer(Allocator->getStats(nullptr, 0));
+    Allocator->getStats(Buffer.data(), Buffer.size());
+    return std::string(Buffer.data());
+  };
+  auto AllocateSlow = [&Allocator, Alignment]() {
+    Allocator->deallocate(Allocator->allocate(64U, Origin, Alignment, true),
+                          Origin);
+  };
+  auto Running = [&GetStats]() {
+    const std::string Stats = GetStats();
+    return Stats.find("Stats: ReleaseThread: ") != std::string::npos &&
+           Stats.find("Stats: RecycleThread: ") != std::string::npos;
+  };
+  AllocateSlow();
+  EXPECT_TRUE(Running());
+
+  const pid_t Pid = fork();
+  ASSERT_GE(Pid, 0);
+  if (Pid == 0) {
+    const std::string Stats = GetStats();
+    const bool Reset =
+        Stats.find("Stats: ReleaseThread: ") == std::string::npos &&
+        Stats.find("Stats: RecycleThread: ") == std::string::npos;
+    AllocateSlow();
+    _exit(Reset && Running() ? 0 : 1);
+  }
+  int Status;
+  EXPECT_EQ(waitpid(Pid, &Status, 0), Pid);
+  EXPECT_TRUE(WIFEXITED(Status));
+  EXPECT_EQ(WEXITSTATUS(Status), 0);
+  Allocator.reset();
+  UseBackgroundRelease = false;
+  UseBackgroundRecycle = false;
+}
+
+struct BackgroundRecycleConfig : public scudo::DefaultConfig {};
+
+// With the background recycle enabled, the quarantine is recycled by the
+// recycle thread, the deallocating thread only stepping in past the hard cap.
+TEST(ScudoCombinedTest, BackgroundRecycleCombined) {
+  using AllocatorT = scudo::Allocator<BackgroundRecycleConfig>;
+  auto Deleter = [](AllocatorT *A) {
+    A->unmapTestOnly();
+    delete A;
+  };
+  UseBackgroundRecycle = true;
+  std::unique_ptr<AllocatorT, decltype(Deleter)> Allocator(new AllocatorT,
+                                                           Deleter);
+  Allocator->reset();
+
+  std::string Stats;
+  for (scudo::uptr I = 0; I < 200U; I++) {
+    std::vector<void *> V;
+    for (scudo::uptr J = 0; J < 1024U; J++)
+      V.push_back(Allocator->allocate(256U, Origin));
+    for (void *P : V)
+      Allocator->deallocate(P, Origin);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    std::vector<char> Buffer(Allocator->getStats(nullptr, 0));
+    Allocator->getStats(Buffer.data(), Buffer.size());
+    Stats = Buffer.data();
+    const std::string::size_type Pos = Stats.find("Stats: RecycleThread: ");
+    if (Pos != std::string::npos && Stats.compare(Pos + 22, 2, "0 ") != 0)
+      break;
+  }
+  EXPECT_NE(Stats.find("Stats: RecycleThread: "), std::string::npos);
+  EXPECT_EQ(Stats.find("Stats: RecycleThread: 0 passes"), std::string::npos);
+  EXPECT_NE(Stats.find("us per pass, "), std::string::npos);
+  EXPECT_NE(Stats.find("Quarantine background recycle: backlog: "),
+            std::string::npos);
+  UseBackgroundRecycle = false;
+}
+
+struct RssLimitConfig : public scudo::DefaultConfig {};
+
+// Allocate and touch large chunks until the RSS limit is reached, then verify
+// that allocations succeed again once the memory has been returned.
+TEST(ScudoCombinedTest, RssLimitCombined) {
+  using AllocatorT = scudo::Allocator<RssLimitConfig>;
+  auto Deleter = [](AllocatorT *A) {
+    A->unmapTestOnly();
+    delete A;
+  };
+  const scudo::uptr Rss = scudo::getRSS();
+  ASSERT_GT(Rss, 0U);
+  snprintf(RssLimitOptions, sizeof(RssLimitOptions), "rss_limit_mb=%zu",
+           (Rss >> 20) + 64U);
+  std::unique_ptr<AllocatorT, decltype(Deleter)> Allocator(new AllocatorT,
+                                                           Deleter);
+  Allocator->reset();
+
+  const scudo::uptr Size = 1U << 20;
+  std::vector<void *> V;
+  for (scudo::uptr I = 0; I < 256U; I++) {
+    void *P = Allocator->allocate(Size, Origin);
+    if (!P)
+      break;
+    memset(P, 0x42, Size);
+    V.push_back(P);
+  }
+  EXPECT_GT(V.size(), 0U);
+  EXPECT_LT(V.size(), 256U);
+  for (void *P : V)
+    Allocator->deallocate(P, Origin);
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(
+      scudo::RssLimitChecker::UpdateIntervalNs / 1000000U + 50U));
+  void *P = Allocator->allocate(Size, Origin);
+  EXPECT_NE(P, nullptr);
+  Allocator->deallocate(P, Origin);
+  RssLimitOptions[0] = '\0';
+}
+
+struct OptionsConfig : public scudo::DefaultConfig {};
+
+// Change every option at runtime, while allocating and deallocating chunks.
+TEST(ScudoCombinedTest, OptionsCombined) {
+  using AllocatorT = scudo::Allocator<OptionsConfig>;
+  auto Deleter = [](AllocatorT *A) {
+    A->unmapTestOnly();
+    delete A;
+  };
+  UseQuarantine = true;
+  std::unique_ptr<AllocatorT, decltype(Deleter)> Allocator(new AllocatorT,
+                                                           Deleter);
+  Allocator->reset();
+  UseQuarantine = false;
+
+  auto AllocateAndDeallocate = [&Allocator]() {
+    std::vector<void *> V;
+    for (scudo::uptr I = 0; I < 256U; I++) {
+      const scudo::uptr Size = (I % 2) ? 64U : (1U << 18);
+      void *P = Allocator->allocate(Size, Origin);
+      EXPECT_NE(P, nullptr);
+      memset(P, 0x42, Size);
+      V.push_back(P);
+    }
+    for (void *P : V)
+      Allocator->deallocate(P, Origin);
+  };
+
+  AllocateAndDeallocate();
+  EXPECT_TRUE(Allocator->setOption(scudo::Option::ReleaseInterval, -1));
+  EXPECT_TRUE(Allocator->setOption(scudo::Option::ReleaseInterval, 0));
+  EXPECT_TRUE(Allocator->setOption(scudo::Option::ReleaseInterval, 1000));
+  // Shrinking the quarantine recycles its chunks.
+  EXPECT_TRUE(Allocator->setOption(scudo::Option::QuarantineSize, 0));
+  // The thread local quarantine can only be disabled with the global one.
+  EXPECT_TRUE(
+      Allocator->setOption(scudo::Option::ThreadLocalQuarantineSize, 0));
+  EXPECT_FALSE(Allocator->setOption(scudo::Option::QuarantineSize, 1 << 20));
+  EXPECT_TRUE(
+      Allocator->setOption(scudo::Option::ThreadLocalQuarantineSize, 1 << 16));
+  EXPECT_TRUE(Allocator->setOption(scudo::Option::QuarantineSize, 1 << 20));
+  EXPECT_TRUE(Allocator->setOption(scudo::Option::QuarantineMaxChunkSize, 0));
+  AllocateAndDeallocate();
+  EXPECT_TRUE(Allocator->setOption(scudo::Option::MaxCacheEntriesCount, 0));
+  EXPECT_TRUE(Allocator->setOption(scudo::Option::MaxCacheEntriesCount, 4));
+  EXPECT_TRUE(Allocator->setOption(scudo::Option::MaxCacheEntrySize, 1 << 20));
+  EXPECT_TRUE(Allocator->setOption(scudo::Option::MaxCacheTotalSize, 4 << 20));
+  EXPECT_TRUE(Allocator->setOption(scudo::Option::MaxThreadCacheCount, 4));
+  AllocateAndDeallocate();
+  EXPECT_TRUE(Allocator->setOption(scudo::Option::MaxThreadCacheCount, 0));
+  AllocateAndDeallocate();
+  EXPECT_FALSE(Allocator->setOption(scudo::Option::MaxCacheEntrySize, -1));
+}
+
+struct RecycleConfig : public scudo::DefaultConfig {};
+
+// Chunks of several classes recycled from the quarantine are returned to the
+// Primary, from where they are handed out again.
+TEST(ScudoCombinedTest, QuarantineRecycleCombined) {
+  using AllocatorT = scudo::Allocator<RecycleConfig>;
+  auto Deleter = [](AllocatorT *A) {
+    A->unmapTestOnly();
+    delete A;
+  };
+  UseQuarantine = true;
+  std::unique_ptr<AllocatorT, decltype(Deleter)> Allocator(new AllocatorT,
+                                                           Deleter);
+  Allocator->reset();
+
+  const scudo::uptr Sizes[] = {16U, 48U, 128U, 1000U};
+  std::set<void *> Freed;
+  for (scudo::uptr I = 0; I < 1024U; I++) {
+    void *P = Allocator->allocate(Sizes[I % ARRAY_SIZE(Sizes)], Origin);
+    EXPECT_NE(P, nullptr);
+    Freed.insert(P);
+  }
+  for (void *P : Freed)
+    Allocator->deallocate(P, Origin);
+  // Shrinking the quarantine recycles all of its chunks.
+  EXPECT_TRUE(Allocator->setOption(scudo::Option::QuarantineSize, 1));
+  scudo::uptr Reused = 0;
+  std::vector<void *> V;
+  for (scudo::uptr I = 0; I < 1024U; I++) {
+    void *P = Allocator->allocate(Sizes[I % ARRAY_SIZE(Sizes)], Origin);
+    EXPECT_NE(P, nullptr);
+    Reused += Freed.count(P);
+    V.push_back(P);
+  }
+  EXPECT_GT(Reused, 512U);
+  for (void *P : V)
+    Allocator->deallocate(P, Origin);
+  UseQuarantine = false;
+}
+
+struct ReleaseConfig : public scudo::DefaultConfig {};
+
+// The pages of large quarantined chunks are released while they wait, their
+// headers still being valid when they are recycled.
+TEST(ScudoCombinedTest, QuarantineReleaseCombined) {
+  if (SCUDO_FUCHSIA)
+    return;
+  using AllocatorT = scudo::Allocator<ReleaseConfig>;
+  auto Deleter = [](AllocatorT *A) {
+    A->unmapTestOnly();
+    delete A;
+  };
+  UseQuarantine = true;
+  std::unique_ptr<AllocatorT, decltype(Deleter)> Allocator(new AllocatorT,
+                                                           Deleter);
+  Allocator->reset();
+  EXPECT_TRUE(
+      Allocator->setOption(scudo::Option::QuarantineMaxChunkSize, 1 << 20));
+  EXPECT_TRUE(
+      Allocator->setOption(scudo::Option::QuarantineReleaseMinSize, 1 << 14));
+
+  const scudo::uptr Sizes[] = {1U << 15, 1U << 17};
+  for (scudo::uptr I = 0; I < 8U; I++) {
+    const scudo::uptr Size = Sizes[I % ARRAY_SIZE(Sizes)];
+    void *P = Allocator->allocate(Size, Origin);
+    EXPECT_NE(P, nullptr);
+    memset(P, 0xaa, Size);
+    Allocator->deallocate(P, Origin);
+  }
+  std::vector<char> Buffer(Allocator->getStats(nullptr, 0));
+  Allocator->getStats(Buffer.data(), Buffer.size());
+  const std::string Stats(Buffer.data());
+  EXPECT_NE(Stats.find("Quarantine release: chunks from 16K; released: "),
+            std::string::npos);
+  EXPECT_EQ(Stats.find("Quarantine release: chunks from 16K; released: 0K"),
+            std::string::npos);
+  // Shrinking the quarantine recycles all of its chunks.
+  EXPECT_TRUE(Allocator->setOption(scudo::Option::QuarantineSize, 1));
+  for (scudo::uptr I = 0; I < 8U; I++) {
+    void *P = Allocator->allocate(Sizes[I % ARRAY_SIZE(Sizes)], Origin);
+    EXPECT_NE(P, nullptr);
+    Allocator->deallocate(P, Origin);
+  }
+  UseQuarantine = false;
+}
+
+struct DrainConfig : public scudo::AndroidConfig {};
+
+// Only the TSDs that haven't been used for a release interval get drained,
+// unless the periodic release is disabled.
+TEST(ScudoCombinedTest, DrainCachesCombined) {
+  using AllocatorT = scudo::Allocator<DrainConfig>;
+  auto Deleter = [](AllocatorT *A) {
+    A->unmapTestOnly();
+    delete A;
+  };
+  std::unique_ptr<AllocatorT, decltype(Deleter)> Allocator(new AllocatorT,
+                                                           Deleter);
+  Allocator->reset();
+
+  auto AllocateAndDeallocate = [&Allocator]() {
+    std::vector<void *> V;
+    for (scudo::uptr I = 0; I < 64U; I++) {
+      void *P = Allocator->allocate(1U << (I % 12), Origin);
+      EXPECT_NE(P, nullptr);
+      V.push_back(P);
+    }
+    for (void *P : V)
+      Allocator->deallocate(P, Origin);
+  };
+
+  EXPECT_TRUE(
+      Allocator->setOption(scudo::Option::ReleaseInterval, 3600 * 1000));
+  AllocateAndDeallocate();
+  EXPECT_EQ(Allocator->drainIdleCaches(), 0U);
+  EXPECT_EQ(Allocator->drainIdleCaches(), 0U);
+  EXPECT_TRUE(Allocator->setOption(scudo::Option::ReleaseInterval, -1));
+  EXPECT_GE(Allocator->drainIdleCaches(), 1U);
+  AllocateAndDeallocate();
+  Allocator->flushThreadCache();
+  AllocateAndDeallocate();
+  Allocator->releaseToOS();
+  AllocateAndDeallocate();
 }
 
 struct DeathConfig {
@@ -69,3 +69,19 @@ TEST(ScudoMapTest, MapGrowUnmap) {
   memset(Q, 0xbb, PageSize);
   scudo::unmap(P, Size, UNMAP_ALL, &Data);
 }
+
+TEST(ScudoMapTest, ResidentBytes) {
+  const scudo::uptr PageSize = scudo::getPageSizeCached();
+  const scudo::uptr Size = 64 * PageSize;
+  scudo::MapPlatformData Data = {};
+  void *P = scudo::map(nullptr, Size, MappingName, 0, &Data);
+  EXPECT_NE(P, nullptr);
+  const scudo::uptr Base = reinterpret_cast<scudo::uptr>(P);
+  for (scudo::uptr I = 0; I < 64; I += 3)
+    memset(reinterpret_cast<void *>(Base + I * PageSize), 0xaa, 1);
+  EXPECT_EQ(scudo::getResidentBytes(Base, 0, Size, &Data), 22 * PageSize);
+  EXPECT_EQ(scudo::getResidentBytes(Base, PageSize, 2 * PageSize, &Data), 0U);
+  scudo::releasePagesToOS(Base, 0, Size / 2, &Data);
+  EXPECT_EQ(scudo::getResidentBytes(Base, 0, Size, &Data), 11 * PageSize);
+  scudo::unmap(P, Size, 0, &Data);
+}
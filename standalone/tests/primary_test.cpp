@@ -14,6 +14,7 @@
 
 #include <condition_variable>
 #include <mutex>
+#include <set>
 #include <thread>
 
 // Note that with small enough regions, the SizeClassAllocator64 also works on
@@ -55,6 +56,7 @@ TEST(ScudoPrimaryTest, BasicPrimary) {
   using SizeClassMap = scudo::DefaultSizeClassMap;
   testPrimary<scudo::SizeClassAllocator32<SizeClassMap, 18U>>();
   testPrimary<scudo::SizeClassAllocator64<SizeClassMap, 24U>>();
+  testPrimary<scudo::SizeClassAllocator64<SizeClassMap, 24U, true>>();
 }
 
 // The 64-bit SizeClassAllocator can be easily OOM'd with small region sizes.
@@ -138,6 +140,7 @@ TEST(ScudoPrimaryTest, PrimaryIterate) {
   using SizeClassMap = scudo::DefaultSizeClassMap;
   testIteratePrimary<scudo::SizeClassAllocator32<SizeClassMap, 18U>>();
   testIteratePrimary<scudo::SizeClassAllocator64<SizeClassMap, 24U>>();
+  testIteratePrimary<scudo::SizeClassAllocator64<SizeClassMap, 24U, true>>();
 }
 
 static std::mutex Mutex;
@@ -195,6 +198,7 @@ TEST(ScudoPrimaryTest, PrimaryThreaded) {
   using SizeClassMap = scudo::SvelteSizeClassMap;
   testPrimaryThreaded<scudo::SizeClassAllocator32<SizeClassMap, 18U>>();
   testPrimaryThreaded<scudo::SizeClassAllocator64<SizeClassMap, 24U>>();
+  testPrimaryThreaded<scudo::SizeClassAllocator64<SizeClassMap, 24U, true>>();
 }
 
 // Through a simple allocation that spans two pages, verify that releaseToOS
@@ -223,4 +227,363 @@ TEST(ScudoPrimaryTest, ReleaseToOS) {
   using SizeClassMap = scudo::DefaultSizeClassMap;
   testReleaseToOS<scudo::SizeClassAllocator32<SizeClassMap, 18U>>();
   testReleaseToOS<scudo::SizeClassAllocator64<SizeClassMap, 24U>>();
+  testReleaseToOS<scudo::SizeClassAllocator64<SizeClassMap, 24U, true>>();
+}
+
+// Touch some blocks, and verify that the structured statistics account for
+// them as resident.
+template <typename Primary> static void testClassStats() {
+  auto Deleter = [](Primary *P) {
+    P->unmapTestOnly();
+    delete P;
+  };
+  std::unique_ptr<Primary, decltype(Deleter)> Allocator(new Primary, Deleter);
+  Allocator->init(/*ReleaseToOsInterval=*/-1);
+  typename Primary::CacheT Cache;
+  Cache.init(nullptr, Allocator.get());
+  EXPECT_EQ(Allocator->getClassStats(nullptr, 0), 0U);
+  const scudo::uptr Size = 1024U;
+  const scudo::uptr ClassId = Primary::SizeClassMap::getClassIdBySize(Size);
+  std::vector<void *> V;
+  for (scudo::uptr I = 0; I < 256U; I++) {
+    void *P = Cache.allocate(ClassId);
+    memset(P, 0xaa, Size);
+    V.push_back(P);
+  }
+  scudo::PrimaryClassStats Stats[4];
+  // The batch class is accounted for as well.
+  EXPECT_EQ(Allocator->getClassStats(Stats, 4), 2U);
+  const scudo::PrimaryClassStats &S = Stats[1];
+  EXPECT_EQ(S.ClassId, ClassId);
+  EXPECT_EQ(S.BlockSize, Primary::SizeClassMap::getSizeByClassId(ClassId));
+  EXPECT_GE(S.ResidentBytes, 256U * Size);
+  EXPECT_LE(S.ResidentBytes, scudo::roundUpTo(
+                                 S.MappedBytes, scudo::getPageSizeCached()));
+  EXPECT_GE(S.PoppedBlocks - S.PushedBlocks, 256U);
+  for (void *P : V)
+    Cache.deallocate(ClassId, P);
+  Cache.destroy(nullptr);
+}
+
+TEST(ScudoPrimaryTest, ClassStats) {
+  using SizeClassMap = scudo::DefaultSizeClassMap;
+  testClassStats<scudo::SizeClassAllocator32<SizeClassMap, 18U>>();
+  testClassStats<scudo::SizeClassAllocator64<SizeClassMap, 24U>>();
+}
+
+// Repeatedly allocating and freeing more blocks than the thread cache holds
+// initially grows it, so that the blocks end up staying in the cache.
+template <typename Primary> static void testAdaptiveCache() {
+  auto Deleter = [](Primary *P) {
+    P->unmapTestOnly();
+    delete P;
+  };
+  std::unique_ptr<Primary, decltype(Deleter)> Allocator(new Primary, Deleter);
+  Allocator->init(/*ReleaseToOsInterval=*/-1);
+  scudo::GlobalStats Stats;
+  Stats.init();
+  typename Primary::CacheT Cache;
+  Cache.init(&Stats, Allocator.get());
+  const scudo::uptr ClassId = Primary::SizeClassMap::getClassIdBySize(1024U);
+  auto SlowPathEvents = [&Stats]() {
+    scudo::uptr S[scudo::StatCount];
+    Stats.get(S);
+    return S[scudo::StatRefills] + S[scudo::StatDrains];
+  };
+  auto AllocateAndDeallocate = [&Cache, ClassId]() {
+    void *Pointers[8];
+    for (void *&P : Pointers)
+      P = Cache.allocate(ClassId);
+    for (void *P : Pointers)
+      Cache.deallocate(ClassId, P);
+  };
+  for (scudo::uptr I = 0; I < 8U; I++)
+    AllocateAndDeallocate();
+  const scudo::uptr Events = SlowPathEvents();
+  EXPECT_GT(Events, 0U);
+  for (scudo::uptr I = 0; I < 8U; I++)
+    AllocateAndDeallocate();
+  EXPECT_EQ(SlowPathEvents(), Events);
+  Cache.destroy(&Stats);
+}
+
+TEST(ScudoPrimaryTest, AdaptiveCache) {
+  using SizeClassMap = scudo::DefaultSizeClassMap;
+  testAdaptiveCache<scudo::SizeClassAllocator32<SizeClassMap, 18U>>();
+  testAdaptiveCache<scudo::SizeClassAllocator64<SizeClassMap, 24U>>();
+}
+
+// A class shrunk for being idle still hands full TransferBatches back to the
+// Primary, and a refill under a lowered limit doesn't overflow the cache.
+template <typename Primary> static void testCacheBatches() {
+  auto Deleter = [](Primary *P) {
+    P->unmapTestOnly();
+    delete P;
+  };
+  std::unique_ptr<Primary, decltype(Deleter)> Allocator(new Primary, Deleter);
+  Allocator->init(/*ReleaseToOsInterval=*/-1);
+  typename Primary::CacheT Cache;
+  Cache.init(nullptr, Allocator.get());
+  const scudo::uptr ClassId = Primary::SizeClassMap::getClassIdBySize(64U);
+  const scudo::uptr OtherClassId =
+      Primary::SizeClassMap::getClassIdBySize(32U);
+  const scudo::u32 MaxCached = Primary::CacheT::TransferBatch::getMaxCached(
+      Primary::SizeClassMap::getSizeByClassId(ClassId));
+  ASSERT_GT(MaxCached, 2U);
+  std::vector<void *> V;
+  for (scudo::uptr I = 0; I < 64U; I++)
+    V.push_back(Cache.allocate(ClassId));
+  // Keep another class busy for a while, the first one being idle.
+  for (scudo::uptr I = 0; I < 256U; I++) {
+    void *Pointers[64];
+    for (void *&P : Pointers)
+      P = Cache.allocate(OtherClassId);
+    for (void *P : Pointers)
+      Cache.deallocate(OtherClassId, P);
+  }
+  for (void *P : V)
+    Cache.deallocate(ClassId, P);
+  Cache.drain();
+  for (scudo::uptr I = 0; I < 64U / MaxCached; I++) {
+    auto *B = Allocator->popBatch(&Cache, ClassId);
+    ASSERT_NE(B, nullptr);
+    EXPECT_EQ(B->getCount(), MaxCached);
+    Allocator->pushBatch(ClassId, B);
+  }
+
+  EXPECT_TRUE(Allocator->setOption(scudo::Option::MaxThreadCacheCount, 2));
+  void *P = Cache.allocate(ClassId);
+  // Only 2 blocks of the refill were kept, the others went back at once.
+  auto *B = Allocator->popBatch(&Cache, ClassId);
+  ASSERT_NE(B, nullptr);
+  EXPECT_EQ(B->getCount(), MaxCached - 2);
+  Allocator->pushBatch(ClassId, B);
+  Cache.deallocate(ClassId, P);
+  Cache.destroy(nullptr);
+}
+
+TEST(ScudoPrimaryTest, CacheBatches) {
+  using SizeClassMap = scudo::DefaultSizeClassMap;
+  testCacheBatches<scudo::SizeClassAllocator32<SizeClassMap, 18U>>();
+  testCacheBatches<scudo::SizeClassAllocator64<SizeClassMap, 24U>>();
+}
+
+// With the background release enabled, or a lock-free free list, deallocating
+// doesn't release anything by itself, but flags the region as dirty for
+// releaseDirtyRegionsToOS.
+template <typename Primary>
+static void testReleaseDirtyRegions(bool Background = true) {
+  auto Deleter = [](Primary *P) {
+    P->unmapTestOnly();
+    delete P;
+  };
+  std::unique_ptr<Primary, decltype(Deleter)> Allocator(new Primary, Deleter);
+  Allocator->init(/*ReleaseToOsInterval=*/0);
+  Allocator->setBackgroundRelease(Background);
+  typename Primary::CacheT Cache;
+  Cache.init(nullptr, Allocator.get());
+  const scudo::uptr Size = scudo::getPageSizeCached() * 2;
+  const scudo::uptr ClassId = Primary::SizeClassMap::getClassIdBySize(Size);
+  EXPECT_EQ(Allocator->releaseDirtyRegionsToOS(), 0U);
+  void *P = Cache.allocate(ClassId);
+  EXPECT_NE(P, nullptr);
+  Cache.deallocate(ClassId, P);
+  Cache.destroy(nullptr);
+  EXPECT_GT(Allocator->releaseDirtyRegionsToOS(), 0U);
+  EXPECT_EQ(Allocator->releaseDirtyRegionsToOS(), 0U);
+}
+
+TEST(ScudoPrimaryTest, ReleaseDirtyRegions) {
+  using SizeClassMap = scudo::DefaultSizeClassMap;
+  testReleaseDirtyRegions<scudo::SizeClassAllocator32<SizeClassMap, 18U>>();
+  testReleaseDirtyRegions<scudo::SizeClassAllocator64<SizeClassMap, 24U>>();
+  testReleaseDirtyRegions<
+      scudo::SizeClassAllocator64<SizeClassMap, 24U, true>>();
+  testReleaseDirtyRegions<scudo::SizeClassAllocator64<SizeClassMap, 24U, true>>(
+      /*Background=*/false);
+}
+
+// The Regions of the classes up to HugePagesMaxSize are backed by huge pages,
+// and only release whole huge pages. This requires transparent huge pages.
+TEST(ScudoPrimaryTest, PrimaryHugePages) {
+  using Primary = scudo::SizeClassAllocator64<scudo::DefaultSizeClassMap, 24U>;
+  auto Deleter = [](Primary *P) {
+    P->unmapTestOnly();
+    delete P;
+  };
+  std::unique_ptr<Primary, decltype(Deleter)> Allocator(new Primary, Deleter);
+  Allocator->init(/*ReleaseToOsInterval=*/-1);
+  const scudo::uptr HugePageSize = Allocator->getHugePageSize();
+  if (!HugePageSize) {
+    EXPECT_FALSE(Allocator->setOption(scudo::Option::HugePagesMaxSize, 256));
+    return;
+  }
+  EXPECT_TRUE(Allocator->setOption(scudo::Option::HugePagesMaxSize, 256));
+  typename Primary::CacheT Cache;
+  Cache.init(nullptr, Allocator.get());
+  const scudo::uptr Size = 256U;
+  const scudo::uptr ClassId = Primary::SizeClassMap::getClassIdBySize(Size);
+  std::vector<void *> Pointers;
+  for (scudo::uptr I = 0; I < 3U * HugePageSize / Size; I++) {
+    void *P = Cache.allocate(ClassId);
+    ASSERT_NE(P, nullptr);
+    memset(P, 'C', Size);
+    Pointers.push_back(P);
+  }
+  scudo::ScopedString Str(1024);
+  Allocator->getStats(&Str);
+  EXPECT_NE(strstr(Str.data(), "huge:"), nullptr);
+  for (void *P : Pointers)
+    Cache.deallocate(ClassId, P);
+  Cache.destroy(nullptr);
+  const scudo::uptr Released = Allocator->releaseToOS();
+  EXPECT_GT(Released, 0U);
+  EXPECT_EQ(Released % HugePageSize, 0U);
+}
+
+// With a fake 2 nodes topology, blocks popped for a node come from its own
+// Regions, and blocks freed in a mixed order go back to their own node.
+TEST(ScudoPrimaryTest, PrimaryNuma) {
+  using Primary = scudo::SizeClassAllocator64<scudo::DefaultSizeClassMap, 24U,
+                                              false, 1U>;
+  using TransferBatch = Primary::CacheT::TransferBatch;
+  auto Deleter = [](Primary *P) {
+    P->unmapTestOnly();
+    delete P;
+  };
+  std::unique_ptr<Primary, decltype(Deleter)> Allocator(new Primary, Deleter);
+  Allocator->init(/*ReleaseToOsInterval=*/-1);
+  Allocator->getTopology()->initFake(2U, Primary::MaxNumaNodes);
+  EXPECT_EQ(Allocator->getTopology()->getNumberOfNodes(), 2U);
+  EXPECT_FALSE(Allocator->getTopology()->isReal());
+  typename Primary::CacheT Cache;
+  Cache.init(nullptr, Allocator.get());
+  const scudo::uptr ClassId = Primary::SizeClassMap::getClassIdBySize(64U);
+  std::vector<void *> Blocks[2];
+  for (scudo::u32 Node = 0; Node < 2U; Node++) {
+    for (scudo::uptr I = 0; I < 4U; I++) {
+      TransferBatch *B = Allocator->popBatch(&Cache, ClassId, Node);
+      ASSERT_NE(B, nullptr);
+      for (scudo::u32 J = 0; J < B->getCount(); J++) {
+        EXPECT_EQ(Allocator->getNodeOfBlock(B->get(J)), Node);
+        Blocks[Node].push_back(B->get(J));
+      }
+      Cache.deallocate(Primary::SizeClassMap::BatchClassId, B);
+    }
+  }
+  // Interleave the frees of both nodes.
+  for (scudo::uptr I = 0; I < Blocks[0].size() || I < Blocks[1].size(); I++)
+    for (scudo::u32 Node = 0; Node < 2U; Node++)
+      if (I < Blocks[Node].size())
+        Cache.deallocate(ClassId, Blocks[Node][I]);
+  Cache.drain();
+  for (scudo::u32 Node = 0; Node < 2U; Node++) {
+    std::set<void *> Expected(Blocks[Node].begin(), Blocks[Node].end());
+    for (scudo::uptr I = 0; I < 64U && !Expected.empty(); I++) {
+      TransferBatch *B = Allocator->popBatch(&Cache, ClassId, Node);
+      ASSERT_NE(B, nullptr);
+      for (scudo::u32 J = 0; J < B->getCount(); J++) {
+        EXPECT_EQ(Allocator->getNodeOfBlock(B->get(J)), Node);
+        Expected.erase(B->get(J));
+      }
+      Cache.deallocate(Primary::SizeClassMap::BatchClassId, B);
+    }
+    EXPECT_TRUE(Expected.empty());
+  }
+  Cache.destroy(nullptr);
+}
+
+// Sparse node ids are indexed densely, the index mapping back to the id of the
+// node, and the nodes past the maximum are folded onto the first indexes.
+TEST(ScudoPrimaryTest, NumaTopologySparse) {
+  scudo::NumaTopology Topology;
+  scudo::u8 NodeIdOfCPU[scudo::NumaTopology::MaxCPUs];
+  memset(NodeIdOfCPU, scudo::UnknownNumaNode, sizeof(NodeIdOfCPU));
+  for (scudo::u32 I = 0; I < 8U; I++)
+    NodeIdOfCPU[I] = I < 4U ? 0U : 4U;
+  Topology.initFromNodeIds(NodeIdOfCPU, 4U);
+  EXPECT_EQ(Topology.getNumberOfNodes(), 2U);
+  EXPECT_EQ(Topology.getNodeOfCPU(0U), 0U);
+  EXPECT_EQ(Topology.getNodeOfCPU(4U), 1U);
+  EXPECT_EQ(Topology.getNodeId(0U), 0U);
+  EXPECT_EQ(Topology.getNodeId(1U), 4U);
+
+  for (scudo::u32 I = 0; I < 8U; I++)
+    NodeIdOfCPU[I] = static_cast<scudo::u8>(I);
+  Topology.initFromNodeIds(NodeIdOfCPU, 4U);
+  EXPECT_EQ(Topology.getNumberOfNodes(), 4U);
+  EXPECT_EQ(Topology.getNodeOfCPU(5U), 1U);
+  EXPECT_EQ(Topology.getNodeId(1U), 1U);
+}
+
+// Hammer a few size classes with batches going back and forth between threads
+// and the Primary, while periodically forcing releases. Each thread tags the
+// blocks it owns, and verifies that no other thread was handed the same block.
+template <typename Primary>
+static void stressBatches(Primary *Allocator, scudo::uptr Iterations) {
+  using TransferBatch = typename Primary::CacheT::TransferBatch;
+  static THREADLOCAL typename Primary::CacheT Cache;
+  Cache.init(nullptr, Allocator);
+  {
+    std::unique_lock<std::mutex> Lock(Mutex);
+    while (!Ready)
+      Cv.wait(Lock);
+  }
+  const scudo::uptr Tag = static_cast<scudo::uptr>(
+      std::hash<std::thread::id>{}(std::this_thread::get_id()));
+  std::vector<std::pair<scudo::uptr, TransferBatch *>> Batches;
+  for (scudo::uptr I = 0; I < Iterations; I++) {
+    const scudo::uptr ClassId = 1U + (I % 4U);
+    TransferBatch *B = Allocator->popBatch(&Cache, ClassId);
+    if (!B)
+      continue;
+    for (scudo::u32 J = 0; J < B->getCount(); J++)
+      *reinterpret_cast<scudo::uptr *>(B->get(J)) = Tag;
+    Batches.push_back(std::make_pair(ClassId, B));
+    if (Batches.size() < 8U && (I % 3U))
+      continue;
+    while (!Batches.empty()) {
+      auto Pair = Batches.back();
+      for (scudo::u32 J = 0; J < Pair.second->getCount(); J++)
+        EXPECT_EQ(*reinterpret_cast<scudo::uptr *>(Pair.second->get(J)), Tag);
+      Allocator->pushBatch(Pair.first, Pair.second);
+      Batches.pop_back();
+    }
+    if ((I % 1024U) == 0)
+      Allocator->releaseToOS();
+  }
+  while (!Batches.empty()) {
+    Allocator->pushBatch(Batches.back().first, Batches.back().second);
+    Batches.pop_back();
+  }
+  Cache.destroy(nullptr);
+}
+
+template <typename Primary>
+static void testBatchesThreaded(scudo::uptr NumberOfThreads,
+                                scudo::uptr Iterations) {
+  auto Deleter = [](Primary *P) {
+    P->unmapTestOnly();
+    delete P;
+  };
+  std::unique_ptr<Primary, decltype(Deleter)> Allocator(new Primary, Deleter);
+  Allocator->init(/*ReleaseToOsInterval=*/0);
+  Ready = false;
+  std::vector<std::thread> Threads;
+  for (scudo::uptr I = 0; I < NumberOfThreads; I++)
+    Threads.push_back(
+        std::thread(stressBatches<Primary>, Allocator.get(), Iterations));
+  {
+    std::unique_lock<std::mutex> Lock(Mutex);
+    Ready = true;
+    Cv.notify_all();
+  }
+  for (auto &T : Threads)
+    T.join();
+}
+
+TEST(ScudoPrimaryTest, PrimaryLockFreeStress) {
+  using SizeClassMap = scudo::DefaultSizeClassMap;
+  testBatchesThreaded<scudo::SizeClassAllocator64<SizeClassMap, 24U, true>>(
+      64U, 8192U);
 }
@@ -11,13 +11,19 @@
 #include "gtest/gtest.h"
 
 #include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
 
 static void *FakePtr = reinterpret_cast<void *>(0xFA83FA83);
 static const scudo::uptr BlockSize = 8UL;
 static const scudo::uptr LargeBlockSize = 16384UL;
 
 struct QuarantineCallback {
-  void recycle(void *P) { EXPECT_EQ(P, FakePtr); }
+  void recycleBatch(void **Ptrs, scudo::uptr Count) {
+    for (scudo::uptr I = 0; I < Count; I++)
+      EXPECT_EQ(Ptrs[I], FakePtr);
+  }
   void *allocate(scudo::uptr Size) { return malloc(Size); }
   void deallocate(void *P) { free(P); }
 };
@@ -213,6 +219,17 @@ TEST(ScudoQuarantineTest, GlobalQuarantine) {
   Quarantine.drainAndRecycle(&Cache, Cb);
   EXPECT_EQ(Cache.getSize(), 0UL);
 
+  // The limits can be changed at runtime, as long as the thread local
+  // quarantine is only disabled along with the global one.
+  EXPECT_FALSE(Quarantine.setLimits(MaxQuarantineSize, 0));
+  EXPECT_EQ(Quarantine.getCacheSize(), MaxCacheSize);
+  EXPECT_TRUE(Quarantine.setLimits(MaxQuarantineSize / 2, MaxCacheSize / 2));
+  EXPECT_EQ(Quarantine.getMaxSize(), MaxQuarantineSize / 2);
+  EXPECT_EQ(Quarantine.getCacheSize(), MaxCacheSize / 2);
+  EXPECT_TRUE(Quarantine.setLimits(0, 0));
+  Quarantine.put(&Cache, Cb, FakePtr, LargeBlockSize);
+  EXPECT_EQ(Cache.getSize(), 0UL);
+
   scudo::ScopedString Str(1024);
   Quarantine.getStats(&Str);
   Str.output();
@@ -242,3 +259,168 @@ TEST(ScudoQuarantineTest, ThreadedGlobalQuarantine) {
   Quarantine.getStats(&Str);
   Str.output();
 }
+
+struct CountingCallback {
+  void recycleBatch(void **Ptrs, scudo::uptr Count) {
+    for (scudo::uptr I = 0; I < Count; I++)
+      EXPECT_EQ(Ptrs[I], FakePtr);
+    Recycled.fetch_add(Count, std::memory_order_relaxed);
+  }
+  void *allocate(scudo::uptr Size) { return malloc(Size); }
+  void deallocate(void *P) { free(P); }
+  static std::atomic<scudo::uptr> Recycled;
+};
+std::atomic<scudo::uptr> CountingCallback::Recycled;
+
+typedef scudo::GlobalQuarantine<CountingCallback, void> CountingQuarantineT;
+
+static const scudo::uptr ChunksPerThread = 512UL;
+
+void *populateShardedQuarantine(void *Param) {
+  CountingQuarantineT::CacheT Cache;
+  Cache.init();
+  CountingCallback Cb;
+  CountingQuarantineT *Quarantine =
+      reinterpret_cast<CountingQuarantineT *>(Param);
+  for (scudo::uptr I = 0; I < ChunksPerThread; I++)
+    Quarantine->put(&Cache, Cb, FakePtr, LargeBlockSize);
+  Quarantine->drain(&Cache, Cb);
+  return 0;
+}
+
+// Each shard holds its share of the global limit, so that the quarantine as a
+// whole never holds more than that, wherever the chunks were freed.
+TEST(ScudoQuarantineTest, ShardedGlobalQuarantine) {
+  const scudo::uptr Size = 16UL << 20; // 16MB
+  CountingQuarantineT *Quarantine = new CountingQuarantineT;
+  Quarantine->init(Size, MaxCacheSize);
+  EXPECT_GE(Quarantine->getNumberOfShards(), 1U);
+  EXPECT_LE(Quarantine->getNumberOfShards(), 8U);
+  CountingCallback::Recycled = 0;
+
+  const scudo::uptr NumberOfThreads = 32U;
+  pthread_t T[NumberOfThreads];
+  for (scudo::uptr I = 0; I < NumberOfThreads; I++)
+    pthread_create(&T[I], 0, populateShardedQuarantine, Quarantine);
+  for (scudo::uptr I = 0; I < NumberOfThreads; I++)
+    pthread_join(T[I], 0);
+
+  const scudo::uptr Total = NumberOfThreads * ChunksPerThread;
+  const scudo::uptr Recycled = CountingCallback::Recycled;
+  EXPECT_GT(Recycled, 0U);
+  EXPECT_LE((Total - Recycled) * LargeBlockSize, Size);
+
+  CountingQuarantineT::CacheT Cache;
+  Cache.init();
+  Quarantine->drainAndRecycle(&Cache, CountingCallback());
+  EXPECT_EQ(CountingCallback::Recycled, Total);
+  delete Quarantine;
+}
+
+// Lowering the limits only recycles the chunks in excess of them, the shards
+// keeping up to their share of the new minimum.
+TEST(ScudoQuarantineTest, DrainToLimits) {
+  const scudo::uptr Size = 16UL << 20; // 16MB
+  CountingQuarantineT *Quarantine = new CountingQuarantineT;
+  Quarantine->init(Size, MaxCacheSize);
+  CountingCallback::Recycled = 0;
+  CountingQuarantineT::CacheT Cache;
+  Cache.init();
+  CountingCallback Cb;
+  const scudo::uptr Total = Size / 2 / LargeBlockSize;
+  for (scudo::uptr I = 0; I < Total; I++)
+    Quarantine->put(&Cache, Cb, FakePtr, LargeBlockSize);
+  Quarantine->drain(&Cache, Cb);
+  const scudo::uptr Recycled = CountingCallback::Recycled;
+
+  EXPECT_TRUE(Quarantine->setLimits(Size / 4, MaxCacheSize));
+  Quarantine->drainToLimits(&Cache, Cb);
+  EXPECT_EQ(Quarantine->getBacklog(), 0U);
+  EXPECT_GT(CountingCallback::Recycled, Recycled);
+  EXPECT_LT(CountingCallback::Recycled, Total);
+
+  Quarantine->drainAndRecycle(&Cache, Cb);
+  EXPECT_EQ(CountingCallback::Recycled, Total);
+  delete Quarantine;
+}
+
+// With the background recycle, the drains leave the recycling to
+// recycleInBackground, up to the hard cap past which they recycle anyway.
+TEST(ScudoQuarantineTest, BackgroundRecycle) {
+  CountingQuarantineT *Quarantine = new CountingQuarantineT;
+  Quarantine->init(MaxQuarantineSize, MaxCacheSize);
+  Quarantine->setBackgroundRecycle(true);
+  CountingCallback::Recycled = 0;
+  CountingQuarantineT::CacheT Cache;
+  Cache.init();
+  CountingCallback Cb;
+
+  // Up to twice the limit, nothing gets recycled.
+  const scudo::uptr Chunks = MaxQuarantineSize / LargeBlockSize;
+  for (scudo::uptr I = 0; I < Chunks + Chunks / 2; I++)
+    Quarantine->put(&Cache, Cb, FakePtr, LargeBlockSize);
+  Quarantine->drain(&Cache, Cb);
+  EXPECT_EQ(CountingCallback::Recycled, 0U);
+  EXPECT_EQ(Quarantine->getStalls(), 0U);
+  EXPECT_GT(Quarantine->getBacklog(), 0U);
+  EXPECT_GT(Quarantine->recycleInBackground(Cb), 0U);
+  EXPECT_EQ(Quarantine->getBacklog(), 0U);
+
+  // Past the hard cap, the draining thread recycles.
+  for (scudo::uptr I = 0; I < 4 * Chunks; I++)
+    Quarantine->put(&Cache, Cb, FakePtr, LargeBlockSize);
+  EXPECT_GT(Quarantine->getStalls(), 0U);
+
+  Quarantine->drainAndRecycle(&Cache, Cb);
+  delete Quarantine;
+}
+
+struct ReleaseCallback {
+  void recycleBatch(void **, scudo::uptr) {}
+  void *allocate(scudo::uptr Size) { return malloc(Size); }
+  void deallocate(void *P) { free(P); }
+};
+
+typedef scudo::GlobalQuarantine<ReleaseCallback, void> ReleaseQuarantineT;
+
+// The pages entirely within the large chunks are released as they are
+// quarantined, leaving the bytes preceding the first page boundary untouched.
+TEST(ScudoQuarantineTest, ReleaseChunkPages) {
+  // Releasing pages requires the MapPlatformData on Fuchsia.
+  if (SCUDO_FUCHSIA)
+    return;
+  const scudo::uptr PageSize = scudo::getPageSizeCached();
+  const scudo::uptr MapSize = 16U * PageSize;
+  char *Map = reinterpret_cast<char *>(
+      scudo::map(nullptr, MapSize, "scudo:test", 0, nullptr));
+  ASSERT_NE(Map, nullptr);
+  memset(Map, 0x42, MapSize);
+
+  ReleaseQuarantineT *Quarantine = new ReleaseQuarantineT;
+  Quarantine->init(MaxQuarantineSize, MaxCacheSize);
+  Quarantine->setReleaseMinSize(4U * PageSize);
+  ReleaseQuarantineT::CacheT Cache;
+  Cache.init();
+  ReleaseCallback Cb;
+
+  // A chunk starting past the beginning of a page, below the threshold.
+  char *Small = Map + 16;
+  Quarantine->releaseChunkPagesMaybe(Small, 2U * PageSize);
+  Quarantine->put(&Cache, Cb, Small, 2U * PageSize);
+  EXPECT_EQ(Quarantine->getReleasedBytes(), 0U);
+
+  // A chunk above the threshold: only its 8 interior pages are released.
+  char *Large = Map + 4U * PageSize + 16;
+  Quarantine->releaseChunkPagesMaybe(Large, 9U * PageSize);
+  Quarantine->put(&Cache, Cb, Large, 9U * PageSize);
+  EXPECT_EQ(Quarantine->getReleasedBytes(), 8U * PageSize);
+  EXPECT_EQ(Large[-1], 0x42);
+  EXPECT_EQ(Large[0], 0x42);
+  EXPECT_EQ(Map[5U * PageSize], 0);
+  EXPECT_EQ(Map[13U * PageSize - 1], 0);
+  EXPECT_EQ(Map[13U * PageSize], 0x42);
+
+  Quarantine->drainAndRecycle(&Cache, Cb);
+  delete Quarantine;
+  scudo::unmap(Map, MapSize);
+}
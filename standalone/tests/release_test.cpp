@@ -54,6 +54,39 @@ TEST(ScudoReleaseTest, PackedCounterArray) {
   }
 }
 
+TEST(ScudoReleaseTest, PackedCounterBuffer) {
+  const scudo::uptr PageSize = scudo::getPageSizeCached();
+  scudo::PackedCounterBuffer Scratch = {};
+  {
+    scudo::PackedCounterArray Counters(PageSize, 1UL << 7, &Scratch);
+    EXPECT_TRUE(Counters.isAllocated());
+    EXPECT_EQ(Scratch.getCapacity(), PageSize);
+    Counters.incRange(0, PageSize - 1);
+    // The buffer is in use, the next array has to map its own.
+    scudo::PackedCounterArray Other(PageSize, 1UL << 7, &Scratch);
+    EXPECT_TRUE(Other.isAllocated());
+    EXPECT_EQ(Scratch.getMapCount(), 2U);
+  }
+  {
+    // The buffer is reused, and zeroed.
+    scudo::PackedCounterArray Counters(PageSize, 1UL << 7, &Scratch);
+    EXPECT_EQ(Scratch.getMapCount(), 2U);
+    for (scudo::uptr I = 0; I < PageSize; I++)
+      EXPECT_EQ(Counters.get(I), 0U);
+  }
+  {
+    // Growing it remaps it to the next power of two number of pages.
+    scudo::PackedCounterArray Counters(3 * PageSize, 1UL << 7, &Scratch);
+    EXPECT_EQ(Scratch.getMapCount(), 3U);
+    EXPECT_EQ(Scratch.getCapacity(), 4 * PageSize);
+  }
+  {
+    scudo::PackedCounterArray Counters(PageSize, 1UL << 7, &Scratch);
+    EXPECT_EQ(Scratch.getMapCount(), 3U);
+  }
+  Scratch.unmapTestOnly();
+}
+
 class StringRangeRecorder {
 public:
   std::string ReportedPages;
@@ -150,6 +183,8 @@ template <class SizeClassMap> void testReleaseFreeMemoryToOS() {
   const scudo::uptr PageSize = scudo::getPageSizeCached();
   std::mt19937 R;
   scudo::u32 RandState = 42;
+  // The counters of all the size classes share a single buffer.
+  scudo::PackedCounterBuffer Scratch = {};
 
   for (scudo::uptr I = 1; I <= SizeClassMap::LargestClassId; I++) {
     const scudo::uptr BlockSize = SizeClassMap::getSizeByClassId(I);
@@ -190,7 +225,7 @@ template <class SizeClassMap> void testReleaseFreeMemoryToOS() {
     // Release the memory.
     ReleasedPagesRecorder Recorder;
     releaseFreeMemoryToOS(FreeList, 0, AllocatedPagesCount, BlockSize,
-                          &Recorder);
+                          &Recorder, &Scratch);
 
     // Verify that there are no released pages touched by used chunks and all
     // ranges of free chunks big enough to contain the entire memory pages had
@@ -245,6 +280,7 @@ template <class SizeClassMap> void testReleaseFreeMemoryToOS() {
       delete CurrentBatch;
     }
   }
+  Scratch.unmapTestOnly();
 }
 
 TEST(ScudoReleaseTest, ReleaseFreeMemoryToOSDefault) {
@@ -258,3 +294,98 @@ TEST(ScudoReleaseTest, ReleaseFreeMemoryToOSAndroid) {
 TEST(ScudoReleaseTest, ReleaseFreeMemoryToOSSvelte) {
   testReleaseFreeMemoryToOS<scudo::SvelteSizeClassMap>();
 }
+
+template <class SizeClassMap> void testFreeBlockGroups() {
+  const scudo::uptr RegionSize = 1UL << 22;
+  const scudo::uptr PageSize = scudo::getPageSizeCached();
+  scudo::u32 RandState = 42;
+
+  for (scudo::uptr I = 1; I <= SizeClassMap::LargestClassId; I++) {
+    const scudo::uptr BlockSize = SizeClassMap::getSizeByClassId(I);
+    scudo::FreeBlockGroups Groups = {};
+    ASSERT_TRUE(Groups.init(RegionSize, BlockSize));
+    // Allocate the region in two steps, and mark all the blocks as used.
+    const scudo::uptr NumBlocks = RegionSize / BlockSize;
+    const scudo::uptr AllocatedSize = NumBlocks * BlockSize;
+    Groups.addBlocks(0, AllocatedSize / 3);
+    Groups.addBlocks(AllocatedSize / 3, AllocatedSize);
+    for (scudo::uptr J = 0; J < NumBlocks; J++)
+      Groups.markUsed(J * BlockSize);
+
+    // Free random ranges of blocks.
+    std::vector<bool> Free(NumBlocks);
+    bool InFreeRange = false;
+    scudo::uptr CurrentRangeEnd = 0;
+    for (scudo::uptr J = 0; J < NumBlocks; J++) {
+      if (J == CurrentRangeEnd) {
+        InFreeRange = (scudo::getRandomU32(&RandState) & 1U) == 1;
+        CurrentRangeEnd += (scudo::getRandomU32(&RandState) & 0xfff) + 1;
+      }
+      if (InFreeRange) {
+        Free[J] = true;
+        Groups.markFree(J * BlockSize);
+      }
+    }
+
+    ReleasedPagesRecorder Recorder;
+    Groups.releaseFreeGroups(scudo::roundUpTo(AllocatedSize, PageSize),
+                             &Recorder);
+
+    // No released page can be touched by a used block.
+    for (scudo::uptr J = 0; J < NumBlocks; J++) {
+      if (Free[J])
+        continue;
+      const scudo::uptr From = scudo::roundDownTo(J * BlockSize, PageSize);
+      for (scudo::uptr P = From; P < (J + 1) * BlockSize; P += PageSize)
+        EXPECT_EQ(Recorder.ReportedPages.count(P), 0U);
+    }
+    // Every page within a range of entirely free groups is released.
+    const scudo::uptr BlocksPerGroup = scudo::Max(
+        static_cast<scudo::uptr>(1U),
+        (1UL << scudo::FreeBlockGroups::GroupSizeLog) / BlockSize);
+    const scudo::uptr GroupSize = BlocksPerGroup * BlockSize;
+    for (scudo::uptr G = 0; G * GroupSize < AllocatedSize; G++) {
+      const scudo::uptr End = scudo::Min((G + 1) * BlocksPerGroup, NumBlocks);
+      if (!std::all_of(Free.begin() + G * BlocksPerGroup, Free.begin() + End,
+                       [](bool B) { return B; }))
+        continue;
+      for (scudo::uptr P = scudo::roundUpTo(G * GroupSize, PageSize);
+           P + PageSize <= End * BlockSize; P += PageSize)
+        EXPECT_EQ(Recorder.ReportedPages.count(P), 1U);
+    }
+
+    // Nothing changed, so nothing else should be released.
+    ReleasedPagesRecorder EmptyRecorder;
+    Groups.releaseFreeGroups(scudo::roundUpTo(AllocatedSize, PageSize),
+                             &EmptyRecorder);
+    EXPECT_TRUE(EmptyRecorder.ReportedPages.empty());
+
+    Groups.unmapTestOnly();
+  }
+}
+
+TEST(ScudoReleaseTest, FreeBlockGroupsDefault) {
+  testFreeBlockGroups<scudo::DefaultSizeClassMap>();
+}
+
+TEST(ScudoReleaseTest, FreeBlockGroupsAndroid) {
+  testFreeBlockGroups<scudo::AndroidSizeClassMap>();
+}
+
+// With a granularity, only the aligned parts of the ranges are released.
+TEST(ScudoReleaseTest, ReleaseRecorderGranularity) {
+  const scudo::uptr PageSize = scudo::getPageSizeCached();
+  const scudo::uptr Granularity = 16U * PageSize;
+  const scudo::uptr Size = 4U * Granularity;
+  void *P = scudo::map(nullptr, Size, "test:release");
+  const scudo::uptr Base =
+      scudo::roundUpTo(reinterpret_cast<scudo::uptr>(P), Granularity) +
+      PageSize;
+  scudo::ReleaseRecorder Recorder(Base, nullptr, Granularity);
+  Recorder.releasePageRangeToOS(0, Granularity - PageSize);
+  EXPECT_EQ(Recorder.getReleasedRangesCount(), 0U);
+  Recorder.releasePageRangeToOS(0, 2U * Granularity);
+  EXPECT_EQ(Recorder.getReleasedRangesCount(), 1U);
+  EXPECT_EQ(Recorder.getReleasedBytes(), Granularity);
+  scudo::unmap(P, Size);
+}
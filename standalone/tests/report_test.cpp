@@ -20,6 +20,7 @@ TEST(ScudoReportTest, Generic) {
   EXPECT_DEATH(scudo::reportAllocationSizeTooBig(123, 456, 789),
                "Scudo ERROR.*123.*456.*789");
   EXPECT_DEATH(scudo::reportOutOfMemory(4242), "Scudo ERROR.*4242");
+  EXPECT_DEATH(scudo::reportRssLimitExceeded(123), "Scudo ERROR.*123");
   EXPECT_DEATH(
       scudo::reportInvalidChunkState(scudo::AllocatorAction::Recycling, P),
       "Scudo ERROR.*recycling.*42424242");
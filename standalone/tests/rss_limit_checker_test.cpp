@@ -0,0 +1,76 @@
+//===-- rss_limit_checker_test.cpp ------------------------------*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+
+#include "rss_limit_checker.h"
+
+#include "gtest/gtest.h"
+
+#include <string.h>
+
+TEST(ScudoRssLimitCheckerTest, GetRSS) {
+  const scudo::uptr Size = 1U << 24;
+  const scudo::uptr Rss = scudo::getRSS();
+  EXPECT_GT(Rss, 0U);
+  void *P = scudo::map(nullptr, Size, "rss");
+  memset(P, 0x42, Size);
+  EXPECT_GE(scudo::getRSS(), Rss + Size / 2);
+  scudo::unmap(P, Size);
+}
+
+TEST(ScudoRssLimitCheckerTest, Limit) {
+  scudo::RssLimitChecker Checker;
+  Checker.init(-1);
+  EXPECT_FALSE(Checker.isEnabled());
+
+  // The RSS of the process is necessarily larger than 1MB.
+  Checker.init(1);
+  EXPECT_TRUE(Checker.isEnabled());
+  EXPECT_FALSE(Checker.isLimitExceeded());
+  EXPECT_TRUE(Checker.tryStartUpdate());
+  // Only one update at a time.
+  EXPECT_FALSE(Checker.tryStartUpdate());
+  const bool Exceeded = Checker.update();
+  EXPECT_TRUE(Exceeded);
+  Checker.finishUpdate(Exceeded);
+  EXPECT_TRUE(Checker.isLimitExceeded());
+
+  // An update was just done, the next one is only due past the interval, or
+  // if the estimated RSS crosses the limit.
+  const scudo::uptr LimitMb = (scudo::getRSS() >> 20) + 1024U;
+  Checker.init(static_cast<scudo::s32>(LimitMb));
+  EXPECT_TRUE(Checker.tryStartUpdate());
+  Checker.finishUpdate(Checker.update());
+  EXPECT_FALSE(Checker.isLimitExceeded());
+  EXPECT_FALSE(Checker.tryStartUpdate());
+  Checker.addCommittedBytes(1U << 20);
+  EXPECT_FALSE(Checker.tryStartUpdate());
+  Checker.addCommittedBytes(LimitMb << 20);
+  EXPECT_TRUE(Checker.tryStartUpdate());
+  Checker.finishUpdate(Checker.update());
+  EXPECT_FALSE(Checker.isLimitExceeded());
+}
+
+// Past the limit, the allocations keep on accounting for the bytes they are
+// about to commit, but the updates are kept to the interval.
+TEST(ScudoRssLimitCheckerTest, BoundedUpdates) {
+  scudo::RssLimitChecker Checker;
+  Checker.init(1);
+  EXPECT_TRUE(Checker.tryStartUpdate());
+  Checker.finishUpdate(Checker.update());
+  EXPECT_TRUE(Checker.isLimitExceeded());
+  scudo::uptr Updates = 0;
+  const scudo::u64 Start = scudo::getMonotonicTime();
+  while (scudo::getMonotonicTime() - Start < 2 * Checker.UpdateIntervalNs) {
+    Checker.addCommittedBytes(1U << 20);
+    if (Checker.tryStartUpdate()) {
+      Updates++;
+      Checker.finishUpdate(Checker.update());
+    }
+  }
+  EXPECT_LE(Updates, 2U);
+}
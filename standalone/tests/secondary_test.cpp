@@ -116,6 +116,147 @@ TEST(ScudoSecondaryTest, SecondaryIterate) {
   Str.output();
 }
 
+// Grow and shrink a block by moving its pages, verifying that the contents are
+// preserved, and that the new block is properly guarded.
+TEST(ScudoSecondaryTest, SecondaryReallocate) {
+  LargeAllocator *L = new LargeAllocator;
+  L->init(nullptr);
+  const scudo::uptr PageSize = scudo::getPageSizeCached();
+  scudo::uptr Size = 4 * PageSize;
+  void *P = L->allocate(Size);
+  EXPECT_NE(P, nullptr);
+  memset(P, 'A', Size);
+  for (scudo::uptr I = 0; I < 6U; I++) {
+    const scudo::uptr NewSize = (I < 4U) ? Size * 2 : Size / 2;
+    scudo::uptr BlockEnd;
+    void *NewP = L->reallocate(P, NewSize, &BlockEnd);
+    // Not every platform supports it.
+    if (!NewP)
+      break;
+    EXPECT_EQ(BlockEnd, LargeAllocator::getBlockEnd(NewP));
+    EXPECT_GE(LargeAllocator::getBlockSize(NewP), NewSize);
+    for (scudo::uptr J = 0; J < scudo::Min(Size, NewSize); J++)
+      ASSERT_EQ(reinterpret_cast<char *>(NewP)[J], 'A');
+    memset(NewP, 'A', NewSize);
+    P = NewP;
+    Size = NewSize;
+  }
+  const scudo::uptr BlockSize = LargeAllocator::getBlockSize(P);
+  memset(P, 'A', BlockSize);
+  EXPECT_DEATH(memset(P, 'A', BlockSize + 1), "");
+  L->disable();
+  scudo::uptr Count = 0;
+  L->iterateOverBlocks([&Count, P](scudo::uptr Block) {
+    EXPECT_EQ(reinterpret_cast<void *>(Block), P);
+    Count++;
+  });
+  L->enable();
+  EXPECT_EQ(Count, 1U);
+  L->deallocate(P);
+  scudo::ScopedString Str(1024);
+  L->getStats(&Str);
+  Str.output();
+}
+
+// Freed blocks are reused for allocations of the same size, and their pages are
+// only released to the OS once the release interval has elapsed, or on demand.
+TEST(ScudoSecondaryTest, SecondaryCache) {
+  LargeAllocator *L = new LargeAllocator;
+  L->init(nullptr, /*ReleaseToOsInterval=*/60000);
+  const scudo::uptr PageSize = scudo::getPageSizeCached();
+  std::vector<void *> V;
+  for (scudo::uptr I = 1; I <= 8U; I++) {
+    void *P = L->allocate(I * 16 * PageSize);
+    EXPECT_NE(P, nullptr);
+    memset(P, 'A', LargeAllocator::getBlockSize(P));
+    V.push_back(P);
+  }
+  for (void *P : V)
+    L->deallocate(P);
+  for (scudo::uptr I = 8; I >= 1U; I--) {
+    void *P = L->allocate(I * 16 * PageSize);
+    EXPECT_EQ(P, V[I - 1]);
+    // The pages were not released.
+    EXPECT_EQ(reinterpret_cast<char *>(P)[I * 16 * PageSize - 1], 'A');
+  }
+  for (void *P : V)
+    L->deallocate(P);
+  L->releaseToOS();
+  for (scudo::uptr I = 1; I <= 8U; I++) {
+    void *P = L->allocate(I * 16 * PageSize);
+    EXPECT_EQ(P, V[I - 1]);
+    EXPECT_EQ(reinterpret_cast<char *>(P)[I * 16 * PageSize - 1], 0);
+  }
+  for (void *P : V)
+    L->deallocate(P);
+  // Nothing fits in the cache anymore.
+  EXPECT_TRUE(L->setOption(scudo::Option::MaxCacheTotalSize, 0));
+  EXPECT_DEATH(memset(V[0], 'A', PageSize), "");
+  void *P = L->allocate(16 * PageSize);
+  EXPECT_NE(P, nullptr);
+  L->deallocate(P);
+  EXPECT_DEATH(memset(P, 'A', PageSize), "");
+  scudo::ScopedString Str(1024);
+  L->getStats(&Str);
+  Str.output();
+}
+
+// Lowering the limits of the cache unmaps the blocks that do not fit anymore.
+TEST(ScudoSecondaryTest, SecondaryOptions) {
+  LargeAllocator *L = new LargeAllocator;
+  L->init(nullptr);
+  const scudo::uptr PageSize = scudo::getPageSizeCached();
+  void *Small = L->allocate(4 * PageSize);
+  void *Large = L->allocate(64 * PageSize);
+  EXPECT_NE(Small, nullptr);
+  EXPECT_NE(Large, nullptr);
+  L->deallocate(Small);
+  L->deallocate(Large);
+  memset(Large, 'A', 64 * PageSize);
+  EXPECT_TRUE(L->setOption(scudo::Option::MaxCacheEntrySize, 16 * PageSize));
+  EXPECT_DEATH(memset(Large, 'A', 64 * PageSize), "");
+  memset(Small, 'A', 4 * PageSize);
+  EXPECT_TRUE(L->setOption(scudo::Option::MaxCacheEntriesCount, 0));
+  EXPECT_DEATH(memset(Small, 'A', 4 * PageSize), "");
+  // Nothing gets cached anymore.
+  void *P = L->allocate(4 * PageSize);
+  EXPECT_NE(P, nullptr);
+  L->deallocate(P);
+  EXPECT_DEATH(memset(P, 'A', 4 * PageSize), "");
+  EXPECT_FALSE(L->setOption(scudo::Option::QuarantineSize, 0));
+  scudo::ScopedString Str(1024);
+  L->getStats(&Str);
+  Str.output();
+}
+
+// Blocks turned away from a full cache must leave its accounting untouched, so
+// that blocks still get cached afterwards.
+TEST(ScudoSecondaryTest, SecondaryCacheFull) {
+  LargeAllocator *L = new LargeAllocator;
+  L->init(nullptr);
+  const scudo::uptr PageSize = scudo::getPageSizeCached();
+  const scudo::uptr Count = LargeAllocator::getMaxFreeListSize();
+  std::vector<void *> V;
+  for (scudo::uptr I = 0; I < Count; I++)
+    V.push_back(L->allocate(4 * PageSize));
+  for (void *P : V)
+    L->deallocate(P);
+  // None of the cached blocks fit those, which are not cached either.
+  for (scudo::uptr I = 0; I < 4 * Count; I++) {
+    void *P = L->allocate(64 * PageSize);
+    EXPECT_NE(P, nullptr);
+    L->deallocate(P);
+  }
+  for (scudo::uptr I = 0; I < 4U; I++) {
+    void *P = L->allocate(4 * PageSize);
+    EXPECT_NE(P, nullptr);
+    L->deallocate(P);
+    EXPECT_EQ(L->allocate(4 * PageSize), P);
+    L->deallocate(P);
+  }
+  L->releaseToOS();
+}
+
 static std::mutex Mutex;
 static std::condition_variable Cv;
 static bool Ready = false;
@@ -153,3 +294,36 @@ TEST(ScudoSecondaryTest, SecondaryThreadsRace) {
   L->getStats(&Str);
   Str.output();
 }
+
+// Blocks allocated from different threads, thus likely different shards, are
+// all visible when iterating, and can be freed from any thread.
+TEST(ScudoSecondaryTest, SecondaryShards) {
+  LargeAllocator *L = new LargeAllocator;
+  L->init(nullptr);
+  const scudo::uptr PageSize = scudo::getPageSizeCached();
+  std::vector<void *> V[8];
+  std::thread Threads[8];
+  for (scudo::uptr I = 0; I < 8U; I++)
+    Threads[I] = std::thread([L, PageSize, &V, I]() {
+      for (scudo::uptr J = 0; J < 16U; J++)
+        V[I].push_back(L->allocate((1U + J) * PageSize));
+    });
+  for (auto &T : Threads)
+    T.join();
+  scudo::uptr Count = 0;
+  L->disable();
+  L->iterateOverBlocks([&Count](scudo::uptr) { Count++; });
+  L->enable();
+  EXPECT_EQ(Count, 8U * 16U);
+  for (auto &Blocks : V)
+    for (void *P : Blocks)
+      L->deallocate(P);
+  Count = 0;
+  L->disable();
+  L->iterateOverBlocks([&Count](scudo::uptr) { Count++; });
+  L->enable();
+  EXPECT_EQ(Count, 0U);
+  scudo::ScopedString Str(1024);
+  L->getStats(&Str);
+  Str.output();
+}
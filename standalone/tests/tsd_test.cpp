@@ -7,10 +7,14 @@
 //===----------------------------------------------------------------------===//
 
 #include "tsd_exclusive.h"
+#include "tsd_hybrid.h"
+#include "tsd_percpu.h"
 #include "tsd_shared.h"
 
 #include "gtest/gtest.h"
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <mutex>
 #include <thread>
@@ -35,6 +39,12 @@ public:
   void unmapTestOnly() { TSDRegistry.unmapTestOnly(); }
   void initCache(CacheT *Cache) { memset(Cache, 0, sizeof(*Cache)); }
   void commitBack(scudo::TSD<MockAllocator> *TSD) {}
+  void drainCaches(scudo::TSD<MockAllocator> *TSD) {}
+  void moveCaches(scudo::TSD<MockAllocator> *From,
+                  scudo::TSD<MockAllocator> *To) {
+    To->Cache.Canary = From->Cache.Canary;
+    From->Cache.Canary = 0;
+  }
   TSDRegistryT *getTSDRegistry() { return &TSDRegistry; }
 
   bool isInitialized() { return Initialized; }
@@ -59,6 +69,17 @@ struct ExclusiveCaches {
   using TSDRegistryT = scudo::TSDRegistryExT<Allocator>;
 };
 
+struct PerCpuCaches {
+  template <class Allocator>
+  using TSDRegistryT = scudo::TSDRegistryPerCpuT<Allocator, 16U>;
+};
+
+// Few enough exclusive threads for the threaded test to also use shared TSDs.
+struct HybridCaches {
+  template <class Allocator>
+  using TSDRegistryT = scudo::TSDRegistryHybridT<Allocator, 4U, 4U>;
+};
+
 TEST(ScudoTSDTest, TSDRegistryInit) {
   using AllocatorT = MockAllocator<OneCache>;
   auto Deleter = [](AllocatorT *A) {
@@ -109,6 +130,8 @@ TEST(ScudoTSDTest, TSDRegistryBasic) {
   testRegistry<MockAllocator<OneCache>>();
   testRegistry<MockAllocator<SharedCaches>>();
   testRegistry<MockAllocator<ExclusiveCaches>>();
+  testRegistry<MockAllocator<PerCpuCaches>>();
+  testRegistry<MockAllocator<HybridCaches>>();
 }
 
 static std::mutex Mutex;
@@ -126,11 +149,9 @@ template <typename AllocatorT> static void stressCache(AllocatorT *Allocator) {
   bool UnlockRequired;
   auto TSD = Registry->getTSDAndLock(&UnlockRequired);
   EXPECT_NE(TSD, nullptr);
-  // For an exclusive TSD, the cache should be empty. We cannot guarantee the
-  // same for a shared TSD.
-  if (!UnlockRequired)
-    EXPECT_EQ(TSD->Cache.Canary, 0U);
-  // Transform the thread id to a uptr to use it as canary.
+  // An exclusive TSD might have been adopted from a thread that exited, and a
+  // shared TSD might be in use by another thread, so the cache is not
+  // necessarily empty. Transform the thread id to a uptr to use it as canary.
   const scudo::uptr Canary = static_cast<scudo::uptr>(
       std::hash<std::thread::id>{}(std::this_thread::get_id()));
   TSD->Cache.Canary = Canary;
@@ -165,4 +186,126 @@ TEST(ScudoTSDTest, TSDRegistryThreaded) {
   testRegistryThreaded<MockAllocator<OneCache>>();
   testRegistryThreaded<MockAllocator<SharedCaches>>();
   testRegistryThreaded<MockAllocator<ExclusiveCaches>>();
+  testRegistryThreaded<MockAllocator<PerCpuCaches>>();
+  testRegistryThreaded<MockAllocator<HybridCaches>>();
+}
+
+// The cache of an exiting thread is adopted by the next thread to start.
+TEST(ScudoTSDTest, TSDRegistryOrphans) {
+  using AllocatorT = MockAllocator<ExclusiveCaches>;
+  auto Deleter = [](AllocatorT *A) {
+    A->unmapTestOnly();
+    delete A;
+  };
+  std::unique_ptr<AllocatorT, decltype(Deleter)> Allocator(new AllocatorT,
+                                                           Deleter);
+  Allocator->reset();
+  auto Registry = Allocator->getTSDRegistry();
+  auto GetThreadTSD = [&Allocator, Registry]() {
+    Registry->initThreadMaybe(Allocator.get(), /*MinimalInit=*/false);
+    bool UnlockRequired;
+    auto TSD = Registry->getTSDAndLock(&UnlockRequired);
+    EXPECT_FALSE(UnlockRequired);
+    return TSD;
+  };
+  std::thread([&]() {
+    auto TSD = GetThreadTSD();
+    EXPECT_EQ(TSD->Cache.Canary, 0U);
+    TSD->Cache.Canary = 0x42U;
+  }).join();
+  std::thread([&]() {
+    auto TSD = GetThreadTSD();
+    EXPECT_EQ(TSD->Cache.Canary, 0x42U);
+  }).join();
+}
+
+struct HybridLimitCaches {
+  template <class Allocator>
+  using TSDRegistryT = scudo::TSDRegistryHybridT<Allocator, 4U, 64U>;
+};
+
+// Past the limit of exclusive threads, threads share a TSD.
+TEST(ScudoTSDTest, TSDRegistryHybrid) {
+  using AllocatorT = MockAllocator<HybridLimitCaches>;
+  auto Deleter = [](AllocatorT *A) {
+    A->unmapTestOnly();
+    delete A;
+  };
+  std::unique_ptr<AllocatorT, decltype(Deleter)> Allocator(new AllocatorT,
+                                                           Deleter);
+  Allocator->reset();
+  auto Registry = Allocator->getTSDRegistry();
+  Registry->initThreadMaybe(Allocator.get(), /*MinimalInit=*/true);
+  EXPECT_FALSE(Registry->setOption(scudo::Option::MaxExclusiveThreads, -1));
+  EXPECT_TRUE(Registry->setOption(scudo::Option::MaxExclusiveThreads, 1));
+
+  auto IsExclusive = [&Allocator, Registry]() {
+    Registry->initThreadMaybe(Allocator.get(), /*MinimalInit=*/false);
+    bool UnlockRequired;
+    auto TSD = Registry->getTSDAndLock(&UnlockRequired);
+    if (UnlockRequired)
+      TSD->unlock();
+    return !UnlockRequired;
+  };
+  std::thread([&]() {
+    EXPECT_TRUE(IsExclusive());
+    std::thread([&]() {
+      EXPECT_FALSE(IsExclusive());
+      EXPECT_EQ(Registry->getNumberOfExclusiveThreads(), 1U);
+      EXPECT_EQ(Registry->getNumberOfSharedThreads(), 1U);
+    }).join();
+  }).join();
+  EXPECT_EQ(Registry->getNumberOfExclusiveThreads(), 0U);
+  EXPECT_EQ(Registry->getNumberOfSharedThreads(), 0U);
+  // Once the exclusive thread exited, another one can take its place.
+  std::thread([&]() { EXPECT_TRUE(IsExclusive()); }).join();
+}
+
+struct SharedGrowingCaches {
+  template <class Allocator>
+  using TSDRegistryT = scudo::TSDRegistrySharedT<Allocator, 4U, 1U>;
+};
+
+// Contended locks make a shared registry grow, and it shrinks back once the
+// contention subsides.
+TEST(ScudoTSDTest, TSDRegistrySharedGrowth) {
+  using AllocatorT = MockAllocator<SharedGrowingCaches>;
+  auto Deleter = [](AllocatorT *A) {
+    A->unmapTestOnly();
+    delete A;
+  };
+  std::unique_ptr<AllocatorT, decltype(Deleter)> Allocator(new AllocatorT,
+                                                           Deleter);
+  Allocator->reset();
+  auto Registry = Allocator->getTSDRegistry();
+  Registry->initThreadMaybe(Allocator.get(), /*MinimalInit=*/false);
+  EXPECT_EQ(Registry->getNumberOfTSDs(), 1U);
+
+  std::atomic<bool> Grown(false);
+  auto Contend = [&]() {
+    Registry->initThreadMaybe(Allocator.get(), /*MinimalInit=*/false);
+    const auto Deadline =
+        std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (!Grown && std::chrono::steady_clock::now() < Deadline) {
+      bool UnlockRequired;
+      auto TSD = Registry->getTSDAndLock(&UnlockRequired);
+      // Give the other threads a chance to find the TSD locked.
+      std::this_thread::yield();
+      TSD->unlock();
+      if (Registry->getNumberOfTSDs() > 1U)
+        Grown = true;
+    }
+  };
+  std::thread Threads[4];
+  for (auto &T : Threads)
+    T = std::thread(Contend);
+  for (auto &T : Threads)
+    T.join();
+  EXPECT_TRUE(Grown);
+
+  for (scudo::uptr I = 0; I < 100U && Registry->getNumberOfTSDs() > 1U; I++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    Registry->adjustNumberOfTSDsMaybe();
+  }
+  EXPECT_EQ(Registry->getNumberOfTSDs(), 1U);
 }
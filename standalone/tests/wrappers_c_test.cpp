@@ -21,6 +21,9 @@ void malloc_disable(void);
 int malloc_iterate(uintptr_t base, size_t size,
                    void (*callback)(uintptr_t base, size_t size, void *arg),
                    void *arg);
+size_t __scudo_malloc_batch(size_t size, size_t count, void **ptrs);
+void __scudo_free_batch(void **ptrs, size_t count);
+void __scudo_thread_cache_flush(void);
 }
 
 // Note that every C allocation function in the test binary will be fulfilled
@@ -59,6 +62,34 @@ TEST(ScudoWrappersCTest, Malloc) {
   EXPECT_EQ(errno, ENOMEM);
 }
 
+TEST(ScudoWrappersCTest, ThreadCacheFlush) {
+  void *P = malloc(Size);
+  EXPECT_NE(P, nullptr);
+  free(P);
+  __scudo_thread_cache_flush();
+  P = malloc(Size);
+  EXPECT_NE(P, nullptr);
+  free(P);
+}
+
+TEST(ScudoWrappersCTest, MallocBatch) {
+  void *Ptrs[100];
+  const size_t Count = sizeof(Ptrs) / sizeof(Ptrs[0]);
+  const uintptr_t Alignment = FIRST_32_SECOND_64(8U, 16U);
+  EXPECT_EQ(__scudo_malloc_batch(Size, Count, Ptrs), Count);
+  for (size_t I = 0; I < Count; I++) {
+    EXPECT_NE(Ptrs[I], nullptr);
+    EXPECT_LE(Size, malloc_usable_size(Ptrs[I]));
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(Ptrs[I]) % Alignment, 0U);
+  }
+  // Null pointers are ignored, as they would be by free.
+  free(Ptrs[Count / 2]);
+  Ptrs[Count / 2] = nullptr;
+  __scudo_free_batch(Ptrs, Count);
+  // Chunks freed in bulk still detect a double free.
+  EXPECT_DEATH(__scudo_free_batch(Ptrs, Count), "");
+}
+
 TEST(ScudoWrappersCTest, Calloc) {
   void *P = calloc(1U, Size);
   EXPECT_NE(P, nullptr);
@@ -212,6 +243,19 @@ TEST(ScudoWrappersCTest, MallOpt) {
   EXPECT_EQ(mallopt(M_DECAY_TIME, 0), 1);
   EXPECT_EQ(mallopt(M_DECAY_TIME, 1), 1);
   EXPECT_EQ(mallopt(M_DECAY_TIME, 0), 1);
+  EXPECT_EQ(mallopt(M_DECAY_TIME, -1), 1);
+  EXPECT_EQ(mallopt(M_DECAY_TIME, 0), 1);
+
+  // Scudo specific parameters, see wrappers_c.h.
+  EXPECT_EQ(mallopt(-200, 16), 1);
+  EXPECT_EQ(mallopt(-201, 1 << 20), 1);
+  EXPECT_EQ(mallopt(-203, 32 << 20), 1);
+  EXPECT_EQ(mallopt(-202, 8), 1);
+  EXPECT_EQ(mallopt(-202, 0), 1);
+  EXPECT_EQ(mallopt(-200, -1), 0);
+  EXPECT_EQ(mallopt(-302, 512), 1);
+  // Only the hybrid TSD registry supports a limit of exclusive threads.
+  EXPECT_EQ(mallopt(-400, 64), 0);
 }
 
 TEST(ScudoWrappersCTest, OtherAlloc) {
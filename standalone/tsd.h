@@ -56,9 +56,40 @@ template <class Allocator> struct ALIGNED(SCUDO_CACHE_LINE_SIZE) TSD {
   INLINE void unlock() { Mutex.unlock(); }
   INLINE uptr getPrecedence() { return atomic_load_relaxed(&Precedence); }
 
+  // Registries that can reclaim the caches of idle TSDs mark them on use.
+  INLINE void markUsed() { atomic_store_relaxed(&Used, 1U); }
+  // Returns true if the TSD hasn't been used for at least IdleIntervalNs. The
+  // time of last use is only sampled by the successive calls, so it is late
+  // by up to the interval between those.
+  bool isIdle(u64 Time, u64 IdleIntervalNs) {
+    if (atomic_load_relaxed(&Used)) {
+      atomic_store_relaxed(&Used, 0U);
+      atomic_store_relaxed(&LastUsedTime, Time);
+    }
+    return Time - atomic_load_relaxed(&LastUsedTime) >= IdleIntervalNs;
+  }
+
+  // Contention counters, maintained by the registries that share TSDs: the
+  // number of times the TSD was locked, and the number of failed attempts.
+  // The former is only updated with the TSD locked.
+  INLINE void noteLocked() {
+    atomic_store_relaxed(&Locks, atomic_load_relaxed(&Locks) + 1);
+  }
+  void noteContended() {
+    atomic_fetch_add(&ContendedLocks, 1U, memory_order_relaxed);
+  }
+  uptr getLocks() const { return atomic_load_relaxed(&Locks); }
+  uptr getContendedLocks() const {
+    return atomic_load_relaxed(&ContendedLocks);
+  }
+
 private:
   HybridMutex Mutex;
   atomic_uptr Precedence;
+  atomic_u8 Used;
+  atomic_u64 LastUsedTime;
+  atomic_uptr Locks;
+  atomic_uptr ContendedLocks;
 };
 
 } // namespace scudo
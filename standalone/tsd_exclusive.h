@@ -9,6 +9,7 @@
 #ifndef SCUDO_TSD_EXCLUSIVE_H_
 #define SCUDO_TSD_EXCLUSIVE_H_
 
+#include "string_utils.h"
 #include "tsd.h"
 
 #include <pthread.h>
@@ -23,7 +24,15 @@ enum class ThreadState : u8 {
 
 template <class Allocator> void teardownThread(void *Ptr);
 
+// The TSD of a thread lives in its thread local storage. When the thread exits,
+// the contents of its caches are moved to a small pool of orphaned TSDs, to be
+// adopted wholesale by the next thread that starts. This spares thread churn
+// the cost of draining the caches of a thread to refill those of the next one.
+// Only when the pool is full are the caches committed back to the allocator.
+// The TSDs of the pool are mapped on their first use, and kept.
 template <class Allocator> struct TSDRegistryExT {
+  static const u32 MaxOrphanedTSDs = 4U;
+
   void initLinkerInitialized(Allocator *Instance) {
     Instance->initLinkerInitialized();
     CHECK_EQ(pthread_key_create(&PThreadKey, teardownThread<Allocator>), 0);
@@ -39,6 +48,8 @@ template <class Allocator> struct TSDRegistryExT {
 
   void unmapTestOnly() {
     unmap(reinterpret_cast<void *>(FallbackTSD), sizeof(TSD<Allocator>));
+    for (u32 I = 0; I < NumberOfMappedOrphanedTSDs; I++)
+      unmap(reinterpret_cast<void *>(OrphanedTSDs[I]), sizeof(TSD<Allocator>));
   }
 
   ALWAYS_INLINE void initThreadMaybe(Allocator *Instance, bool MinimalInit) {
@@ -54,10 +65,44 @@ template <class Allocator> struct TSDRegistryExT {
     }
     DCHECK(FallbackTSD);
     FallbackTSD->lock();
+    FallbackTSD->markUsed();
     *UnlockRequired = true;
     return FallbackTSD;
   }
 
+  // The thread specific TSDs are used without locking, and can only be drained
+  // by their own thread. This leaves the fallback TSD and the orphaned ones,
+  // if they have been idle for IdleIntervalNs. Returns the number of TSDs
+  // drained.
+  uptr drainCaches(Allocator *Instance, u64 IdleIntervalNs) {
+    ScopedLock L(Mutex);
+    if (!Initialized)
+      return 0;
+    const u64 Time = getMonotonicTime();
+    uptr Drained = 0;
+    if (FallbackTSD->isIdle(Time, IdleIntervalNs) && FallbackTSD->tryLock()) {
+      Instance->drainCaches(FallbackTSD);
+      FallbackTSD->unlock();
+      Drained++;
+    }
+    // Nobody uses the orphaned TSDs while we hold the mutex.
+    for (u32 I = 0; I < NumberOfOrphanedTSDs; I++) {
+      if (!OrphanedTSDs[I]->isIdle(Time, IdleIntervalNs))
+        continue;
+      Instance->drainCaches(OrphanedTSDs[I]);
+      Drained++;
+    }
+    return Drained;
+  }
+
+  bool setOption(UNUSED Option O, UNUSED sptr Value) { return false; }
+
+  void getStats(ScopedString *Str) {
+    ScopedLock L(Mutex);
+    Str->append("Stats: ExclusiveTSDs: %u orphaned TSDs\n",
+                NumberOfOrphanedTSDs);
+  }
+
 private:
   void initOnceMaybe(Allocator *Instance) {
     ScopedLock L(Mutex);
@@ -76,13 +121,44 @@ private:
     CHECK_EQ(
         pthread_setspecific(PThreadKey, reinterpret_cast<void *>(Instance)), 0);
     ThreadTSD.initLinkerInitialized(Instance);
+    adoptOrphanedTSD(Instance);
     State = ThreadState::Initialized;
   }
 
+  // The orphaned TSDs are the first NumberOfOrphanedTSDs of the pool, the
+  // following ones being mapped but empty.
+  void adoptOrphanedTSD(Allocator *Instance) {
+    ScopedLock L(Mutex);
+    if (NumberOfOrphanedTSDs == 0)
+      return;
+    Instance->moveCaches(OrphanedTSDs[--NumberOfOrphanedTSDs], &ThreadTSD);
+  }
+
+  // Returns false if the pool is full.
+  bool orphanTSD(Allocator *Instance, TSD<Allocator> *ExitingTSD) {
+    ScopedLock L(Mutex);
+    if (NumberOfOrphanedTSDs == MaxOrphanedTSDs)
+      return false;
+    if (NumberOfOrphanedTSDs == NumberOfMappedOrphanedTSDs) {
+      TSD<Allocator> *OrphanedTSD = reinterpret_cast<TSD<Allocator> *>(
+          map(nullptr, sizeof(TSD<Allocator>), "scudo:tsd"));
+      OrphanedTSD->initLinkerInitialized(Instance);
+      OrphanedTSDs[NumberOfMappedOrphanedTSDs++] = OrphanedTSD;
+    }
+    TSD<Allocator> *OrphanedTSD = OrphanedTSDs[NumberOfOrphanedTSDs++];
+    Instance->moveCaches(ExitingTSD, OrphanedTSD);
+    // Starts the idle period of the TSD.
+    OrphanedTSD->markUsed();
+    return true;
+  }
+
   pthread_key_t PThreadKey;
   bool Initialized;
   TSD<Allocator> *FallbackTSD;
   HybridMutex Mutex;
+  u32 NumberOfOrphanedTSDs;
+  u32 NumberOfMappedOrphanedTSDs;
+  TSD<Allocator> *OrphanedTSDs[MaxOrphanedTSDs];
   static THREADLOCAL ThreadState State;
   static THREADLOCAL TSD<Allocator> ThreadTSD;
 
@@ -102,15 +178,20 @@ template <class Allocator> void teardownThread(void *Ptr) {
   // We want to be called last since other destructors might call free and the
   // like, so we wait until PTHREAD_DESTRUCTOR_ITERATIONS before draining the
   // quarantine and swallowing the cache.
-  if (TSDRegistryT::ThreadTSD.DestructorIterations > 1) {
-    TSDRegistryT::ThreadTSD.DestructorIterations--;
+  TSD<Allocator> *ThreadTSD = &TSDRegistryT::ThreadTSD;
+  if (ThreadTSD->DestructorIterations > 1) {
+    ThreadTSD->DestructorIterations--;
     // If pthread_setspecific fails, we will go ahead with the teardown.
     if (LIKELY(pthread_setspecific(Instance->getTSDRegistry()->PThreadKey,
                                    Ptr) == 0))
       return;
   }
-  TSDRegistryT::ThreadTSD.commitBack(Instance);
+  // Any further heap operation of the thread will go to the fallback TSD.
   TSDRegistryT::State = ThreadState::TornDown;
+  // Whatever is left in the caches, if the pool was full, is committed back,
+  // and the stats of the TSD unlinked either way.
+  Instance->getTSDRegistry()->orphanTSD(Instance, ThreadTSD);
+  ThreadTSD->commitBack(Instance);
 }
 
 } // namespace scudo
@@ -0,0 +1,223 @@
+//===-- tsd_hybrid.h --------------------------------------------*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef SCUDO_TSD_HYBRID_H_
+#define SCUDO_TSD_HYBRID_H_
+
+#include "string_utils.h"
+#include "tsd.h"
+
+#include <pthread.h>
+
+namespace scudo {
+
+template <class Allocator> void teardownHybridThread(void *Ptr);
+
+// A registry giving an exclusive TSD to the first threads, up to a limit that
+// can be changed at runtime, and having the other threads share a pool of TSDs.
+// Exclusive TSDs are mapped on demand, so the threads that share a TSD don't
+// pay for the memory of one. Lowering the limit only applies to the threads
+// started after that.
+template <class Allocator, u32 MaxSharedTSDs, u32 DefaultMaxExclusiveThreads>
+struct TSDRegistryHybridT {
+  void initLinkerInitialized(Allocator *Instance) {
+    Instance->initLinkerInitialized();
+    CHECK_EQ(pthread_key_create(&PThreadKey, teardownHybridThread<Allocator>),
+             0);
+    NumberOfSharedTSDs = Min(Max(1U, getNumberOfCPUs()), MaxSharedTSDs);
+    SharedTSDs = reinterpret_cast<TSD<Allocator> *>(
+        map(nullptr, sizeof(TSD<Allocator>) * NumberOfSharedTSDs, "scudo:tsd"));
+    for (u32 I = 0; I < NumberOfSharedTSDs; I++)
+      SharedTSDs[I].initLinkerInitialized(Instance);
+    atomic_store_relaxed(&MaxExclusiveThreads, DefaultMaxExclusiveThreads);
+    Initialized = true;
+  }
+  void init(Allocator *Instance) {
+    memset(this, 0, sizeof(*this));
+    initLinkerInitialized(Instance);
+  }
+
+  void unmapTestOnly() {
+    unmap(reinterpret_cast<void *>(SharedTSDs),
+          sizeof(TSD<Allocator>) * NumberOfSharedTSDs);
+  }
+
+  ALWAYS_INLINE void initThreadMaybe(Allocator *Instance, bool MinimalInit) {
+    if (LIKELY(State != HybridThreadState::NotInitialized))
+      return;
+    initThread(Instance, MinimalInit);
+  }
+
+  ALWAYS_INLINE TSD<Allocator> *getTSDAndLock(bool *UnlockRequired) {
+    if (LIKELY(State == HybridThreadState::Exclusive)) {
+      *UnlockRequired = false;
+      return ThreadTSD;
+    }
+    *UnlockRequired = true;
+    // Threads that were not, or are no longer, initialized use the first
+    // shared TSD.
+    TSD<Allocator> *CurrentTSD =
+        LIKELY(State == HybridThreadState::Shared) ? ThreadTSD : &SharedTSDs[0];
+    if (UNLIKELY(!CurrentTSD->tryLock()))
+      CurrentTSD = getTSDAndLockSlow(CurrentTSD);
+    CurrentTSD->markUsed();
+    return CurrentTSD;
+  }
+
+  // The exclusive TSDs can only be drained by their own thread, this drains
+  // the shared TSDs that haven't been used for IdleIntervalNs, skipping those
+  // currently locked. Returns the number of TSDs drained.
+  uptr drainCaches(Allocator *Instance, u64 IdleIntervalNs) {
+    ScopedLock L(Mutex);
+    const u64 Time = getMonotonicTime();
+    uptr Drained = 0;
+    for (u32 I = 0; I < NumberOfSharedTSDs; I++) {
+      TSD<Allocator> *CandidateTSD = &SharedTSDs[I];
+      if (!CandidateTSD->isIdle(Time, IdleIntervalNs) ||
+          !CandidateTSD->tryLock())
+        continue;
+      Instance->drainCaches(CandidateTSD);
+      CandidateTSD->unlock();
+      Drained++;
+    }
+    return Drained;
+  }
+
+  bool setOption(Option O, sptr Value) {
+    if (O != Option::MaxExclusiveThreads || Value < 0)
+      return false;
+    atomic_store_relaxed(&MaxExclusiveThreads,
+                         static_cast<u32>(Min(Value, sptr(UINT32_MAX))));
+    return true;
+  }
+
+  void getStats(ScopedString *Str) {
+    Str->append("Stats: HybridTSDs: %u exclusive threads (max %u), %u shared "
+                "threads on %u TSDs\n",
+                atomic_load_relaxed(&NumberOfExclusiveThreads),
+                atomic_load_relaxed(&MaxExclusiveThreads),
+                atomic_load_relaxed(&NumberOfSharedThreads),
+                NumberOfSharedTSDs);
+  }
+
+  u32 getNumberOfExclusiveThreads() const {
+    return atomic_load_relaxed(&NumberOfExclusiveThreads);
+  }
+  u32 getNumberOfSharedThreads() const {
+    return atomic_load_relaxed(&NumberOfSharedThreads);
+  }
+
+private:
+  enum class HybridThreadState : u8 {
+    NotInitialized = 0,
+    Exclusive,
+    Shared,
+    TornDown,
+  };
+
+  void initOnceMaybe(Allocator *Instance) {
+    ScopedLock L(Mutex);
+    if (LIKELY(Initialized))
+      return;
+    initLinkerInitialized(Instance); // Sets Initialized.
+  }
+
+  // As for the exclusive registry, minimal initialization leaves the thread
+  // specific data untouched.
+  NOINLINE void initThread(Allocator *Instance, bool MinimalInit) {
+    initOnceMaybe(Instance);
+    if (UNLIKELY(MinimalInit))
+      return;
+    CHECK_EQ(
+        pthread_setspecific(PThreadKey, reinterpret_cast<void *>(Instance)), 0);
+    const u32 Exclusive =
+        atomic_fetch_add(&NumberOfExclusiveThreads, 1U, memory_order_relaxed);
+    if (Exclusive < atomic_load_relaxed(&MaxExclusiveThreads)) {
+      ThreadTSD = reinterpret_cast<TSD<Allocator> *>(
+          map(nullptr, sizeof(TSD<Allocator>), "scudo:tsd"));
+      ThreadTSD->initLinkerInitialized(Instance);
+      State = HybridThreadState::Exclusive;
+      return;
+    }
+    atomic_fetch_sub(&NumberOfExclusiveThreads, 1U, memory_order_relaxed);
+    // Shared TSDs are assigned in a round-robin fashion.
+    const u32 Index =
+        atomic_fetch_add(&NumberOfSharedThreads, 1U, memory_order_relaxed);
+    ThreadTSD = &SharedTSDs[Index % NumberOfSharedTSDs];
+    State = HybridThreadState::Shared;
+  }
+
+  // Try a few other shared TSDs before waiting on the current one, and stick
+  // to the one that could be locked.
+  NOINLINE TSD<Allocator> *getTSDAndLockSlow(TSD<Allocator> *CurrentTSD) {
+    const u32 Index = static_cast<u32>(CurrentTSD - SharedTSDs);
+    for (u32 I = 1; I < Min(4U, NumberOfSharedTSDs); I++) {
+      TSD<Allocator> *CandidateTSD =
+          &SharedTSDs[(Index + I) % NumberOfSharedTSDs];
+      if (CandidateTSD->tryLock()) {
+        if (State == HybridThreadState::Shared)
+          ThreadTSD = CandidateTSD;
+        return CandidateTSD;
+      }
+    }
+    CurrentTSD->lock();
+    return CurrentTSD;
+  }
+
+  pthread_key_t PThreadKey;
+  bool Initialized;
+  HybridMutex Mutex;
+  u32 NumberOfSharedTSDs;
+  TSD<Allocator> *SharedTSDs;
+  atomic_u32 MaxExclusiveThreads;
+  atomic_u32 NumberOfExclusiveThreads;
+  atomic_u32 NumberOfSharedThreads;
+  static THREADLOCAL HybridThreadState State;
+  static THREADLOCAL TSD<Allocator> *ThreadTSD;
+
+  friend void teardownHybridThread<Allocator>(void *Ptr);
+};
+
+template <class Allocator, u32 MaxSharedTSDs, u32 DefaultMaxExclusiveThreads>
+THREADLOCAL typename TSDRegistryHybridT<
+    Allocator, MaxSharedTSDs, DefaultMaxExclusiveThreads>::HybridThreadState
+    TSDRegistryHybridT<Allocator, MaxSharedTSDs,
+                       DefaultMaxExclusiveThreads>::State;
+template <class Allocator, u32 MaxSharedTSDs, u32 DefaultMaxExclusiveThreads>
+THREADLOCAL TSD<Allocator> *TSDRegistryHybridT<
+    Allocator, MaxSharedTSDs, DefaultMaxExclusiveThreads>::ThreadTSD;
+
+template <class Allocator> void teardownHybridThread(void *Ptr) {
+  typedef typename Allocator::TSDRegistryT TSDRegistryT;
+  Allocator *Instance = reinterpret_cast<Allocator *>(Ptr);
+  TSDRegistryT *Registry = Instance->getTSDRegistry();
+  if (TSDRegistryT::State == TSDRegistryT::HybridThreadState::Shared) {
+    atomic_fetch_sub(&Registry->NumberOfSharedThreads, 1U,
+                     memory_order_relaxed);
+    TSDRegistryT::State = TSDRegistryT::HybridThreadState::TornDown;
+    return;
+  }
+  // As for the exclusive registry, wait for the last destructor iteration, as
+  // other destructors might still call free and the like.
+  TSD<Allocator> *ThreadTSD = TSDRegistryT::ThreadTSD;
+  if (ThreadTSD->DestructorIterations > 1) {
+    ThreadTSD->DestructorIterations--;
+    if (LIKELY(pthread_setspecific(Registry->PThreadKey, Ptr) == 0))
+      return;
+  }
+  TSDRegistryT::State = TSDRegistryT::HybridThreadState::TornDown;
+  TSDRegistryT::ThreadTSD = nullptr;
+  ThreadTSD->commitBack(Instance);
+  unmap(reinterpret_cast<void *>(ThreadTSD), sizeof(TSD<Allocator>));
+  atomic_fetch_sub(&Registry->NumberOfExclusiveThreads, 1U,
+                   memory_order_relaxed);
+}
+
+} // namespace scudo
+
+#endif // SCUDO_TSD_HYBRID_H_
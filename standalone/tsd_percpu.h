@@ -0,0 +1,145 @@
+//===-- tsd_percpu.h --------------------------------------------*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef SCUDO_TSD_PERCPU_H_
+#define SCUDO_TSD_PERCPU_H_
+
+#include "string_utils.h"
+#include "tsd.h"
+
+#include <pthread.h>
+
+// Starting with 2.35, glibc registers a restartable sequences area for every
+// thread, the kernel keeping its cpu_id field up to date. Reading it is a lot
+// cheaper than a call to sched_getcpu.
+#if SCUDO_LINUX && !SCUDO_ANDROID && defined(__GLIBC_PREREQ)
+#if __GLIBC_PREREQ(2, 35) && defined(__has_builtin)
+#if __has_builtin(__builtin_thread_pointer)
+#define SCUDO_HAS_RSEQ 1
+#include <sys/rseq.h>
+#endif
+#endif
+#endif
+
+#ifndef SCUDO_HAS_RSEQ
+#define SCUDO_HAS_RSEQ 0
+#endif
+
+namespace scudo {
+
+// A registry with one TSD per CPU, the calling thread using the one of the CPU
+// it is currently running on. As long as a thread isn't preempted while holding
+// a TSD, the lock of the TSD is uncontended, and the caches are local to a CPU
+// whatever the number of threads.
+template <class Allocator, u32 MaxTSDCount> struct TSDRegistryPerCpuT {
+  void initLinkerInitialized(Allocator *Instance) {
+    Instance->initLinkerInitialized();
+    NumberOfTSDs = Min(Max(1U, getNumberOfCPUs()), MaxTSDCount);
+    TSDs = reinterpret_cast<TSD<Allocator> *>(
+        map(nullptr, sizeof(TSD<Allocator>) * NumberOfTSDs, "scudo:tsd"));
+    for (u32 I = 0; I < NumberOfTSDs; I++)
+      TSDs[I].initLinkerInitialized(Instance);
+    atomic_store(&Initialized, 1U, memory_order_release);
+  }
+  void init(Allocator *Instance) {
+    memset(this, 0, sizeof(*this));
+    initLinkerInitialized(Instance);
+  }
+
+  void unmapTestOnly() {
+    unmap(reinterpret_cast<void *>(TSDs),
+          sizeof(TSD<Allocator>) * NumberOfTSDs);
+  }
+
+  // There is no thread specific state, only the registry has to be set up.
+  ALWAYS_INLINE void initThreadMaybe(Allocator *Instance,
+                                     UNUSED bool MinimalInit) {
+    if (LIKELY(atomic_load(&Initialized, memory_order_acquire)))
+      return;
+    initOnceMaybe(Instance);
+  }
+
+  ALWAYS_INLINE TSD<Allocator> *getTSDAndLock(bool *UnlockRequired) {
+    *UnlockRequired = true;
+    const u32 Index = getCPU() % NumberOfTSDs;
+    TSD<Allocator> *CurrentTSD = &TSDs[Index];
+    if (UNLIKELY(!CurrentTSD->tryLock()))
+      CurrentTSD = getTSDAndLockSlow(Index);
+    CurrentTSD->markUsed();
+    return CurrentTSD;
+  }
+
+  // Drains the caches of the TSDs that haven't been used for IdleIntervalNs,
+  // skipping those currently locked. Returns the number of TSDs drained.
+  uptr drainCaches(Allocator *Instance, u64 IdleIntervalNs) {
+    ScopedLock L(Mutex);
+    const u64 Time = getMonotonicTime();
+    uptr Drained = 0;
+    for (u32 I = 0; I < NumberOfTSDs; I++) {
+      TSD<Allocator> *CandidateTSD = &TSDs[I];
+      if (!CandidateTSD->isIdle(Time, IdleIntervalNs) ||
+          !CandidateTSD->tryLock())
+        continue;
+      Instance->drainCaches(CandidateTSD);
+      CandidateTSD->unlock();
+      Drained++;
+    }
+    return Drained;
+  }
+
+  bool setOption(UNUSED Option O, UNUSED sptr Value) { return false; }
+
+  void getStats(ScopedString *Str) {
+    Str->append("Stats: PerCpuTSDs: %u TSDs\n", NumberOfTSDs);
+  }
+
+private:
+  static ALWAYS_INLINE u32 getCPU() {
+#if SCUDO_HAS_RSEQ
+    // __rseq_size is 0 if glibc didn't register the area.
+    if (LIKELY(__rseq_size)) {
+      const struct rseq *Rseq = reinterpret_cast<const struct rseq *>(
+          reinterpret_cast<uptr>(__builtin_thread_pointer()) + __rseq_offset);
+      const s32 CPU = static_cast<s32>(
+          __atomic_load_n(&Rseq->cpu_id, __ATOMIC_RELAXED));
+      if (LIKELY(CPU >= 0))
+        return static_cast<u32>(CPU);
+    }
+#endif
+    return getCurrentCPU();
+  }
+
+  void initOnceMaybe(Allocator *Instance) {
+    ScopedLock L(Mutex);
+    if (LIKELY(atomic_load_relaxed(&Initialized)))
+      return;
+    initLinkerInitialized(Instance); // Sets Initialized.
+  }
+
+  // The TSD of the current CPU is held by a thread that was preempted, or that
+  // migrated (as might have the current thread). Try a few neighbours before
+  // waiting on it.
+  NOINLINE TSD<Allocator> *getTSDAndLockSlow(u32 Index) {
+    for (u32 I = 1; I < Min(4U, NumberOfTSDs); I++) {
+      TSD<Allocator> *CandidateTSD = &TSDs[(Index + I) % NumberOfTSDs];
+      if (CandidateTSD->tryLock())
+        return CandidateTSD;
+    }
+    TSDs[Index].lock();
+    return &TSDs[Index];
+  }
+
+  atomic_u8 Initialized;
+  u32 NumberOfTSDs;
+  TSD<Allocator> *TSDs;
+  HybridMutex Mutex;
+};
+
+} // namespace scudo
+
+#endif // SCUDO_TSD_PERCPU_H_
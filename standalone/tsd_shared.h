@@ -10,36 +10,39 @@
 #define SCUDO_TSD_SHARED_H_
 
 #include "linux.h" // for getAndroidTlsPtr()
+#include "string_utils.h"
 #include "tsd.h"
 
 #include <pthread.h>
 
 namespace scudo {
 
-template <class Allocator, u32 MaxTSDCount> struct TSDRegistrySharedT {
+// The number of TSDs starts at the number of CPUs, capped by DefaultTSDCount.
+// When more than 1/16th of the attempts at locking a TSD fail, the registry
+// adds a TSD, up to MaxTSDCount. When less than 1/256th fail, it retires the
+// last TSD added, draining its caches, down to the initial count. Contention is
+// evaluated at most every AdjustIntervalNs, from the slow path and when the
+// idle caches are drained.
+template <class Allocator, u32 MaxTSDCount, u32 DefaultTSDCount = MaxTSDCount>
+struct TSDRegistrySharedT {
+  static const u64 AdjustIntervalNs = 100ULL * 1000000ULL;
+  static const uptr MinLocksToGrow = 1024U;
+
   void initLinkerInitialized(Allocator *Instance) {
     Instance->initLinkerInitialized();
     CHECK_EQ(pthread_key_create(&PThreadKey, nullptr), 0); // For non-TLS
-    NumberOfTSDs = Min(Max(1U, getNumberOfCPUs()), MaxTSDCount);
+    AllocatorInstance = Instance;
+    MinNumberOfTSDs =
+        Min(Max(1U, getNumberOfCPUs()), Min(DefaultTSDCount, MaxTSDCount));
+    // Only the TSDs in use get initialized, and the memory of the others is
+    // left untouched.
     TSDs = reinterpret_cast<TSD<Allocator> *>(
-        map(nullptr, sizeof(TSD<Allocator>) * NumberOfTSDs, "scudo:tsd"));
-    for (u32 I = 0; I < NumberOfTSDs; I++)
+        map(nullptr, sizeof(TSD<Allocator>) * MaxTSDCount, "scudo:tsd"));
+    for (u32 I = 0; I < MinNumberOfTSDs; I++)
       TSDs[I].initLinkerInitialized(Instance);
-    // Compute all the coprimes of NumberOfTSDs. This will be used to walk the
-    // array of TSDs in a random order. For details, see:
-    // https://lemire.me/blog/2017/09/18/visiting-all-values-in-an-array-exactly-once-in-random-order/
-    for (u32 I = 0; I < NumberOfTSDs; I++) {
-      u32 A = I + 1;
-      u32 B = NumberOfTSDs;
-      // Find the GCD between I + 1 and NumberOfTSDs. If 1, they are coprimes.
-      while (B != 0) {
-        const u32 T = A;
-        A = B;
-        B = T % B;
-      }
-      if (A == 1)
-        CoPrimes[NumberOfCoPrimes++] = I + 1;
-    }
+    NumberOfInitializedTSDs = MinNumberOfTSDs;
+    atomic_store_relaxed(&NumberOfTSDs, MinNumberOfTSDs);
+    atomic_store_relaxed(&LastAdjustTime, getMonotonicTime());
     Initialized = true;
   }
   void init(Allocator *Instance) {
@@ -48,8 +51,7 @@ template <class Allocator, u32 MaxTSDCount> struct TSDRegistrySharedT {
   }
 
   void unmapTestOnly() {
-    unmap(reinterpret_cast<void *>(TSDs),
-          sizeof(TSD<Allocator>) * NumberOfTSDs);
+    unmap(reinterpret_cast<void *>(TSDs), sizeof(TSD<Allocator>) * MaxTSDCount);
   }
 
   ALWAYS_INLINE void initThreadMaybe(Allocator *Instance,
@@ -63,11 +65,65 @@ template <class Allocator, u32 MaxTSDCount> struct TSDRegistrySharedT {
     TSD<Allocator> *TSD = getCurrentTSD();
     DCHECK(TSD);
     *UnlockRequired = true;
-    // Try to lock the currently associated context.
-    if (TSD->tryLock())
+    // Try to lock the currently associated context, unless it was retired.
+    if (LIKELY(isActive(TSD)) && TSD->tryLock()) {
+      TSD->markUsed();
+      TSD->noteLocked();
       return TSD;
+    }
     // If that fails, go down the slow path.
-    return getTSDAndLockSlow(TSD);
+    TSD = getTSDAndLockSlow(TSD);
+    TSD->markUsed();
+    TSD->noteLocked();
+    return TSD;
+  }
+
+  // Drains the caches of the TSDs that haven't been used for IdleIntervalNs,
+  // and those of the retired TSDs, skipping those currently locked. Returns
+  // the number of TSDs drained.
+  uptr drainCaches(Allocator *Instance, u64 IdleIntervalNs) {
+    adjustNumberOfTSDsMaybe();
+    ScopedLock L(Mutex);
+    const u64 Time = getMonotonicTime();
+    const u32 N = atomic_load_relaxed(&NumberOfTSDs);
+    uptr Drained = 0;
+    for (u32 I = 0; I < NumberOfInitializedTSDs; I++) {
+      TSD<Allocator> *CandidateTSD = &TSDs[I];
+      // Always sample the use of the TSD, retired or not.
+      if ((!CandidateTSD->isIdle(Time, IdleIntervalNs) && I < N) ||
+          !CandidateTSD->tryLock())
+        continue;
+      Instance->drainCaches(CandidateTSD);
+      CandidateTSD->unlock();
+      Drained++;
+    }
+    return Drained;
+  }
+
+  bool setOption(UNUSED Option O, UNUSED sptr Value) { return false; }
+
+  void getStats(ScopedString *Str) {
+    ScopedLock L(Mutex);
+    Str->append("Stats: SharedTSDs: %u TSDs (%u-%u)\n",
+                atomic_load_relaxed(&NumberOfTSDs), MinNumberOfTSDs,
+                MaxTSDCount);
+    for (u32 I = 0; I < NumberOfInitializedTSDs; I++)
+      Str->append("  %02u: %zu locks, %zu contended\n", I, TSDs[I].getLocks(),
+                  TSDs[I].getContendedLocks());
+  }
+
+  u32 getNumberOfTSDs() const { return atomic_load_relaxed(&NumberOfTSDs); }
+
+  // Grows or shrinks the TSD array based on the contention measured since the
+  // previous adjustment, if it's due.
+  void adjustNumberOfTSDsMaybe() {
+    if (MaxTSDCount == MinNumberOfTSDs ||
+        getMonotonicTime() < atomic_load_relaxed(&LastAdjustTime) +
+                                 AdjustIntervalNs ||
+        !Mutex.tryLock())
+      return;
+    adjustNumberOfTSDs();
+    Mutex.unlock();
   }
 
 private:
@@ -93,6 +149,10 @@ private:
 #endif
   }
 
+  ALWAYS_INLINE bool isActive(TSD<Allocator> *CurrentTSD) {
+    return CurrentTSD < &TSDs[atomic_load_relaxed(&NumberOfTSDs)];
+  }
+
   void initOnceMaybe(Allocator *Instance) {
     ScopedLock L(Mutex);
     if (LIKELY(Initialized))
@@ -100,25 +160,57 @@ private:
     initLinkerInitialized(Instance); // Sets Initialized.
   }
 
+  // Assignments are done in a plain round-robin fashion.
+  TSD<Allocator> *getNextTSD() {
+    const u32 Index = atomic_fetch_add(&CurrentIndex, 1U, memory_order_relaxed);
+    return &TSDs[Index % atomic_load(&NumberOfTSDs, memory_order_acquire)];
+  }
+
   NOINLINE void initThread(Allocator *Instance) {
     initOnceMaybe(Instance);
-    // Initial context assignment is done in a plain round-robin fashion.
-    const u32 Index = atomic_fetch_add(&CurrentIndex, 1U, memory_order_relaxed);
-    setCurrentTSD(&TSDs[Index % NumberOfTSDs]);
+    setCurrentTSD(getNextTSD());
+  }
+
+  // Returns an increment coprime with N, derived from R. Using it to walk the
+  // array of TSDs visits them all in a random order. For details, see:
+  // https://lemire.me/blog/2017/09/18/visiting-all-values-in-an-array-exactly-once-in-random-order/
+  static u32 getCoPrime(u32 R, u32 N) {
+    for (u32 Inc = R % N + 1;; Inc = (Inc % N) + 1) {
+      u32 A = Inc;
+      u32 B = N;
+      // Find the GCD between Inc and N. If 1, they are coprimes.
+      while (B != 0) {
+        const u32 T = A;
+        A = B;
+        B = T % B;
+      }
+      if (A == 1)
+        return Inc;
+    }
   }
 
   NOINLINE TSD<Allocator> *getTSDAndLockSlow(TSD<Allocator> *CurrentTSD) {
-    if (MaxTSDCount > 1U && NumberOfTSDs > 1U) {
+    if (UNLIKELY(!isActive(CurrentTSD))) {
+      // The TSD was retired, move on to an active one.
+      CurrentTSD = getNextTSD();
+      setCurrentTSD(CurrentTSD);
+      if (CurrentTSD->tryLock())
+        return CurrentTSD;
+    }
+    CurrentTSD->noteContended();
+    adjustNumberOfTSDsMaybe();
+    const u32 N = atomic_load(&NumberOfTSDs, memory_order_acquire);
+    if (MaxTSDCount > 1U && N > 1U) {
       // Use the Precedence of the current TSD as our random seed. Since we are
       // in the slow path, it means that tryLock failed, and as a result it's
       // very likely that said Precedence is non-zero.
       const u32 R = static_cast<u32>(CurrentTSD->getPrecedence());
-      const u32 Inc = CoPrimes[R % NumberOfCoPrimes];
-      u32 Index = R % NumberOfTSDs;
+      const u32 Inc = getCoPrime(R, N);
+      u32 Index = R % N;
       uptr LowestPrecedence = UINTPTR_MAX;
       TSD<Allocator> *CandidateTSD = nullptr;
       // Go randomly through at most 4 contexts and find a candidate.
-      for (u32 I = 0; I < Min(4U, NumberOfTSDs); I++) {
+      for (u32 I = 0; I < Min(4U, N); I++) {
         if (TSDs[Index].tryLock()) {
           setCurrentTSD(&TSDs[Index]);
           return &TSDs[Index];
@@ -130,8 +222,8 @@ private:
           LowestPrecedence = Precedence;
         }
         Index += Inc;
-        if (Index >= NumberOfTSDs)
-          Index -= NumberOfTSDs;
+        if (Index >= N)
+          Index -= N;
       }
       if (CandidateTSD) {
         CandidateTSD->lock();
@@ -144,12 +236,54 @@ private:
     return CurrentTSD;
   }
 
+  // Requires the registry mutex. The counters of all the initialized TSDs are
+  // accounted for, as threads can still be locking a TSD that was just retired.
+  void adjustNumberOfTSDs() {
+    const u64 Time = getMonotonicTime();
+    if (Time < atomic_load_relaxed(&LastAdjustTime) + AdjustIntervalNs)
+      return;
+    atomic_store_relaxed(&LastAdjustTime, Time);
+    uptr Locks = 0;
+    uptr ContendedLocks = 0;
+    for (u32 I = 0; I < NumberOfInitializedTSDs; I++) {
+      Locks += TSDs[I].getLocks();
+      ContendedLocks += TSDs[I].getContendedLocks();
+    }
+    const uptr NewLocks = Locks - LocksAtAdjust;
+    const uptr NewContendedLocks = ContendedLocks - ContendedLocksAtAdjust;
+    LocksAtAdjust = Locks;
+    ContendedLocksAtAdjust = ContendedLocks;
+    const u32 N = atomic_load_relaxed(&NumberOfTSDs);
+    if (NewLocks >= MinLocksToGrow && NewContendedLocks * 16 > NewLocks &&
+        N < MaxTSDCount) {
+      if (N == NumberOfInitializedTSDs) {
+        TSDs[N].initLinkerInitialized(AllocatorInstance);
+        NumberOfInitializedTSDs++;
+      }
+      atomic_store(&NumberOfTSDs, N + 1, memory_order_release);
+    } else if (NewContendedLocks * 256 <= NewLocks && N > MinNumberOfTSDs) {
+      atomic_store_relaxed(&NumberOfTSDs, N - 1);
+      // The threads still using the retired TSD will move on to another one
+      // on their next allocation, the idle cache draining catches up with the
+      // blocks they cache in the meantime.
+      TSD<Allocator> *RetiredTSD = &TSDs[N - 1];
+      if (RetiredTSD->tryLock()) {
+        AllocatorInstance->drainCaches(RetiredTSD);
+        RetiredTSD->unlock();
+      }
+    }
+  }
+
   pthread_key_t PThreadKey;
   atomic_u32 CurrentIndex;
-  u32 NumberOfTSDs;
+  atomic_u32 NumberOfTSDs;
+  u32 MinNumberOfTSDs;
+  u32 NumberOfInitializedTSDs;
   TSD<Allocator> *TSDs;
-  u32 NumberOfCoPrimes;
-  u32 CoPrimes[MaxTSDCount];
+  Allocator *AllocatorInstance;
+  atomic_u64 LastAdjustTime;
+  uptr LocksAtAdjust;
+  uptr ContendedLocksAtAdjust;
   bool Initialized;
   HybridMutex Mutex;
 #if SCUDO_LINUX && !SCUDO_ANDROID
@@ -158,9 +292,9 @@ private:
 };
 
 #if SCUDO_LINUX && !SCUDO_ANDROID
-template <class Allocator, u32 MaxTSDCount>
+template <class Allocator, u32 MaxTSDCount, u32 DefaultTSDCount>
 THREADLOCAL TSD<Allocator>
-    *TSDRegistrySharedT<Allocator, MaxTSDCount>::ThreadTSD;
+    *TSDRegistrySharedT<Allocator, MaxTSDCount, DefaultTSDCount>::ThreadTSD;
 #endif
 
 } // namespace scudo
@@ -34,6 +34,21 @@ extern "C" {
 
 INTERFACE void __scudo_print_stats(void) { Allocator.printStats(); }
 
+INTERFACE void __scudo_thread_cache_flush(void) {
+  Allocator.flushThreadCache();
+}
+
+INTERFACE size_t __scudo_malloc_batch(size_t size, size_t count, void **ptrs) {
+  const size_t Allocated = Allocator.allocateBatch(size, count, ptrs);
+  if (UNLIKELY(Allocated < count))
+    errno = ENOMEM;
+  return Allocated;
+}
+
+INTERFACE void __scudo_free_batch(void **ptrs, size_t count) {
+  Allocator.deallocateBatch(ptrs, count);
+}
+
 } // extern "C"
 
 #endif // !SCUDO_ANDROID || !_BIONIC
@@ -49,4 +49,46 @@ struct __scudo_mallinfo {
 #define M_PURGE -101
 #endif
 
+// Scudo specific mallopt parameters, see Allocator::setOption. Sizes are in
+// bytes.
+#ifndef M_CACHE_COUNT_MAX
+#define M_CACHE_COUNT_MAX -200
+#endif
+
+#ifndef M_CACHE_SIZE_MAX
+#define M_CACHE_SIZE_MAX -201
+#endif
+
+#ifndef M_THREAD_CACHE_COUNT_MAX
+#define M_THREAD_CACHE_COUNT_MAX -202
+#endif
+
+#ifndef M_CACHE_TOTAL_SIZE_MAX
+#define M_CACHE_TOTAL_SIZE_MAX -203
+#endif
+
+#ifndef M_QUARANTINE_SIZE
+#define M_QUARANTINE_SIZE -300
+#endif
+
+#ifndef M_THREAD_LOCAL_QUARANTINE_SIZE
+#define M_THREAD_LOCAL_QUARANTINE_SIZE -301
+#endif
+
+#ifndef M_QUARANTINE_MAX_CHUNK_SIZE
+#define M_QUARANTINE_MAX_CHUNK_SIZE -302
+#endif
+
+#ifndef M_QUARANTINE_RELEASE_MIN_SIZE
+#define M_QUARANTINE_RELEASE_MIN_SIZE -303
+#endif
+
+#ifndef M_EXCLUSIVE_THREADS_MAX
+#define M_EXCLUSIVE_THREADS_MAX -400
+#endif
+
+#ifndef M_HUGEPAGES_SIZE_MAX
+#define M_HUGEPAGES_SIZE_MAX -401
+#endif
+
 #endif // SCUDO_WRAPPERS_C_H_
@@ -37,13 +37,18 @@ extern "C" {
 #undef SCUDO_ALLOCATOR
 #undef SCUDO_PREFIX
 
-// The following is the only function that will end up initializing both
+// The following are the only functions that will end up initializing both
 // allocators, which will result in a slight increase in memory footprint.
 INTERFACE void __scudo_print_stats(void) {
   Allocator.printStats();
   SvelteAllocator.printStats();
 }
 
+INTERFACE void __scudo_thread_cache_flush(void) {
+  Allocator.flushThreadCache();
+  SvelteAllocator.flushThreadCache();
+}
+
 } // extern "C"
 
 #endif // SCUDO_ANDROID && _BIONIC